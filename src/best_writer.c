@@ -0,0 +1,137 @@
+/**
+ * best_writer.c
+ *
+ *  Background output of the best table so far.
+ *
+ *  Whenever the best element improves, the optimizer posts its table and
+ *  carries on. Tables no better than one posted before are ignored, so a
+ *  late post from one thread never replaces a better table from another. A writer thread encodes the latest posted table with
+ *  tiny_jpeg. Tables posted while it is encoding replace each other, so the
+ *  writer never falls behind by more than one file and never makes the
+ *  optimizer wait.
+ *
+ *  When the input is a JPEG being re-quantized, files are written from its
+ *  coefficients instead (see jpeg_input.c).
+ *
+ *  Files are written next to the destination and renamed over it, so a
+ *  reader never sees a partial JPEG, even if the process is killed.
+ */
+
+typedef struct
+{
+    const char*             path;
+    char                    tmp_path[1024];
+    int                     width;
+    int                     height;
+    int                     num_components;
+    const unsigned char*    data;
+    const JpegInput*        jpeg_input;  // Written from instead of data, if not NULL.
+
+    // Protected by mutex.
+    SglMutex*               mutex;
+    uint8_t                 pending[64];
+    b32                     has_pending;
+    float                   best_fitness;  // Of the best table posted. FLT_MAX before the first post.
+    b32                     quit;
+    int                     num_written;
+
+    SglSemaphore*           wake_semaphore;
+    SglSemaphore*           done_semaphore;
+} BestWriter;
+
+static void best_writer_thread(void* data)
+{
+    BestWriter* writer = (BestWriter*)data;
+    for ( ;; ) {
+        sgl_semaphore_wait(writer->wake_semaphore);
+
+        uint8_t table[64];
+        sgl_mutex_lock(writer->mutex);
+        b32 has_pending = writer->has_pending;
+        b32 quit = writer->quit;
+        memcpy(table, writer->pending, 64);
+        writer->has_pending = false;
+        sgl_mutex_unlock(writer->mutex);
+
+        if ( has_pending ) {
+            b32 written = false;
+            if ( writer->jpeg_input ) {
+                written = jpeg_input_write(writer->jpeg_input, writer->tmp_path, table);
+            } else {
+                written = tje_encode_to_file_with_qt(writer->tmp_path, table, writer->width, writer->height,
+                                                     writer->num_components, writer->data) != 0;
+            }
+            if ( written &&
+                 evolve_replace_file(writer->tmp_path, writer->path) ) {
+                sgl_mutex_lock(writer->mutex);
+                ++writer->num_written;
+                sgl_mutex_unlock(writer->mutex);
+            } else {
+                sgl_log("Could not write %s\n", writer->path);
+            }
+        }
+        if ( quit ) {
+            break;
+        }
+    }
+    sgl_semaphore_signal(writer->done_semaphore);
+}
+
+void best_writer_start(BestWriter* writer, const char* path,
+                       int width, int height, int num_components, const unsigned char* data,
+                       const JpegInput* jpeg_input)
+{
+    memset(writer, 0, sizeof(BestWriter));
+    writer->path = path;
+    snprintf(writer->tmp_path, sizeof(writer->tmp_path), "%s.tmp", path);
+    writer->width = width;
+    writer->height = height;
+    writer->num_components = num_components;
+    writer->data = data;
+    writer->jpeg_input = jpeg_input;
+    writer->best_fitness = FLT_MAX;
+    writer->mutex = sgl_create_mutex();
+    writer->wake_semaphore = sgl_create_semaphore(0);
+    writer->done_semaphore = sgl_create_semaphore(0);
+    sgl_create_thread(best_writer_thread, writer);
+}
+
+// Queues table to be written, if its fitness is better than that of every
+// table posted before. Returns immediately.
+void best_writer_post(BestWriter* writer, uint8_t* table, float fitness)
+{
+    sgl_mutex_lock(writer->mutex);
+    b32 better = fitness < writer->best_fitness;
+    if ( better ) {
+        writer->best_fitness = fitness;
+        memcpy(writer->pending, table, 64);
+        writer->has_pending = true;
+    }
+    sgl_mutex_unlock(writer->mutex);
+    if ( better ) {
+        sgl_semaphore_signal(writer->wake_semaphore);
+    }
+}
+
+// Writes table unless a better one was posted, then stops the writer thread.
+// Waits until the file is in place. A fitness of -FLT_MAX always writes table.
+void best_writer_finish(BestWriter* writer, uint8_t* table, float fitness)
+{
+    sgl_mutex_lock(writer->mutex);
+    if ( fitness < writer->best_fitness ) {
+        writer->best_fitness = fitness;
+        memcpy(writer->pending, table, 64);
+        writer->has_pending = true;
+    } else if ( fitness > writer->best_fitness ) {
+        sgl_log("Keeping the posted table in %s. It is better than the final one (%f vs %f).\n",
+                writer->path, writer->best_fitness, fitness);
+    }
+    writer->quit = true;
+    sgl_mutex_unlock(writer->mutex);
+    sgl_semaphore_signal(writer->wake_semaphore);
+    sgl_semaphore_wait(writer->done_semaphore);
+    sgl_destroy_mutex(writer->mutex);
+    sgl_destroy_semaphore(writer->wake_semaphore);
+    sgl_destroy_semaphore(writer->done_semaphore);
+    sgl_log("Wrote %s %d times.\n", writer->path, writer->num_written);
+}
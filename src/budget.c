@@ -0,0 +1,179 @@
+/**
+ * budget.c
+ *
+ *  Byte budget mode: best quality under a given file size.
+ *
+ *  The fitness becomes the error ratio, plus a penalty for tables whose
+ *  estimated size is over budget. The estimator does not count DC, chroma
+ *  or headers, so its budget comes from the real encoder in extended_jpeg.c:
+ *
+ *   1. Bisect a global scale of the standard luma table with the estimator,
+ *      for the largest table that fits the estimated budget.
+ *   2. Encode that table with tiny_jpeg and correct the estimated budget
+ *      from its real size. Repeat a few times.
+ *   3. Seed the optimizer with the scaled table and evolve as usual.
+ *   4. Encode the winner with tiny_jpeg. Scale it up until it fits.
+ */
+
+typedef struct
+{
+    uint32_t    max_bytes;  // 0 means "don't use the budget mode"
+    int         max_calibrations;
+    int         max_bisections;
+} BudgetParams;
+
+typedef struct
+{
+    BudgetParams            params;
+    FitnessContext*         fitness_ctx;
+
+    int                     width;
+    int                     height;
+    int                     num_components;
+    const unsigned char*    data;
+
+    uint8_t                 base_table[64];  // Scaled table the search starts from.
+    float                   correction;      // Real bytes per estimated byte of base_table.
+} Budget;
+
+// Table K.1 of the JPEG spec, in natural order.
+static const uint8_t budget_spec_luma[64] =
+{
+    16,11,10,16, 24, 40, 51, 61,
+    12,12,14,19, 26, 58, 60, 55,
+    14,13,16,24, 40, 57, 69, 56,
+    14,17,22,29, 51, 87, 80, 62,
+    18,22,37,56, 68,109,103, 77,
+    24,35,55,64, 81,104,113, 92,
+    49,64,78,87,103,121,120,101,
+    72,92,95,98,112,100,103, 99,
+};
+
+BudgetParams budget_default_params()
+{
+    BudgetParams params = {0};
+    params.max_bytes = 0;
+    params.max_calibrations = 4;
+    params.max_bisections = 16;
+    return params;
+}
+
+// Tables are in zig-zag order, like the ones tiny_jpeg writes.
+static void budget_scaled_table(float scale, uint8_t* table)
+{
+    for ( int i = 0; i < 64; ++i ) {
+        int q = (int)(budget_spec_luma[i] * scale + 0.5f);
+        table[djei_zig_zag[i]] = (uint8_t)((q < 1) ? 1 : ((q > 255) ? 255 : q));
+    }
+}
+
+static uint64_t budget_estimated_bits(Budget* budget, Arena* arena, uint8_t* table)
+{
+    EvalResult result;
+    evaluate_fitness(budget->fitness_ctx, arena, table, &result);
+    return result.bit_count;
+}
+
+// Smallest scale whose estimated size fits in budget_bits, as a table.
+static void budget_bisect(Budget* budget, Arena* arena, uint64_t budget_bits, uint8_t* table)
+{
+    // In log scale. Every entry is 1 at the bottom and 255 at the top.
+    float lo = logf(1.0f / 16.0f);
+    float hi = logf(255.0f);
+    budget_scaled_table(expf(hi), table);
+    if ( budget_estimated_bits(budget, arena, table) > budget_bits ) {
+        return;  // Nothing fits. Use the coarsest table.
+    }
+    for ( int i = 0; i < budget->params.max_bisections; ++i ) {
+        float mid = 0.5f * (lo + hi);
+        uint8_t mid_table[64];
+        budget_scaled_table(expf(mid), mid_table);
+        if ( budget_estimated_bits(budget, arena, mid_table) <= budget_bits ) {
+            hi = mid;
+        } else {
+            lo = mid;
+        }
+    }
+    budget_scaled_table(expf(hi), table);
+}
+
+// Finds the scaled table for params->max_bytes and sets the budget of
+// budget->fitness_ctx. The table is left in budget->base_table.
+//
+// Headers make the real size an affine function of the estimated one rather
+// than a multiple of it, so the estimated budget is found with the secant
+// method.
+void budget_calibrate(Budget* budget, Arena* arena)
+{
+    uint64_t begin_us = evolve_time_us();
+    uint32_t max_bytes = budget->params.max_bytes;
+    double target = max_bytes;  // Estimated bytes.
+    double prev_estimated = 0, prev_real = 0;
+    uint64_t estimated = 0;
+    size_t real = 0;
+
+    for ( int i = 0; i < budget->params.max_calibrations; ++i ) {
+        budget_bisect(budget, arena, (uint64_t)(8 * target), budget->base_table);
+
+        estimated = budget_estimated_bits(budget, arena, budget->base_table) / 8;
+        real = tje_encoded_size_with_qt(budget->base_table, budget->width, budget->height,
+                                        budget->num_components, budget->data);
+        sgl_log("Budget: %u bytes. Scaled table: estimated %" PRIu64 ", real %zu bytes.\n",
+                max_bytes, estimated, real);
+        if ( real == 0 || estimated == 0 ) {
+            break;
+        }
+        if ( real <= max_bytes && real >= 0.98 * max_bytes ) {
+            break;
+        }
+        double next = target * max_bytes / real;
+        if ( prev_real != 0 && (double)real != prev_real ) {
+            next = estimated + (max_bytes - (double)real) * (estimated - prev_estimated) / (real - prev_real);
+        }
+        prev_estimated = estimated;
+        prev_real = (double)real;
+        target = (next < 1) ? 1 : next;
+    }
+
+    budget->correction = (estimated > 0) ? (float)real / (float)estimated : 1.0f;
+    // The winner's DC and chroma are not the ones of base_table. Leave 1% for them.
+    double fits = (real > max_bytes) ? (double)max_bytes / real : 1.0;
+    budget->fitness_ctx->budget_bits = (uint64_t)(8 * estimated * fits * 0.99);
+    sgl_log("Budget: calibrated in %" PRIu64 "us. Estimated budget %" PRIu64 " bytes.\n",
+            evolve_time_us() - begin_us, budget->fitness_ctx->budget_bits / 8);
+}
+
+// Makes sure the winner fits in the budget with the real encoder, scaling
+// it up if it doesn't.
+void budget_confirm(Budget* budget, Arena* arena, PopulationElement* winner)
+{
+    uint32_t max_bytes = budget->params.max_bytes;
+    uint8_t* table = winner->table;
+
+    // The estimator does not see DC bits, so the search is free to lower DC.
+    // Keep the DC of the calibrated table.
+    table[0] = budget->base_table[0];
+
+    uint64_t estimated = budget_estimated_bits(budget, arena, table) / 8;
+    size_t real = tje_encoded_size_with_qt(table, budget->width, budget->height,
+                                           budget->num_components, budget->data);
+    sgl_log("Budget: winner estimated %" PRIu64 " bytes (%" PRIu64 " corrected), real %zu bytes. Budget %u.\n",
+            estimated, (uint64_t)(estimated * budget->correction), real, max_bytes);
+
+    for ( int step = 0; real > max_bytes && step < 100; ++step ) {
+        for ( int i = 0; i < 64; ++i ) {
+            int q = (table[i] * 103 + 99) / 100;  // At least +1.
+            table[i] = (uint8_t)((q > 255) ? 255 : q);
+        }
+        real = tje_encoded_size_with_qt(table, budget->width, budget->height,
+                                        budget->num_components, budget->data);
+    }
+    if ( real > max_bytes ) {
+        sgl_log("Budget: %u bytes is not reachable. Smallest file is %zu bytes.\n", max_bytes, real);
+    }
+
+    EvalResult result;
+    winner->fitness = evaluate_fitness(budget->fitness_ctx, arena, table, &result);
+    sgl_log("Budget: final size %zu bytes, error ratio %f\n",
+            real, (float)result.mse / budget->fitness_ctx->optimal_mse);
+}
@@ -0,0 +1,192 @@
+/**
+ * checkpoint.c
+ *
+ *  Snapshots of the generational loop, to resume runs that get killed.
+ *
+ *  A snapshot is a small binary file: a header with the state of the loop,
+ *  then the state of the optimizer. For the GA that is the ranked
+ *  population with its breeding state and the operator rates; for CMA-ES,
+ *  the distribution. The random streams are keyed by (seed, generation,
+ *  index), so the seed and the generation are all the RNG state there is,
+ *  and a resumed run breeds exactly what the original would have.
+ *
+ *  The header also keeps the content hash of the source image, so a resume
+ *  maps the prelude cache (see prelude_cache.c) and never touches the
+ *  source image.
+ *
+ *  The correction factor of -exact is part of the loop state, so an exact
+ *  run also resumes where it left off. The surrogate is not saved. It refits
+ *  from new evaluations after a resume, so a run with -surrogate does not
+ *  follow the uninterrupted one exactly.
+ *
+ *  Files are written to a temporary path and renamed, so a kill during a
+ *  write leaves the previous snapshot intact. They are meant to be read by
+ *  the same build on the same machine, and are rejected otherwise.
+ */
+
+#define CHECKPOINT_MAGIC    0x4b435047  // "GPCK"
+#define CHECKPOINT_VERSION  3
+
+// State of the generational loop in main().
+typedef struct
+{
+    int32_t             generation;  // Generations completed.
+    int32_t             convergence_hits;
+    int64_t             num_evaluations;
+    float               last_winner_fitness;
+    PopulationElement   winner;
+    double              exact_correction;  // Exact.correction. 0 without -exact.
+    int64_t             exact_encodes;     // Exact.num_encodes.
+} LoopState;
+
+typedef struct
+{
+    uint32_t    magic;
+    uint32_t    version;
+    uint32_t    header_size;  // Catches snapshots from builds with a different layout.
+    int32_t     optimizer_kind;
+    int32_t     population_size;
+    uint64_t    seed;
+    uint64_t    image_hash;  // See prelude_hash_file.
+    LoopState   loop;
+} CheckpointHeader;
+
+static b32 checkpoint_fwrite(FILE* fd, void* data, size_t size)
+{
+    return fwrite(data, size, 1, fd) == 1;
+}
+
+static b32 checkpoint_fread(FILE* fd, void* data, size_t size)
+{
+    return fread(data, size, 1, fd) == 1;
+}
+
+// Writes to path + ".tmp" and renames it over path.
+static b32 checkpoint_commit(FILE* fd, const char* path, const char* tmp_path, b32 ok)
+{
+    ok = (fclose(fd) == 0) && ok;
+    if ( ok ) {
+        ok = evolve_replace_file(tmp_path, path);
+    }
+    if ( !ok ) {
+        sgl_log("Could not write %s\n", path);
+        remove(tmp_path);
+    }
+    return ok;
+}
+
+static b32 checkpoint_population(FILE* fd, Population* pop, b32 write)
+{
+    b32 (*io)(FILE*, void*, size_t) = write ? checkpoint_fwrite : checkpoint_fread;
+    int32_t count = pop->count;
+    int32_t num_ranked = pop->num_ranked;
+    b32 ok = io(fd, &count, sizeof(count)) && io(fd, &num_ranked, sizeof(num_ranked));
+    if ( !ok || count > pop->capacity ) {
+        return false;
+    }
+    pop->count = count;
+    pop->num_ranked = num_ranked;
+    return io(fd, pop->tables, 64 * (size_t)count) &&
+           io(fd, pop->fitness, sizeof(float) * count) &&
+           io(fd, pop->order, sizeof(int) * count) &&
+           io(fd, pop->steps, 64 * (size_t)count) &&
+           io(fd, pop->op, count) &&
+           io(fd, pop->parent_fitness, sizeof(float) * count);
+}
+
+static b32 checkpoint_optimizer(FILE* fd, Optimizer* opt, b32 write)
+{
+    b32 (*io)(FILE*, void*, size_t) = write ? checkpoint_fwrite : checkpoint_fread;
+    switch ( opt->kind ) {
+    case OptimizerKind_GA: {
+        GAOptimizer* ga = &opt->ga;
+        return io(fd, &ga->generation, sizeof(ga->generation)) &&
+               io(fd, &ga->rates, sizeof(ga->rates)) &&
+               checkpoint_population(fd, ga->population, write);
+    }
+    case OptimizerKind_CMAES: {
+        CMAES* es = &opt->cmaes;
+        return io(fd, &es->generation, sizeof(es->generation)) &&
+               io(fd, &es->sigma, sizeof(es->sigma)) &&
+               io(fd, es->mean, sizeof(es->mean)) &&
+               io(fd, es->pc, sizeof(es->pc)) &&
+               io(fd, es->ps, sizeof(es->ps)) &&
+               io(fd, es->C, sizeof(es->C));
+    }
+    }
+    return false;
+}
+
+// Snapshots loop and opt. The optimizer must be between optimizer_tell and
+// the next optimizer_ask.
+b32 checkpoint_write(const char* path, LoopState* loop, Optimizer* opt, int population_size,
+                     uint64_t seed, uint64_t image_hash)
+{
+    char tmp_path[1024];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    FILE* fd = fopen(tmp_path, "wb");
+    if ( !fd ) {
+        sgl_log("Could not open %s for writing.\n", tmp_path);
+        return false;
+    }
+    CheckpointHeader header = {0};
+    header.magic = CHECKPOINT_MAGIC;
+    header.version = CHECKPOINT_VERSION;
+    header.header_size = sizeof(CheckpointHeader);
+    header.optimizer_kind = opt->kind;
+    header.population_size = population_size;
+    header.seed = seed;
+    header.image_hash = image_hash;
+    header.loop = *loop;
+    b32 ok = checkpoint_fwrite(fd, &header, sizeof(header)) && checkpoint_optimizer(fd, opt, true);
+    return checkpoint_commit(fd, path, tmp_path, ok);
+}
+
+// Reads the seed and the image hash of a snapshot, which are needed before
+// the optimizer exists.
+b32 checkpoint_read_header(const char* path, uint64_t* seed, uint64_t* image_hash)
+{
+    FILE* fd = fopen(path, "rb");
+    if ( !fd ) {
+        return false;
+    }
+    CheckpointHeader header = {0};
+    b32 ok = checkpoint_fread(fd, &header, sizeof(header)) &&
+            header.magic == CHECKPOINT_MAGIC && header.version == CHECKPOINT_VERSION &&
+            header.header_size == sizeof(CheckpointHeader);
+    fclose(fd);
+    if ( ok ) {
+        *seed = header.seed;
+        *image_hash = header.image_hash;
+    }
+    return ok;
+}
+
+// Restores loop and opt. opt must have been through optimizer_init with the
+// same kind and population size as the run that wrote the snapshot.
+b32 checkpoint_read(const char* path, LoopState* loop, Optimizer* opt, int population_size)
+{
+    FILE* fd = fopen(path, "rb");
+    if ( !fd ) {
+        sgl_log("Could not open %s\n", path);
+        return false;
+    }
+    CheckpointHeader header = {0};
+    b32 ok = checkpoint_fread(fd, &header, sizeof(header));
+    if ( ok && (header.magic != CHECKPOINT_MAGIC || header.version != CHECKPOINT_VERSION ||
+                header.header_size != sizeof(CheckpointHeader)) ) {
+        sgl_log("%s is not a snapshot from this version.\n", path);
+        ok = false;
+    }
+    if ( ok && (header.optimizer_kind != (int32_t)opt->kind ||
+                header.population_size != population_size) ) {
+        sgl_log("%s was written with a different optimizer or population size.\n", path);
+        ok = false;
+    }
+    ok = ok && checkpoint_optimizer(fd, opt, false);
+    fclose(fd);
+    if ( ok ) {
+        *loop = header.loop;
+    }
+    return ok;
+}
@@ -0,0 +1,232 @@
+/**
+ * cmaes.c
+ *
+ *  CMA-ES over the logs of the 64 table entries.
+ *
+ *  Samples are real vectors x, evaluated as the table round(exp(x)). Everything
+ *  else follows the usual (mu/mu_w, lambda) CMA-ES with rank-one and rank-mu
+ *  updates and cumulative step size adaptation. Instead of an
+ *  eigendecomposition, C is factored as L L' every generation, and samples
+ *  are x = mean + sigma * L z.
+ *
+ *  Samples are clamped to [log 1, log 255] before the update. Otherwise the
+ *  mean walks out of the range where the table changes, and the step size
+ *  grows without bound. Because of that, the step size path uses the actual
+ *  shift of the mean, L^-1 (mean' - mean) / sigma, instead of the z's.
+ */
+
+#define CMAES_DIM 64
+
+typedef struct
+{
+    int         lambda;  // Samples per generation.
+    int         mu;      // Parents per generation.
+    double*     weights; // [mu]
+    double      mueff;
+    double      cc, cs, c1, cmu, damps, chi_n;
+
+    double      sigma;
+    double      mean[CMAES_DIM];
+    double      pc[CMAES_DIM];
+    double      ps[CMAES_DIM];
+    double      C[CMAES_DIM * CMAES_DIM];
+    double      L[CMAES_DIM * CMAES_DIM];  // Lower triangular. C = L L'
+
+    double      (*x)[CMAES_DIM];  // [lambda] Samples of the current generation, clamped.
+
+    Population  population;  // Tables of the current generation, in the same order as x.
+    uint64_t    seed;
+    int         generation;
+} CMAES;
+
+static double cmaes_uniform(GARng* rng)
+{
+    return ((double)ga_rand(rng) + 0.5) / 2147483648.0;
+}
+
+// Box-Muller. Wastes the second value, but sampling is nowhere near the cost
+// of an evaluation.
+static double cmaes_gaussian(GARng* rng)
+{
+    double u = cmaes_uniform(rng);
+    double v = cmaes_uniform(rng);
+    return sqrt(-2.0 * log(u)) * cos(6.283185307179586 * v);
+}
+
+// Returns false if C is not positive definite.
+static b32 cmaes_factor(CMAES* es)
+{
+    double* C = es->C;
+    double* L = es->L;
+    memset(L, 0, sizeof(es->L));
+    for ( int j = 0; j < CMAES_DIM; ++j ) {
+        for ( int i = j; i < CMAES_DIM; ++i ) {
+            double sum = C[i * CMAES_DIM + j];
+            for ( int k = 0; k < j; ++k ) {
+                sum -= L[i * CMAES_DIM + k] * L[j * CMAES_DIM + k];
+            }
+            if ( i == j ) {
+                if ( sum <= 0.0 ) {
+                    return false;
+                }
+                L[j * CMAES_DIM + j] = sqrt(sum);
+            } else {
+                L[i * CMAES_DIM + j] = sum / L[j * CMAES_DIM + j];
+            }
+        }
+    }
+    return true;
+}
+
+void cmaes_init(CMAES* es, Arena* arena, int lambda, uint64_t seed)
+{
+    memset(es, 0, sizeof(CMAES));
+    int n = CMAES_DIM;
+
+    es->lambda = lambda;
+    es->mu = lambda / 2;
+    es->weights = arena_alloc_array(arena, es->mu, double);
+    double sum = 0, sum_sq = 0;
+    for ( int i = 0; i < es->mu; ++i ) {
+        es->weights[i] = log(es->mu + 0.5) - log(i + 1.0);
+        sum += es->weights[i];
+    }
+    for ( int i = 0; i < es->mu; ++i ) {
+        es->weights[i] /= sum;
+        sum_sq += es->weights[i] * es->weights[i];
+    }
+    es->mueff = 1.0 / sum_sq;
+
+    es->cc    = (4.0 + es->mueff / n) / (n + 4.0 + 2.0 * es->mueff / n);
+    es->cs    = (es->mueff + 2.0) / (n + es->mueff + 5.0);
+    es->c1    = 2.0 / ((n + 1.3) * (n + 1.3) + es->mueff);
+    es->cmu   = 2.0 * (es->mueff - 2.0 + 1.0 / es->mueff) / ((n + 2.0) * (n + 2.0) + es->mueff);
+    if ( es->cmu > 1.0 - es->c1 ) {
+        es->cmu = 1.0 - es->c1;
+    }
+    es->damps = 1.0 + es->cs + 2.0 * fmax(0.0, sqrt((es->mueff - 1.0) / (n + 1.0)) - 1.0);
+    es->chi_n = sqrt((double)n) * (1.0 - 1.0 / (4.0 * n) + 1.0 / (21.0 * n * n));
+
+    // Start in the middle of the range that fill_initial_population uses.
+    for ( int i = 0; i < n; ++i ) {
+        es->mean[i] = log(8.0);
+        es->C[i * n + i] = 1.0;
+    }
+    es->mean[0] = 0.0;
+    es->sigma = 0.5;
+
+    es->x = (double(*)[CMAES_DIM])arena_alloc_array(arena, lambda * CMAES_DIM, double);
+    es->population = population_init(arena, lambda);
+    es->seed = seed;
+}
+
+// Samples a new generation into es->population.
+Population* cmaes_ask(CMAES* es)
+{
+    if ( !cmaes_factor(es) ) {
+        // Numerical trouble. Start over from the current mean.
+        sgl_log("CMA-ES: covariance is not positive definite. Resetting it.\n");
+        memset(es->C, 0, sizeof(es->C));
+        memset(es->pc, 0, sizeof(es->pc));
+        for ( int i = 0; i < CMAES_DIM; ++i ) {
+            es->C[i * CMAES_DIM + i] = 1.0;
+        }
+        cmaes_factor(es);
+    }
+
+    double max_x = log(255.0);
+    Population* pop = &es->population;
+    pop->count = 0;
+    for ( int k = 0; k < es->lambda; ++k ) {
+        GARng rng = ga_rng_key(es->seed, (uint32_t)es->generation, (uint32_t)k);
+        double z[CMAES_DIM];
+        double* x = es->x[k];
+        for ( int i = 0; i < CMAES_DIM; ++i ) {
+            z[i] = cmaes_gaussian(&rng);
+        }
+        uint8_t table[64];
+        for ( int i = 0; i < CMAES_DIM; ++i ) {
+            double lz = 0;
+            for ( int j = 0; j <= i; ++j ) {
+                lz += es->L[i * CMAES_DIM + j] * z[j];
+            }
+            double v = es->mean[i] + es->sigma * lz;
+            v = (v < 0.0) ? 0.0 : ((v > max_x) ? max_x : v);
+            x[i] = v;
+            int q = (int)(exp(v) + 0.5);
+            table[i] = (uint8_t)((q < 1) ? 1 : ((q > 255) ? 255 : q));
+        }
+        population_push(pop, table, FLT_MAX);
+    }
+    return pop;
+}
+
+// Updates the distribution. es->population must have been evaluated.
+// Leaves it ranked.
+void cmaes_tell(CMAES* es)
+{
+    int n = CMAES_DIM;
+    Population* pop = &es->population;
+    population_rank(pop, es->mu, 1);
+
+    double old_mean[CMAES_DIM];
+    memcpy(old_mean, es->mean, sizeof(old_mean));
+    memset(es->mean, 0, sizeof(es->mean));
+    for ( int r = 0; r < es->mu; ++r ) {
+        int k = pop->order[r];
+        for ( int i = 0; i < n; ++i ) {
+            es->mean[i] += es->weights[r] * es->x[k][i];
+        }
+    }
+
+    // zw = L^-1 (mean - old_mean) / sigma
+    double zw[CMAES_DIM];
+    for ( int i = 0; i < n; ++i ) {
+        double sum = (es->mean[i] - old_mean[i]) / es->sigma;
+        for ( int k = 0; k < i; ++k ) {
+            sum -= es->L[i * n + k] * zw[k];
+        }
+        zw[i] = sum / es->L[i * n + i];
+    }
+
+    // Step size path.
+    double ps_norm = 0;
+    double cs_factor = sqrt(es->cs * (2.0 - es->cs) * es->mueff);
+    for ( int i = 0; i < n; ++i ) {
+        es->ps[i] = (1.0 - es->cs) * es->ps[i] + cs_factor * zw[i];
+        ps_norm += es->ps[i] * es->ps[i];
+    }
+    ps_norm = sqrt(ps_norm);
+
+    ++es->generation;
+    double ps_expected = sqrt(1.0 - pow(1.0 - es->cs, 2.0 * es->generation)) * es->chi_n;
+    int hsig = ps_norm / ps_expected < 1.4 + 2.0 / (n + 1.0);
+
+    // Covariance path.
+    double cc_factor = sqrt(es->cc * (2.0 - es->cc) * es->mueff);
+    for ( int i = 0; i < n; ++i ) {
+        es->pc[i] = (1.0 - es->cc) * es->pc[i] +
+                hsig * cc_factor * (es->mean[i] - old_mean[i]) / es->sigma;
+    }
+
+    // Rank-one and rank-mu updates.
+    double c1a = es->c1 * (1.0 - (1 - hsig) * es->cc * (2.0 - es->cc));
+    double decay = 1.0 - c1a - es->cmu;
+    for ( int i = 0; i < n; ++i ) {
+        for ( int j = 0; j <= i; ++j ) {
+            double rank_mu = 0;
+            for ( int r = 0; r < es->mu; ++r ) {
+                int k = pop->order[r];
+                rank_mu += es->weights[r] *
+                        (es->x[k][i] - old_mean[i]) * (es->x[k][j] - old_mean[j]);
+            }
+            rank_mu /= es->sigma * es->sigma;
+            double c = decay * es->C[i * n + j] + es->c1 * es->pc[i] * es->pc[j] +
+                    es->cmu * rank_mu;
+            es->C[i * n + j] = c;
+            es->C[j * n + i] = c;
+        }
+    }
+
+    es->sigma *= exp((es->cs / es->damps) * (ps_norm / es->chi_n - 1.0));
+}
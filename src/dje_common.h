@@ -10,10 +10,22 @@
 #define __constant
 #endif
 
+// Luma samples of one 8x8 block, 0 to 255, in natural order. Exactly one
+// cache line. The -128 level shift is done in registers when a block is
+// loaded for the DCT.
 typedef struct DJEBlock_s {
-    float d[64];
+    uint8_t d[64];
 } DJEBlock;
 
+// DCT coefficients of one block, in natural order.
+typedef struct DJEDCTBlock_s {
+    float d[64];
+} DJEDCTBlock;
+
+// Work-group size of the OpenCL kernels. Each group adds up the results of
+// this many blocks before anything is written to global memory.
+#define DJE_GPU_GROUP_SIZE 64
+
 // Zig-zag order:
 __constant uint8_t djei_zig_zag[64] = {
    0,   1,  5,  6, 14, 15, 27, 28,
@@ -24,6 +24,19 @@ typedef struct DJEProcessedQT_s {
     float luma[64];
 } DJEProcessedQT;
 
+// Where the samples of an image are, so that any uncompressed layout can be
+// read in place. Sample c (R, G, B) of pixel (x, y) is at
+//   pixels[y * row_stride + x * pixel_stride + channel_offset[c]]
+// row_stride is negative for bottom-up images.
+typedef struct DJEImage_s {
+    const unsigned char*    pixels;  // Pixel (0, 0). NULL to skip block extraction.
+    int                     width;
+    int                     height;
+    ptrdiff_t               row_stride;
+    int                     pixel_stride;
+    ptrdiff_t               channel_offset[3];
+} DJEImage;
+
 typedef struct DJEState_s {
     uint8_t     ehuffsize[4][257];
     uint16_t    ehuffcode[4][256];
@@ -38,10 +51,11 @@ typedef struct DJEState_s {
     Arena*          arena;
     DJEProcessedQT  pqt;
     DJEBlock*       y_blocks;
-    int             num_blocks;
+    int             num_blocks;  // At most 2^26: the header limits each side to 0xffff.
+    DJEDCTBlock*    dct_blocks;  // DCT of y_blocks. Set by dje_delta_prepare or from a prelude cache.
 
     // Result stuff
-    uint32_t    bit_count;  // Instead of writing, we increase this value.
+    uint64_t    bit_count;  // Instead of writing, we increase this value.
     uint64_t    mse;        // Mean square error.
 } DJEState;
 
@@ -429,53 +443,37 @@ float slow_fdct(int u, int v, float* data)
 
 #define ABS(x) ((x) < 0 ? -(x) : (x))
 
-static void djei_encode_and_write_MCU(int block_i,
-                                      DJEBlock* mcu_array,
-                                      uint32_t* bitcount_array,
-                                      uint64_t* out_mse,
 #if DJE_USE_FAST_DCT
-                                      float* qt,  // Pre-processed quantization matrix.
-#else
-                                      uint8_t* qt,
-#endif
-                                      // Huffman tables
-                                      uint8_t* huff_ac_len, uint16_t* huff_ac_code)
+// Quantizes one coefficient of the output of fdct. qt_i is the pre-processed
+// quantization value.
+DJEI_FORCE_INLINE int16_t djei_quantize(float dct_i, float qt_i)
 {
-    DJE_UNUSED(huff_ac_code);
-    float* mcu = mcu_array[block_i].d;
-    int16_t du[64];  // Data unit in zig-zag order
-
-    float dct_mcu[64];
-    memcpy(dct_mcu, mcu, 64 * sizeof(float));
-
-#if DJE_USE_FAST_DCT
-    fdct(dct_mcu);
-    for ( int i = 0; i < 64; ++i ) {
-        float fval = dct_mcu[i];
-        fval *= qt[i];
-        assert(fval >= -1024 && fval < 1024.0f);
+    float fval = dct_i;
+    fval *= qt_i;
+    assert(fval >= -1024 && fval < 1024.0f);
 #if 0
-        fval = (fval > 0) ? floorf(fval + 0.5f) : ceilf(fval - 0.5f);
+    fval = (fval > 0) ? floorf(fval + 0.5f) : ceilf(fval - 0.5f);
 #else
-        fval = floorf(fval + 1024 + 0.5f);
-        fval -= 1024;
+    fval = floorf(fval + 1024 + 0.5f);
+    fval -= 1024;
 #endif
-        int16_t val = (int16_t)fval;
-        du[djei_zig_zag[i]] = val;
-    }
-#else
-    for ( int v = 0; v < 8; ++v ) {
-        for ( int u = 0; u < 8; ++u ) {
-            dct_mcu[v * 8 + u] = slow_fdct(u, v, mcu);
-        }
-    }
-    for ( int i = 0; i < 64; ++i ) {
-        float fval = dct_mcu[i] / (qt[i]);
-        int16_t val = (int16_t)((fval > 0) ? floorf(fval + 0.5f) : ceilf(fval - 0.5f));
-        du[djei_zig_zag[i]] = val;
-    }
+    return (int16_t)fval;
+}
 #endif
 
+// Level-shifted samples of block, as the DCT wants them.
+static void dje_block_load(float* out, DJEBlock* block)
+{
+    for (int i = 0; i < 64; ++i) {
+        out[i] = (float)block->d[i] - 128;
+    }
+}
+
+// Size and error of one block, given its quantized coefficients du, in zig-zag order.
+static void djei_block_cost(int16_t* du, uint8_t* samples,
+                            uint8_t* huff_ac_len,
+                            uint32_t* out_bits, uint64_t* out_mse)
+{
     uint8_t decomp[64];
     float re[64];  // Reconstructed image =)
 
@@ -488,14 +486,13 @@ static void djei_encode_and_write_MCU(int block_i,
 
     for ( int i = 0; i < 64; ++i ) {
         int32_t re_i = (int32_t)(re[i]);
-        int32_t mcu_i = (int32_t)(mcu[i] + 128);
-        int32_t err = ABS(re_i - mcu_i);
+        int32_t err = ABS(re_i - (int32_t)samples[i]);
         MSE += err;
     }
 
-    out_mse[block_i] = MSE;
-
+    *out_mse = MSE;
 
+    uint32_t bits = 0;
     uint16_t vli[2];
 
 #if 0
@@ -549,7 +546,7 @@ static void djei_encode_and_write_MCU(int block_i,
             if (zero_count == 16) {
                 // encode (ff,00) == 0xf0
                 //djei_write_bits(state, bitbuffer, location, huff_ac_len[0xf0], huff_ac_code[0xf0]);
-                bitcount_array[block_i] += huff_ac_len[0xf0];
+                bits += huff_ac_len[0xf0];
                 zero_count = 0;
             }
         }
@@ -571,18 +568,63 @@ static void djei_encode_and_write_MCU(int block_i,
 
         // Write symbol 1  --- (RUNLENGTH, SIZE)
         //djei_write_bits(state, bitbuffer, location, huff_ac_len[sym1], huff_ac_code[sym1]);
-        bitcount_array[block_i] += huff_ac_len[sym1];
+        bits += huff_ac_len[sym1];
         // Write symbol 2  --- (AMPLITUDE)
         //djei_write_bits(state, bitbuffer, location, vli[1], vli[0]);
-        bitcount_array[block_i] += vli[1];
+        bits += vli[1];
     }
 
     if (last_non_zero_i != 63) {
         // write EOB HUFF(00,00)
         //djei_write_bits(state, bitbuffer, location, huff_ac_len[0], huff_ac_code[0]);
-        bitcount_array[block_i] += huff_ac_len[0];
+        bits += huff_ac_len[0];
+    }
+    *out_bits = bits;
+}
+
+static void djei_encode_and_write_MCU(int block_i,
+                                      DJEBlock* mcu_array,
+                                      DJEDCTBlock* dct_array,  // DCT of mcu_array, or NULL to compute it.
+                                      uint32_t* out_bits,  // Of this block.
+                                      uint64_t* out_mse,   // Of this block.
+#if DJE_USE_FAST_DCT
+                                      float* qt,  // Pre-processed quantization matrix.
+#else
+                                      uint8_t* qt,
+#endif
+                                      // Huffman tables
+                                      uint8_t* huff_ac_len, uint16_t* huff_ac_code)
+{
+    DJE_UNUSED(huff_ac_code);
+    uint8_t* mcu = mcu_array[block_i].d;
+    int16_t du[64];  // Data unit in zig-zag order
+
+    float dct_mcu[64];
+
+#if DJE_USE_FAST_DCT
+    if (dct_array) {
+        memcpy(dct_mcu, dct_array[block_i].d, 64 * sizeof(float));
+    } else {
+        dje_block_load(dct_mcu, &mcu_array[block_i]);
+        fdct(dct_mcu);
+    }
+    for ( int i = 0; i < 64; ++i ) {
+        du[djei_zig_zag[i]] = djei_quantize(dct_mcu[i], qt[i]);
+    }
+#else
+    for ( int v = 0; v < 8; ++v ) {
+        for ( int u = 0; u < 8; ++u ) {
+            dct_mcu[v * 8 + u] = slow_fdct(u, v, mcu);
+        }
     }
-    return;
+    for ( int i = 0; i < 64; ++i ) {
+        float fval = dct_mcu[i] / (qt[i]);
+        int16_t val = (int16_t)((fval > 0) ? floorf(fval + 0.5f) : ceilf(fval - 0.5f));
+        du[djei_zig_zag[i]] = val;
+    }
+#endif
+
+    djei_block_cost(du, mcu, huff_ac_len, out_bits, out_mse);
 }
 
 enum {
@@ -634,15 +676,132 @@ static void djei_huff_expand (DJEState* state)
     }
 }
 
-static int djei_encode_prelude(DJEState* state,
-                               const unsigned char* src_data,
-                               const int width,
-                               const int height,
-                               const int src_num_components)
+#define DJEI_MAX_PRELUDE_BANDS 64
+
+// A range of block rows for one thread of the prelude.
+typedef struct DJEPreludeBand_s {
+    const DJEImage*         image;
+    DJEBlock*               y_blocks;    // Blocks of block row block_row_origin.
+    int                     block_row_origin;
+    int                     block_row_begin;
+    int                     block_row_end;
+    SglSemaphore*           done_semaphore;
+} DJEPreludeBand;
+
+// Converts row y of image to luma, rounded to 8 bits like libjpeg does.
+// The common pixel strides get plain loops with a constant stride, so that
+// compilers vectorize them.
+static void djei_luma_row(uint8_t* out, const DJEImage* image, int y)
 {
-    if (src_num_components != 3 && src_num_components != 4) {
-        return 0;
+    const unsigned char* row = image->pixels + y * image->row_stride;
+    const unsigned char* r = row + image->channel_offset[0];
+    const unsigned char* g = row + image->channel_offset[1];
+    const unsigned char* b = row + image->channel_offset[2];
+    int width = image->width;
+    switch (image->pixel_stride) {
+    case 1:  // Planar.
+        for (int x = 0; x < width; ++x) {
+            out[x] = (uint8_t)(0.299f * r[x] + 0.587f * g[x] + 0.114f * b[x] + 0.5f);
+        }
+        break;
+    case 3:
+        for (int x = 0; x < width; ++x) {
+            out[x] = (uint8_t)(0.299f * r[3 * x] + 0.587f * g[3 * x] + 0.114f * b[3 * x] + 0.5f);
+        }
+        break;
+    case 4:
+        for (int x = 0; x < width; ++x) {
+            out[x] = (uint8_t)(0.299f * r[4 * x] + 0.587f * g[4 * x] + 0.114f * b[4 * x] + 0.5f);
+        }
+        break;
+    default: {
+        int stride = image->pixel_stride;
+        for (int x = 0; x < width; ++x) {
+            out[x] = (uint8_t)(0.299f * r[stride * x] + 0.587f * g[stride * x] + 0.114f * b[stride * x] + 0.5f);
+        }
+    } break;
+    }
+}
+
+
+// Fills the blocks of the band, one image row at a time. Rows and columns
+// past the edge of the image repeat the last one. That is done once per row
+// (columns) or once per block row (rows), not per pixel.
+static void djei_prelude_band(DJEPreludeBand* band)
+{
+    const DJEImage* image = band->image;
+    int width = image->width;
+    int w_cap = (width + 7) & ~7;
+    int blocks_per_row = w_cap / 8;
+    uint8_t* row = sgl_malloc(w_cap);
+    for (int by = band->block_row_begin; by < band->block_row_end; ++by) {
+        DJEBlock* blocks = band->y_blocks + (size_t)(by - band->block_row_origin) * blocks_per_row;
+        for (int off_y = 0; off_y < 8; ++off_y) {
+            int src_y = by * 8 + off_y;
+            if (src_y >= image->height) {
+                src_y = image->height - 1;
+            }
+            djei_luma_row(row, image, src_y);
+            for (int x = width; x < w_cap; ++x) {
+                row[x] = row[width - 1];
+            }
+            for (int bx = 0; bx < blocks_per_row; ++bx) {
+                memcpy(&blocks[bx].d[off_y * 8], &row[bx * 8], 8);
+            }
+        }
+    }
+    sgl_free(row);
+}
+
+static void djei_prelude_band_thread(void* data)
+{
+    DJEPreludeBand* band = (DJEPreludeBand*)data;
+    djei_prelude_band(band);
+    sgl_semaphore_signal(band->done_semaphore);
+}
+
+// Fills y_blocks with block rows [block_row_begin, block_row_end) of the
+// image, split in bands over up to num_threads threads. y_blocks gets the
+// blocks of block_row_begin first.
+static void dje_extract_blocks(const DJEImage* image,
+                               DJEBlock* y_blocks, int block_row_begin, int block_row_end,
+                               int num_threads, SglSemaphore* done_semaphore)
+{
+    DJEPreludeBand bands[DJEI_MAX_PRELUDE_BANDS];
+    int num_block_rows = block_row_end - block_row_begin;
+    int num_bands = (num_threads < num_block_rows) ? num_threads : num_block_rows;
+    if (num_bands > DJEI_MAX_PRELUDE_BANDS) {
+        num_bands = DJEI_MAX_PRELUDE_BANDS;
+    }
+    if (num_bands < 1) {
+        num_bands = 1;
+    }
+    for (int i = 0; i < num_bands; ++i) {
+        DJEPreludeBand* band = &bands[i];
+        band->image = image;
+        band->y_blocks = y_blocks;
+        band->block_row_origin = block_row_begin;
+        band->block_row_begin = block_row_begin + num_block_rows * i / num_bands;
+        band->block_row_end = block_row_begin + num_block_rows * (i + 1) / num_bands;
+        band->done_semaphore = done_semaphore;
+        if (i + 1 < num_bands) {
+            sgl_create_thread(djei_prelude_band_thread, band);
+        }
     }
+    // The last band runs on this thread.
+    djei_prelude_band(&bands[num_bands - 1]);
+    for (int i = 0; i < num_bands - 1; ++i) {
+        sgl_semaphore_wait(done_semaphore);
+    }
+}
+
+static int djei_encode_prelude(DJEState* state,
+                               const DJEImage* image,
+                               DJEBlock* cached_blocks,
+                               int num_threads)
+{
+    int width = image->width;
+    int height = image->height;
 
     if (width > 0xffff || height > 0xffff) {
         return 0;
@@ -745,96 +904,102 @@ static int djei_encode_prelude(DJEState* state,
     int w_cap = (width % 8 == 0) ? width : (width + (8 - width % 8));
     int h_cap = (height % 8 == 0) ? height : (height + (8 - height % 8));
 
-    int num_blocks = w_cap * h_cap / 64;
+    int num_blocks = (int)((int64_t)w_cap * h_cap / 64);
     state->num_blocks = num_blocks;
 
-    DJEBlock* y_blocks = arena_alloc_array(state->arena, num_blocks, DJEBlock);
-#if 0
-    DJEBlock* u_blocks = arena_alloc_array(state->arena, num_blocks, DJEBlock);
-    DJEBlock* v_blocks = arena_alloc_array(state->arena, num_blocks, DJEBlock);
-#endif
-
-    uint32_t block_i = 0;
-    for ( int y = 0; y < height; y += 8 ) {
-        for ( int x = 0; x < width; x += 8 ) {
-            // Block loop: ====
-            for ( int off_y = 0; off_y < 8; ++off_y ) {
-                for ( int off_x = 0; off_x < 8; ++off_x ) {
-                    int block_index = (off_y * 8 + off_x);
-
-                    int src_index = (((y + off_y) * width) + (x + off_x)) * src_num_components;
-
-                    int col = x + off_x;
-                    int row = y + off_y;
-
-                    if(row >= height) {
-                        src_index -= (width * (row - height + 1)) * src_num_components;
-                    }
-                    if(col >= width) {
-                        src_index -= (col - width + 1) * src_num_components;
-                    }
-                    assert(src_index < width * height * src_num_components);
-
-                    uint8_t r = src_data[src_index + 0];
-                    uint8_t g = src_data[src_index + 1];
-                    uint8_t b = src_data[src_index + 2];
-
-                    float luma = 0.299f   * r + 0.587f    * g + 0.114f    * b - 128;
-
-                    // TODO: measure. This could result in many cache misses in the name of parallelization.
-                    y_blocks[block_i].d[block_index] = luma;
-#if 0
-                    u_blocks[block_i].d[block_index] = cb;
-                    v_blocks[block_i].d[block_index] = cr;
-#endif
-                }
-            }
-            block_i++;
-        }
+    if (cached_blocks) {
+        state->y_blocks = cached_blocks;
+        return 1;
     }
+    if (!image->pixels) {
+        // Tiled mode. The caller extracts blocks a strip at a time.
+        state->y_blocks = NULL;
+        return 1;
+    }
+
+    // Aligned to a cache line, so that no block straddles two.
+    DJEBlock* y_blocks = arena_alloc_array(state->arena, num_blocks + 1, DJEBlock);
+    y_blocks = (DJEBlock*)(((uintptr_t)y_blocks + sizeof(DJEBlock) - 1) & ~(uintptr_t)(sizeof(DJEBlock) - 1));
+    SglSemaphore* done_semaphore = sgl_create_semaphore(0);
+    dje_extract_blocks(image, y_blocks, 0, h_cap / 8, num_threads, done_semaphore);
+    sgl_destroy_semaphore(done_semaphore);
     state->y_blocks = y_blocks;
     return 1;
 }
 
+// Blocks handed out to a worker at a time. Big enough that the queue lock is
+// rare, small enough that workers finish at about the same time.
+#define DJEI_WORK_CHUNK 64
+
 static SglMutex* work_queue_mutex;
-static volatile int32_t work_done;
+static volatile int32_t work_done;      // Blocks handed out to workers.
+static volatile int32_t work_finished;  // Blocks whose results have been added to the totals.
 
 struct global_work_data {
-    uint64_t* mse;
     DJEBlock* y_blocks;
-    uint32_t* bitcount_array;
     DJEState* state;
     uint32_t  num_blocks;
+    // Totals of the current call. Each worker adds its own sums once, when
+    // the queue runs out.
+    uint64_t  mse;
+    uint64_t  bit_count;
 };
 static struct global_work_data* gwd;
 
 void dje_worker_thread(void* data)
 {
     DJE_UNUSED(data);
+    // Sums of the blocks this worker has encoded in the current call.
+    uint64_t mse = 0;
+    uint64_t bit_count = 0;
+    int32_t  count = 0;
     for(;;) {
         sgl_mutex_lock(work_queue_mutex);
-        volatile uint32_t bi =  work_done++;
+        uint32_t begin = (uint32_t)work_done;
+        // Read under the lock. Otherwise a worker that was preempted here
+        // could see the block count of the next call.
+        uint32_t num_blocks = gwd->num_blocks;
+        if (begin < num_blocks) {
+            work_done += DJEI_WORK_CHUNK;
+        } else if (count > 0) {
+            gwd->mse += mse;
+            gwd->bit_count += bit_count;
+            work_finished += count;
+            mse = 0;
+            bit_count = 0;
+            count = 0;
+        }
         sgl_mutex_unlock(work_queue_mutex);
-        if (bi < gwd->num_blocks) {
-            djei_encode_and_write_MCU(bi, gwd->y_blocks, gwd->bitcount_array, gwd->mse,
+        if (begin < num_blocks) {
+            uint32_t end = begin + DJEI_WORK_CHUNK;
+            if (end > num_blocks) {
+                end = num_blocks;
+            }
+            for (uint32_t bi = begin; bi < end; ++bi) {
+                uint32_t block_bits;
+                uint64_t block_mse;
+                djei_encode_and_write_MCU(bi, gwd->y_blocks, gwd->state->dct_blocks,
+                                          &block_bits, &block_mse,
 #if DJE_USE_FAST_DCT
-                                      gwd->state->pqt.luma,
+                                          gwd->state->pqt.luma,
 #else
-                                      gwd->state->qt_luma,
+                                          gwd->state->qt_luma,
 #endif
-                                      // AC was removed from call since we are not "dummy encodeing" dc values
-                                      gwd->state->ehuffsize[LUMA_AC], gwd->state->ehuffcode[LUMA_AC]);
+                                          // AC was removed from call since we are not "dummy encodeing" dc values
+                                          gwd->state->ehuffsize[LUMA_AC], gwd->state->ehuffcode[LUMA_AC]);
+                bit_count += block_bits;
+                mse += block_mse;
+            }
+            count += (int32_t)(end - begin);
         }
     }
 }
 
-static int dje_encode_main(DJEState* state, GPUInfo* gpu_info, uint8_t* qt)
-{
-    memcpy(state->qt_luma, qt, 64);
-    memcpy(state->qt_chroma, qt, 64);
-
 #if DJE_USE_FAST_DCT
-    DJEProcessedQT pqt;
+// Pre-processed quantization value for the coefficient at i (in natural
+// order) when it is quantized with q.
+static float djei_pqt_entry(int i, uint8_t q)
+{
     // Again, taken from classic japanese implementation.
     //
     /* For float AA&N IDCT method, divisors are equal to quantization
@@ -849,179 +1014,500 @@ static int dje_encode_main(DJEState* state, GPUInfo* gpu_info, uint8_t* qt)
         1.0f, 1.387039845f, 1.306562965f, 1.175875602f,
         1.0f, 0.785694958f, 0.541196100f, 0.275899379f
     };
+    int y = i / 8;
+    int x = i % 8;
+    return 1.0f / (8 * aan_scales[x] * aan_scales[y] * q);
+}
+#endif
+
+// Copies qt into the state and builds the AA&N post-processed version of it.
+static void djei_process_qt(DJEState* state, uint8_t* qt)
+{
+    memcpy(state->qt_luma, qt, 64);
+    memcpy(state->qt_chroma, qt, 64);
+
+#if DJE_USE_FAST_DCT
+    DJEProcessedQT pqt;
 
     // build (de)quantization tables
-    for(int y=0; y<8; y++) {
-        for(int x=0; x<8; x++) {
-            int i = y*8 + x;
-            pqt.luma[y*8+x] = 1.0f / (8 * aan_scales[x] * aan_scales[y] * state->qt_luma[djei_zig_zag[i]]);
-            pqt.chroma[y*8+x] = 1.0f / (8 * aan_scales[x] * aan_scales[y] * state->qt_chroma[djei_zig_zag[i]]);
-        }
+    for(int i=0; i<64; i++) {
+        pqt.luma[i] = djei_pqt_entry(i, state->qt_luma[djei_zig_zag[i]]);
+        pqt.chroma[i] = djei_pqt_entry(i, state->qt_chroma[djei_zig_zag[i]]);
     }
 
     state->pqt = pqt;
 
 #endif
+}
 
-    // These will be the kernel parameters
+// Adds the totals of all blocks to the state and writes EOI.
+static void djei_encode_finish(DJEState* state, uint64_t mse, uint64_t bit_count)
+{
+    state->bit_count += bit_count;
+    state->mse = mse;
+
+    uint16_t EOI = djei_be_word(0xffd9);
+    dje_write(state, &EOI, sizeof(uint16_t), 1);
+
+    // If compiled with buffered IO
+    djei_g_output_buffer_count = 0;
+}
+
+// Same as dje_encode_main, but every block is processed on the calling thread
+// and no global state is touched. Safe to call from many threads at once as
+// long as each caller owns state->arena.
+static int dje_encode_serial(DJEState* state, uint8_t* qt)
+{
+    djei_process_qt(state, qt);
+
+    int num_blocks = state->num_blocks;
+    uint64_t mse = 0;
+    uint64_t bit_count = 0;
+    for ( int bi = 0; bi < num_blocks; ++bi ) {
+        uint32_t block_bits;
+        uint64_t block_mse;
+        djei_encode_and_write_MCU(bi, state->y_blocks, state->dct_blocks, &block_bits, &block_mse,
+#if DJE_USE_FAST_DCT
+                                  state->pqt.luma,
+#else
+                                  state->qt_luma,
+#endif
+                                  state->ehuffsize[LUMA_AC], state->ehuffcode[LUMA_AC]);
+        bit_count += block_bits;
+        mse += block_mse;
+    }
 
-    int num_blocks           = state->num_blocks;
-    DJEBlock* y_blocks       = state->y_blocks;
-    uint64_t* mse            = arena_alloc_array(state->arena, num_blocks, uint64_t);
-    uint32_t* bitcount_array = arena_alloc_array(state->arena, num_blocks, uint32_t);
+    djei_encode_finish(state, mse, bit_count);
 
-    if (gpu_info) {
-        cl_int err;
+    return 1;
+}
 
-#define ERR_CHECK if ( err != CL_SUCCESS ) { gpu_handle_cl_error(err); assert(!"kernel argument fail"); }
-#define CHECK_WRAPPER(expr) err=expr; ERR_CHECK;
+#if DJE_USE_FAST_DCT
+// ==== Delta evaluation.
+//
+// Changing one entry of the table changes one coefficient of every block, and
+// most blocks quantize it to the same value as before. A DJEDeltaCache keeps
+// the quantized coefficients, size and error of every block for one table, so
+// that a single-entry change only re-encodes the blocks where that
+// coefficient changes. Results are the same as with dje_encode_main.
+
+typedef struct DJEDeltaCache_s {
+    uint8_t     qt[64];
+    float       pqt[64];
+    int16_t*    du;         // [num_blocks * 64], zig-zag order, like the table.
+    uint32_t*   bitcount;   // [num_blocks]
+    uint64_t*   mse;        // [num_blocks]
+
+    // Same as DJEState::bit_count and DJEState::mse after encoding qt.
+    uint64_t    bit_count;
+    uint64_t    mse_total;
+} DJEDeltaCache;
+
+// Computes the DCT of every block, which doesn't depend on the table. Must be
+// called once, before any other dje_delta_ function. Memory comes from
+// state->arena. Once this is done, CPU encodes of any state copied from this
+// one skip the forward DCT.
+static void dje_delta_prepare(DJEState* state)
+{
+    if (state->dct_blocks) {
+        return;  // Already there. They came from a cache.
+    }
+    state->dct_blocks = arena_alloc_array(state->arena, state->num_blocks, DJEDCTBlock);
+    for ( int bi = 0; bi < state->num_blocks; ++bi ) {
+        dje_block_load(state->dct_blocks[bi].d, &state->y_blocks[bi]);
+        fdct(state->dct_blocks[bi].d);
+    }
+}
+
+// Fully encodes qt into cache. Memory comes from arena.
+static void dje_delta_init(DJEState* state, DJEDeltaCache* cache, Arena* arena, uint8_t* qt)
+{
+    assert(state->dct_blocks);
+    int num_blocks = state->num_blocks;
+    cache->du       = arena_alloc_array(arena, (size_t)num_blocks * 64, int16_t);
+    cache->bitcount = arena_alloc_array(arena, num_blocks, uint32_t);
+    cache->mse      = arena_alloc_array(arena, num_blocks, uint64_t);
+
+    memcpy(cache->qt, qt, 64);
+    for ( int i = 0; i < 64; ++i ) {
+        cache->pqt[i] = djei_pqt_entry(i, qt[djei_zig_zag[i]]);
+    }
+
+    // Headers and EOI, as written by the prelude and djei_encode_finish.
+    cache->bit_count = state->bit_count + 16;
+    cache->mse_total = 0;
+    for ( int bi = 0; bi < num_blocks; ++bi ) {
+        int16_t* du = cache->du + (size_t)bi * 64;
+        float* dct = state->dct_blocks[bi].d;
+        for ( int i = 0; i < 64; ++i ) {
+            du[djei_zig_zag[i]] = djei_quantize(dct[i], cache->pqt[i]);
+        }
+        djei_block_cost(du, state->y_blocks[bi].d, state->ehuffsize[LUMA_AC],
+                        &cache->bitcount[bi], &cache->mse[bi]);
+        cache->bit_count += cache->bitcount[bi];
+        cache->mse_total += cache->mse[bi];
+    }
+}
+
+static void djei_delta_run(DJEState* state, DJEDeltaCache* cache, int index, uint8_t value,
+                           int apply, uint64_t* out_bit_count, uint64_t* out_mse)
+{
+    // The coefficient that table entry index quantizes, in natural order.
+    int ci = 0;
+    while ( djei_zig_zag[ci] != index ) {
+        ++ci;
+    }
+    float pqt = djei_pqt_entry(ci, value);
+
+    int64_t bits = cache->bit_count;
+    int64_t mse  = (int64_t)cache->mse_total;
+    for ( int bi = 0; bi < state->num_blocks; ++bi ) {
+        int16_t* du = cache->du + (size_t)bi * 64;
+        int16_t q = djei_quantize(state->dct_blocks[bi].d[ci], pqt);
+        if ( q == du[index] ) {
+            continue;
+        }
+        int16_t new_du[64];
+        memcpy(new_du, du, sizeof(new_du));
+        new_du[index] = q;
+        uint32_t block_bits;
+        uint64_t block_mse;
+        djei_block_cost(new_du, state->y_blocks[bi].d, state->ehuffsize[LUMA_AC],
+                        &block_bits, &block_mse);
+        bits += (int64_t)block_bits - cache->bitcount[bi];
+        mse  += (int64_t)block_mse - (int64_t)cache->mse[bi];
+        if ( apply ) {
+            du[index] = q;
+            cache->bitcount[bi] = block_bits;
+            cache->mse[bi] = block_mse;
+        }
+    }
+    if ( apply ) {
+        cache->qt[index] = value;
+        cache->pqt[ci] = pqt;
+        cache->bit_count = (uint64_t)bits;
+        cache->mse_total = (uint64_t)mse;
+    }
+    *out_bit_count = (uint64_t)bits;
+    *out_mse = (uint64_t)mse;
+}
 
-        // Write input parameters
-        //  - Huffman data is passed in gpu_setup_buffers
-        //  - pqt is per-kernel call. Pass it now.
-        cl_event write_events[3];
-        CHECK_WRAPPER (clEnqueueWriteBuffer(gpu_info->queue, gpu_info->qt_mem, /*blocking=*/CL_TRUE,
-                                            /*offset=*/0,
-                                            /*cb=*/64*sizeof(float),
-                                            /*ptr=*/pqt.luma,
-                                            /*num_in_wait_list=*/0,
-                                            /*wait_list*/NULL,
-                                            /*event*/&write_events[0]));
-        // Zeroed-out.
-        CHECK_WRAPPER (clEnqueueWriteBuffer(gpu_info->queue, gpu_info->mse_mem, /*blocking=*/CL_TRUE,
-                                            /*offset=*/0,
-                                            /*cb=*/num_blocks*sizeof(uint64_t),
-                                            /*ptr=*/mse,
-                                            /*num_in_wait_list=*/0,
-                                            /*wait_list*/NULL,
-                                            /*event*/&write_events[1]));
-        // Zeroed-out.
-        CHECK_WRAPPER (clEnqueueWriteBuffer(gpu_info->queue, gpu_info->bitcount_array_mem, /*blocking=*/CL_TRUE,
-                                            /*offset=*/0,
-                                            /*cb=*/num_blocks*sizeof(uint32_t),
-                                            /*ptr=*/mse,
-                                            /*num_in_wait_list=*/0,
-                                            /*wait_list*/NULL,
-                                            /*event*/&write_events[2]));
-        clWaitForEvents(sgl_array_count(write_events), write_events);
-
-        // Reset buffers.
-
-        CHECK_WRAPPER(clSetKernelArg(gpu_info->kernel,0,sizeof(cl_mem),&gpu_info->mcu_array_mem));
-        CHECK_WRAPPER(clSetKernelArg(gpu_info->kernel,1,sizeof(cl_mem),&gpu_info->bitcount_array_mem));
-        CHECK_WRAPPER(clSetKernelArg(gpu_info->kernel,2,sizeof(cl_mem),&gpu_info->mse_mem));
-        CHECK_WRAPPER(clSetKernelArg(gpu_info->kernel,3,sizeof(cl_mem),&gpu_info->qt_mem));
-        CHECK_WRAPPER(clSetKernelArg(gpu_info->kernel,4,sizeof(cl_mem),&gpu_info->huffman_len_mem));
-
-        assert(err == CL_SUCCESS);
-
-        size_t global_work_size[1] = { num_blocks };
-        size_t local_work_size[1] = { 32 };
-        cl_event event = {0};
-        CHECK_WRAPPER( clEnqueueNDRangeKernel (gpu_info->queue,
-                                               gpu_info->kernel,
-                                               /*cl_uint work_dim = */1,
-                                               /* const size_t *global_work_offset = */ NULL,
-                                               /* const size_t *global_work_size = */ global_work_size,
-                                               /* const size_t *local_work_size = */ local_work_size,
-                                               /* cl_uint num_events_in_wait_list = */ 0,
-                                               /* const cl_event *event_wait_list = */ NULL,
-                                               /* cl_event *event = */ &event));
-
-        // Wait until the GPU processed the image.
-        clWaitForEvents(1, &event);
-
-        cl_event read_events[2];
-        // Read from GPU memory for the 'reduce' step.
-        clEnqueueReadBuffer(gpu_info->queue, gpu_info->bitcount_array_mem, /*blocking=*/CL_TRUE,
-                            /*offset=*/0, /*size=*/num_blocks*sizeof(uint32_t), bitcount_array, /*event crap*/0,NULL,
-                            &read_events[0]);
-        clEnqueueReadBuffer(gpu_info->queue, gpu_info->mse_mem, /*blocking=*/CL_TRUE,
-                            /*offset=*/0, /*size=*/num_blocks*sizeof(uint64_t), mse, /*event crap*/0,NULL,
-                            &read_events[1]);
-
-        clWaitForEvents(2, read_events);
+// Size and error of the table in cache with entry index set to value. The cache is not modified.
+static void dje_delta_try(DJEState* state, DJEDeltaCache* cache, int index, uint8_t value,
+                          uint64_t* out_bit_count, uint64_t* out_mse)
+{
+    djei_delta_run(state, cache, index, value, false, out_bit_count, out_mse);
+}
 
+// Sets entry index of the table in cache to value.
+static void dje_delta_apply(DJEState* state, DJEDeltaCache* cache, int index, uint8_t value)
+{
+    uint64_t bit_count;
+    uint64_t mse;
+    djei_delta_run(state, cache, index, value, true, &bit_count, &mse);
+}
+#endif  // DJE_USE_FAST_DCT
+
+// A batch of tables in flight on the device. See dje_gpu_launch.
+typedef struct DJEGPUBatch_s {
+    int         count;
+    uint32_t*   bits;  // [count] Bits of the blocks, without headers or EOI.
+    uint64_t*   mse;   // [count]
+    cl_event    upload_event;
+    cl_event    encode_event;
+    cl_event    reduce_event;
+    cl_event    read_events[2];  // bits, mse
+    // With gpu_info->profile, device timestamps in nanoseconds, filled by
+    // the wait: when the upload was queued, when it started and when the
+    // last read ended.
+    uint64_t    queued_ns;
+    uint64_t    begin_ns;
+    uint64_t    end_ns;
+} DJEGPUBatch;
+
+static void dje_start_workers(int num_threads);
+
+static int djei_num_threads;  // Of the worker pool. See dje_init.
+
+// Stops using the device after an error. Later encodes, including those of
+// callers that check gpu_info->failed, run on the CPU worker pool.
+static void djei_gpu_fail(GPUInfo* gpu_info)
+{
+    if ( !gpu_info->failed ) {
+        sgl_log("OpenCL error. Encoding on %d CPU threads from now on.\n", djei_num_threads);
+        gpu_info->failed = true;
+        dje_start_workers(djei_num_threads);
+    }
+}
 
+// Releases the events of batch. Commands that are still queued may use the
+// host memory of the batch, so they are waited for first.
+static void djei_gpu_release(GPUInfo* gpu_info, DJEGPUBatch* batch, int wait)
+{
+    if ( wait ) {
+        clFinish(gpu_info->queue);
+    }
+    cl_event* events[] = {
+        &batch->upload_event,
+        &batch->encode_event,
+        &batch->reduce_event,
+        &batch->read_events[0],
+        &batch->read_events[1],
+    };
+    for ( uint32_t i = 0; i < sgl_array_count(events); ++i ) {
+        if ( *events[i] ) {
+            clReleaseEvent(*events[i]);
+            *events[i] = NULL;
+        }
+    }
+}
+
+// Queues the encode of count tables on the device, in one launch over
+// (block, table), and returns without waiting for it. Results are the same
+// as count calls to dje_encode_main on copies of state once dje_gpu_finish
+// returns. Blocks are added up on the device, so only one (bits, error) pair
+// per table comes back.
+//
+// The tables go to buffer set `set`, so two batches on different sets can be
+// in flight at once: one uploads while the other runs. Every command waits on
+// the one before it through events, which keeps the chain right on an out of
+// order queue. Memory for the tables and results comes from state->arena and
+// must stay until the batch is waited for.
+//
+// Returns 0 after an error, with gpu_info->failed set. Nothing is left in
+// flight then.
+static int dje_gpu_launch(DJEState* state, GPUInfo* gpu_info, int set, uint8_t (*tables)[64], int count,
+                          DJEGPUBatch* batch)
+{
+    memset(batch, 0, sizeof(DJEGPUBatch));
+    batch->count = count;
+    batch->bits = arena_alloc_array(state->arena, count, uint32_t);
+    batch->mse = arena_alloc_array(state->arena, count, uint64_t);
+    float* pqts = arena_alloc_array(state->arena, (size_t)count * 64, float);
+    for ( int ti = 0; ti < count; ++ti ) {
+        djei_process_qt(state, tables[ti]);
+        memcpy(pqts + ti * 64, state->pqt.luma, 64 * sizeof(float));
+    }
+    if ( !gpu_reserve_batch(gpu_info, set, count) ) {
+        sgl_log("Could not allocate OpenCL buffers for %d tables.\n", count);
+        djei_gpu_fail(gpu_info);
+        return 0;
+    }
+    GPUBatchBuffers* buffers = &gpu_info->batch_sets[set];
+
+    cl_int err;
+
+#define ERR_CHECK if ( err != CL_SUCCESS ) { gpu_handle_cl_error(err); goto err; }
+#define CHECK_WRAPPER(expr) err=expr; ERR_CHECK;
+
+    // Nothing is zeroed: every partial sum is written.
+    CHECK_WRAPPER (clEnqueueWriteBuffer(gpu_info->queue, buffers->qt_mem, /*blocking=*/CL_FALSE,
+                                        /*offset=*/0,
+                                        /*cb=*/(size_t)count * 64 * sizeof(float),
+                                        /*ptr=*/pqts,
+                                        /*num_in_wait_list=*/0,
+                                        /*wait_list*/NULL,
+                                        /*event*/&batch->upload_event));
+
+    // Arguments are copied when the kernel is queued, so setting them again
+    // for the next batch does not touch this one.
+    cl_int num_blocks = gpu_info->num_blocks;
+    cl_int num_groups = gpu_info->num_groups;
+    CHECK_WRAPPER(clSetKernelArg(gpu_info->encode_kernel,0,sizeof(cl_mem),&gpu_info->mcu_array_mem));
+    CHECK_WRAPPER(clSetKernelArg(gpu_info->encode_kernel,1,sizeof(cl_int),&num_blocks));
+    CHECK_WRAPPER(clSetKernelArg(gpu_info->encode_kernel,2,sizeof(cl_mem),&buffers->qt_mem));
+    CHECK_WRAPPER(clSetKernelArg(gpu_info->encode_kernel,3,sizeof(cl_mem),&gpu_info->huffman_len_mem));
+    CHECK_WRAPPER(clSetKernelArg(gpu_info->encode_kernel,4,sizeof(cl_mem),&buffers->partial_bits_mem));
+    CHECK_WRAPPER(clSetKernelArg(gpu_info->encode_kernel,5,sizeof(cl_mem),&buffers->partial_mse_mem));
+
+    size_t encode_global_size[2] = { (size_t)num_groups * DJE_GPU_GROUP_SIZE, (size_t)count };
+    size_t encode_local_size[2] = { DJE_GPU_GROUP_SIZE, 1 };
+    CHECK_WRAPPER( clEnqueueNDRangeKernel (gpu_info->queue,
+                                           gpu_info->encode_kernel,
+                                           /*cl_uint work_dim = */2,
+                                           /* const size_t *global_work_offset = */ NULL,
+                                           /* const size_t *global_work_size = */ encode_global_size,
+                                           /* const size_t *local_work_size = */ encode_local_size,
+                                           /* cl_uint num_events_in_wait_list = */ 1,
+                                           /* const cl_event *event_wait_list = */ &batch->upload_event,
+                                           /* cl_event *event = */ &batch->encode_event));
+
+    CHECK_WRAPPER(clSetKernelArg(gpu_info->reduce_kernel,0,sizeof(cl_mem),&buffers->partial_bits_mem));
+    CHECK_WRAPPER(clSetKernelArg(gpu_info->reduce_kernel,1,sizeof(cl_mem),&buffers->partial_mse_mem));
+    CHECK_WRAPPER(clSetKernelArg(gpu_info->reduce_kernel,2,sizeof(cl_int),&num_groups));
+    CHECK_WRAPPER(clSetKernelArg(gpu_info->reduce_kernel,3,sizeof(cl_mem),&buffers->bits_mem));
+    CHECK_WRAPPER(clSetKernelArg(gpu_info->reduce_kernel,4,sizeof(cl_mem),&buffers->mse_mem));
+
+    size_t reduce_global_size[1] = { (size_t)count * DJE_GPU_GROUP_SIZE };
+    size_t reduce_local_size[1] = { DJE_GPU_GROUP_SIZE };
+    CHECK_WRAPPER( clEnqueueNDRangeKernel (gpu_info->queue,
+                                           gpu_info->reduce_kernel,
+                                           1, NULL,
+                                           reduce_global_size,
+                                           reduce_local_size,
+                                           1, &batch->encode_event, &batch->reduce_event));
+
+    CHECK_WRAPPER( clEnqueueReadBuffer(gpu_info->queue, buffers->bits_mem, /*blocking=*/CL_FALSE,
+                                       /*offset=*/0, /*size=*/(size_t)count * sizeof(uint32_t), batch->bits,
+                                       1, &batch->reduce_event, &batch->read_events[0]));
+    CHECK_WRAPPER( clEnqueueReadBuffer(gpu_info->queue, buffers->mse_mem, /*blocking=*/CL_FALSE,
+                                       /*offset=*/0, /*size=*/(size_t)count * sizeof(uint64_t), batch->mse,
+                                       1, &batch->reduce_event, &batch->read_events[1]));
+
+    // Start the device now instead of at the first wait.
+    CHECK_WRAPPER( clFlush(gpu_info->queue) );
+
+    return 1;
+err:
+    djei_gpu_release(gpu_info, batch, /*wait=*/true);
+    djei_gpu_fail(gpu_info);
+    return 0;
 #undef CHECK_WRAPPER
 #undef ERR_CHECK
-    } else {
+}
+
+// Blocks until batch is back in host memory. Returns 0 after an error, with
+// gpu_info->failed set.
+static int djei_gpu_wait(GPUInfo* gpu_info, DJEGPUBatch* batch)
+{
+    cl_int err = clWaitForEvents(sgl_array_count(batch->read_events), batch->read_events);
+    if ( err != CL_SUCCESS ) {
+        gpu_handle_cl_error(err);
+        djei_gpu_release(gpu_info, batch, /*wait=*/true);
+        djei_gpu_fail(gpu_info);
+        return 0;
+    }
+    if ( gpu_info->profile ) {
+        cl_ulong queued = 0, begin = 0, end = 0, end_mse = 0;
+        clGetEventProfilingInfo(batch->upload_event, CL_PROFILING_COMMAND_QUEUED, sizeof(cl_ulong), &queued, NULL);
+        clGetEventProfilingInfo(batch->upload_event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &begin, NULL);
+        clGetEventProfilingInfo(batch->read_events[0], CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &end, NULL);
+        clGetEventProfilingInfo(batch->read_events[1], CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &end_mse, NULL);
+        batch->queued_ns = queued;
+        batch->begin_ns = begin;
+        batch->end_ns = end > end_mse ? end : end_mse;
+    }
+    djei_gpu_release(gpu_info, batch, /*wait=*/false);
+    return 1;
+}
+
+static int dje_encode_main(DJEState* state, GPUInfo* gpu_info, uint8_t* qt)
+{
+    djei_process_qt(state, qt);
+
+    // These will be the kernel parameters
+
+    int num_blocks     = state->num_blocks;
+    DJEBlock* y_blocks = state->y_blocks;
+    uint64_t mse_total = 0;
+    uint64_t bit_total = 0;
+
+    int on_gpu = false;
+    if (gpu_info && !gpu_info->failed) {
+        DJEGPUBatch batch;
+        if ( dje_gpu_launch(state, gpu_info, 0, (uint8_t (*)[64])qt, 1, &batch) &&
+             djei_gpu_wait(gpu_info, &batch) ) {
+            mse_total = batch.mse[0];
+            bit_total = batch.bits[0];
+            on_gpu = true;
+        }
+    }
+    if (!on_gpu) {
 #if DJE_MULTITHREADED
         // Fill work to do and unlock queue
-        gwd->mse = mse;
         gwd->y_blocks = y_blocks;
         gwd->state = state;
-        gwd->bitcount_array = bitcount_array;
+        gwd->mse = 0;
+        gwd->bit_count = 0;
         gwd->num_blocks = num_blocks;
         work_done = 0;
+        work_finished = 0;
 
         sgl_memory_barrier();
 
         sgl_mutex_unlock(work_queue_mutex);
 
+        // Wait until every worker has added its sums, not only until every
+        // block has been handed out.
         for (;;) {
             sgl_mutex_lock(work_queue_mutex);
-            if (work_done >= num_blocks) {
+            if (work_finished >= num_blocks) {
                 break;
             } else {
                 sgl_mutex_unlock(work_queue_mutex);
             }
         }
-        sgl_usleep(1000);
-        // Janky... but time constrainded =( i just want to leave enough time
-        // for the trailing work to finish. I would use a semaphore but I am
-        // running into a weird thread ownership bug which I honestly don't
-        // have time to fix right now.
 
         gwd->num_blocks = 0;
+        mse_total = gwd->mse;
+        bit_total = gwd->bit_count;
 
 #else
         // This loop is ready to be substituted by a single OpenCL kernel call
         for ( int bi = 0; bi < num_blocks; ++bi ) {
-            djei_encode_and_write_MCU(bi, y_blocks, bitcount_array, mse,
+            uint32_t block_bits;
+            uint64_t block_mse;
+            djei_encode_and_write_MCU(bi, y_blocks, state->dct_blocks, &block_bits, &block_mse,
 #if DJE_USE_FAST_DCT
                                       state->pqt.luma,
 #else
                                       state->qt_luma,
 #endif
                                       state->ehuffsize[LUMA_AC], state->ehuffcode[LUMA_AC]);
+            bit_total += block_bits;
+            mse_total += block_mse;
         }
 #endif
     }
-    // "Reduce" step
-    uint64_t mse_accum = 0;
-    uint64_t mse_sum  = 0;
-    for ( int bi = 0; bi < num_blocks; ++bi ) {
-        mse_accum += mse[bi];
+    djei_encode_finish(state, mse_total, bit_total);
 
-        if ( mse_accum >= (uint64_t)num_blocks ) {
-            mse_accum -= (uint64_t)num_blocks;
-            mse_sum += num_blocks;
-        }
+    return 1;
+}
 
-        state->bit_count += bitcount_array[bi];
+// Waits for a batch from dje_gpu_launch and writes the size and error of each
+// table. The buffer set of the batch is free again afterwards. Returns 0 after
+// an error, with gpu_info->failed set, and writes nothing.
+static int dje_gpu_finish(DJEState* state, GPUInfo* gpu_info, DJEGPUBatch* batch,
+                          uint64_t* out_bit_counts, uint64_t* out_mse)
+{
+    if ( !djei_gpu_wait(gpu_info, batch) ) {
+        return 0;
+    }
+    for ( int ti = 0; ti < batch->count; ++ti ) {
+        DJEState table_state = *state;
+        djei_encode_finish(&table_state, batch->mse[ti], batch->bits[ti]);
+        out_bit_counts[ti] = table_state.bit_count;
+        out_mse[ti] = table_state.mse;
     }
-    mse_sum += mse_accum;
-
-    state->mse = mse_sum;
-
-    uint16_t EOI = djei_be_word(0xffd9);
-    dje_write(state, &EOI, sizeof(uint16_t), 1);
-
-    // If compiled with buffered IO
-    djei_g_output_buffer_count = 0;
-
     return 1;
 }
 
 // Define public interface.
 
+// Starts the worker pool that dje_encode_main uses without a GPU. dje_init
+// calls it when there is no GPU, and djei_gpu_fail when the GPU stops
+// working. Only the first call starts threads.
+static void dje_start_workers(int num_threads)
+{
+#if DJE_MULTITHREADED
+    static int started = false;
+    if (started) {
+        return;
+    }
+    started = true;
+    gwd = sgl_calloc(sizeof(struct global_work_data), 1);
+    work_queue_mutex = sgl_create_mutex();
+    sgl_mutex_lock(work_queue_mutex);
+    for (int i = 0 ; i < num_threads; ++i)
+        sgl_create_thread(dje_worker_thread, NULL);
+#endif
+}
+
 DJEState dje_init(Arena* arena,
-                  GPUInfo* gpu_info,
-                  int width,
-                  int height,
-                  int num_components,
-                  unsigned char* src_data)
+                  GPUInfo** gpu_info,  // Released and set to NULL if the image can not be uploaded to the device.
+                  int num_threads,  // Size of the worker pool used by dje_encode_main when there is no GPU, and of the prelude.
+                  const DJEImage* image,  // With NULL pixels, blocks are not extracted (see tiled.c).
+                  DJEBlock* y_blocks)  // Blocks from an earlier run on the same image, or NULL to extract them from image.
 {
     static int called_once = true;
     if (!called_once) {
@@ -1029,39 +1515,37 @@ DJEState dje_init(Arena* arena,
     }
     called_once = false;
 
-#if DJE_MULTITHREADED
-    if (!gpu_info) {
-        gwd = sgl_calloc(sizeof(struct global_work_data), 1);
-        work_queue_mutex = sgl_create_mutex();
-        sgl_mutex_lock(work_queue_mutex);
-        for (int i = 0 ; i < 8; ++i)
-            sgl_create_thread(dje_worker_thread, NULL);
-    }
-#endif
-
     int res = 1;
     DJEState state = { 0 };
 
     state.arena = arena;
+    djei_num_threads = num_threads;
 
     djei_huff_expand(&state);
 
     if (res) {
-        res = djei_encode_prelude(&state, src_data, width, height, num_components);
+        res = djei_encode_prelude(&state, image, y_blocks, num_threads);
 
-        if (res && gpu_info) {
+        if (res && *gpu_info) {
             // Assuming that we have already called gpu_init()
-            gwd = sgl_calloc(sizeof(struct global_work_data), 1);
-
-            res = gpu_setup_buffers(gpu_info,
-                                    state.ehuffsize[LUMA_AC], state.num_blocks,
-                                    state.y_blocks);
+            if (!gpu_setup_buffers(*gpu_info,
+                                   state.ehuffsize[LUMA_AC], state.num_blocks,
+                                   state.y_blocks)) {
+                sgl_log("Could not upload the image to the OpenCL device. Encoding on %d CPU threads.\n",
+                        num_threads);
+                gpu_deinit(*gpu_info);
+                sgl_free(*gpu_info);
+                *gpu_info = NULL;
+            }
         }
 
     }
     if ( !res ) {
         assert (!"prelude failed");
     }
+    if (!*gpu_info) {
+        dje_start_workers(num_threads);
+    }
     return state;
 }
 // ============================================================
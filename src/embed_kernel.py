@@ -0,0 +1,55 @@
+#!/usr/bin/env python3
+#
+# Generates opencl_jpeg_cl.h, the kernel source that gpu.c builds, from
+# opencl_jpeg.cl. Local #includes are pasted in, so the executable needs no
+# file at run time. Run it from the project root whenever the kernel or
+# dje_common.h change, and commit the result:
+#
+#   python3 src/embed_kernel.py
+
+import os
+import re
+
+SRC_DIR = os.path.dirname(os.path.abspath(__file__))
+ROOT_DIR = os.path.dirname(SRC_DIR)
+KERNEL = os.path.join(SRC_DIR, "opencl_jpeg.cl")
+OUTPUT = os.path.join(SRC_DIR, "opencl_jpeg_cl.h")
+
+INCLUDE = re.compile(r'^\s*#include\s+"([^"]+)"')
+
+
+def expand(path, seen):
+    lines = []
+    with open(path, newline="") as f:
+        for line in f.read().splitlines():
+            match = INCLUDE.match(line)
+            if match:
+                # Paths in the kernel are relative to the project root.
+                included = os.path.join(ROOT_DIR, match.group(1))
+                if included not in seen:
+                    seen.add(included)
+                    lines += expand(included, seen)
+            elif line.strip() != "#pragma once":
+                lines.append(line)
+    return lines
+
+
+def main():
+    lines = expand(KERNEL, set())
+    out = [
+        "// Generated by src/embed_kernel.py from src/opencl_jpeg.cl. Do not edit.",
+        "",
+        "#pragma once",
+        "",
+        "static const char gpu_kernel_source[] =",
+    ]
+    for line in lines:
+        escaped = line.replace("\\", "\\\\").replace('"', '\\"').replace("\t", "    ")
+        out.append('    "%s\\n"' % escaped)
+    out[-1] += ";"
+    with open(OUTPUT, "w", newline="\n") as f:
+        f.write("\n".join(out) + "\n")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,166 @@
+/**
+ * exact.c
+ *
+ *  Hybrid evaluation. Every element is scored with the estimator, and the
+ *  best few of every generation are also encoded for real with tiny_jpeg.
+ *
+ *  The estimator skips DC, chroma and headers and uses fixed Huffman
+ *  lengths, so its bit counts drift from the real file size. The real sizes
+ *  of the elites keep a running correction factor (real bytes per estimated
+ *  byte), which is applied to the estimate of everybody else. Elites are
+ *  scored with their real size.
+ *
+ *  Corrected sizes are written back into the results in the units of the
+ *  estimator (as a fraction of the estimated size of the optimal table), so
+ *  fitness_from_result, the surrogate and everything downstream work
+ *  unchanged.
+ */
+
+typedef struct
+{
+    int     num_exact;  // Elements encoded for real per generation. 0 means "off".
+    float   rate;       // Weight of the newest generation in the correction factor.
+} ExactParams;
+
+typedef struct Exact_s Exact;
+
+typedef struct
+{
+    Exact*      exact;
+    uint8_t*    table;
+    size_t      real_bytes;
+} ExactTask;
+
+struct Exact_s
+{
+    ExactParams             params;
+    FitnessContext*         fitness_ctx;
+
+    int                     width;
+    int                     height;
+    int                     num_components;
+    const unsigned char*    data;
+
+    double                  base_real_bytes;  // Real size of the optimal table.
+    double                  correction;       // Real bytes per estimated byte. 0 until the first generation.
+    int64_t                 num_encodes;
+
+    ExactTask*              tasks;  // [num_exact]
+    SglSemaphore*           done_semaphore;
+};
+
+ExactParams exact_default_params()
+{
+    ExactParams params = {0};
+    params.num_exact = 0;
+    params.rate = 0.3f;
+    return params;
+}
+
+void exact_init(Exact* exact, ExactParams* params, Arena* arena, FitnessContext* fitness_ctx,
+                int width, int height, int num_components, const unsigned char* data)
+{
+    memset(exact, 0, sizeof(Exact));
+    exact->params = *params;
+    exact->fitness_ctx = fitness_ctx;
+    exact->width = width;
+    exact->height = height;
+    exact->num_components = num_components;
+    exact->data = data;
+    exact->tasks = arena_alloc_array(arena, params->num_exact, ExactTask);
+    exact->done_semaphore = sgl_create_semaphore(0);
+
+    exact->base_real_bytes = (double)tje_encoded_size_with_qt(optimal_table, width, height,
+                                                              num_components, data);
+    sgl_log("Exact: optimal table is %.0f bytes, estimated %" PRIu64 ".\n",
+            exact->base_real_bytes, fitness_ctx->base_bit_count);
+}
+
+static void exact_thread(void* data)
+{
+    ExactTask* task = (ExactTask*)data;
+    Exact* exact = task->exact;
+    task->real_bytes = tje_encoded_size_with_qt(task->table, exact->width, exact->height,
+                                                exact->num_components, exact->data);
+    sgl_semaphore_signal(exact->done_semaphore);
+}
+
+// Estimator bit count that gives the same compression ratio as real_bytes.
+static uint64_t exact_to_estimator_bits(Exact* exact, double real_bytes)
+{
+    double bits = 8.0 * real_bytes * exact->fitness_ctx->base_bit_count / exact->base_real_bytes;
+    return (uint64_t)bits;
+}
+
+// Encodes the best elements of population for real, updates the correction
+// factor and corrects results and fitness of every element. population must
+// have been through evaluate_population. Leaves it unranked.
+void exact_correct(Exact* exact, Population* population, EvalResult* results)
+{
+    FitnessContext* ctx = exact->fitness_ctx;
+    int num_exact = exact->params.num_exact;
+    if ( num_exact > population->count ) {
+        num_exact = population->count;
+    }
+
+    population_select_best(population, num_exact);
+    for ( int i = 0; i < num_exact; ++i ) {
+        ExactTask* task = &exact->tasks[i];
+        task->exact = exact;
+        task->table = population->tables[population->order[i]];
+        sgl_create_thread(exact_thread, task);
+    }
+    for ( int i = 0; i < num_exact; ++i ) {
+        sgl_semaphore_wait(exact->done_semaphore);
+    }
+    exact->num_encodes += num_exact;
+
+    // ---- Compare with the current correction, then update it.
+    double ratio_sum = 0;
+    double error_sum = 0;
+    int num_valid = 0;
+    for ( int i = 0; i < num_exact; ++i ) {
+        int idx = population->order[i];
+        double estimated = results[idx].bit_count / 8.0;
+        double real = (double)exact->tasks[i].real_bytes;
+        if ( real == 0 || estimated == 0 ) {
+            continue;
+        }
+        if ( exact->correction > 0 ) {
+            error_sum += fabs(estimated * exact->correction - real) / real;
+        }
+        ratio_sum += real / estimated;
+        ++num_valid;
+    }
+    if ( num_valid > 0 ) {
+        double ratio = ratio_sum / num_valid;
+        double previous = exact->correction;
+        double rate = exact->params.rate;
+        exact->correction = (previous > 0) ? (1 - rate) * previous + rate * ratio : ratio;
+        // The num_exact best are first, but in no particular order.
+        int best = 0;
+        for ( int i = 1; i < num_exact; ++i ) {
+            if ( population->fitness[population->order[i]] < population->fitness[population->order[best]] ) {
+                best = i;
+            }
+        }
+        sgl_log("Exact: best estimated %" PRIu64 " bytes, actual %zu. Corrected estimate error %.2f%%. Correction %f\n",
+                results[population->order[best]].bit_count / 8, exact->tasks[best].real_bytes,
+                (previous > 0) ? 100.0 * error_sum / num_valid : 0.0, exact->correction);
+    }
+
+    // ---- Rescore.
+    for ( int i = 0; exact->correction > 0 && i < population->count; ++i ) {
+        double real = results[i].bit_count / 8.0 * exact->correction;
+        results[i].bit_count = exact_to_estimator_bits(exact, real);
+    }
+    for ( int i = 0; i < num_exact; ++i ) {
+        if ( exact->tasks[i].real_bytes > 0 ) {
+            int idx = population->order[i];
+            results[idx].bit_count = exact_to_estimator_bits(exact, (double)exact->tasks[i].real_bytes);
+        }
+    }
+    for ( int i = 0; i < population->count; ++i ) {
+        population->fitness[i] = fitness_from_result(ctx, &results[i]);
+    }
+}
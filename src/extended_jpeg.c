@@ -35,3 +35,38 @@ int tje_encode_to_file_with_qt(const char* dest_path,
 
     return result;
 }
+
+static void tjei_count_func(void* context, void* data, int size)
+{
+    (void)data;
+    *(size_t*)context += (size_t)size;
+}
+
+size_t tje_encoded_size_with_qt(uint8_t* qt,
+                                const int width,
+                                const int height,
+                                const int num_components,
+                                const unsigned char* src_data)
+{
+    size_t size = 0;
+
+    TJEState state = { 0 };
+
+    memcpy(state.qt_luma, qt, 64 * sizeof(uint8_t));
+    memcpy(state.qt_chroma, qt, 64 * sizeof(uint8_t));
+
+    TJEWriteContext wc = { 0 };
+
+    wc.context = &size;
+    wc.func = tjei_count_func;
+
+    state.write_context = wc;
+
+    tjei_huff_expand(&state);
+
+    if (!tjei_encode_main(&state, src_data, width, height, num_components)) {
+        return 0;
+    }
+
+    return size;
+}
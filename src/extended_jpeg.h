@@ -6,3 +6,11 @@ int tje_encode_to_file_with_qt(const char* dest_path,
                                const int height,
                                const int num_components,
                                const unsigned char* src_data);
+
+// Size in bytes of the file tje_encode_to_file_with_qt would write. Nothing
+// is written. Returns 0 on failure.
+size_t tje_encoded_size_with_qt(uint8_t* qt,
+                                const int width,
+                                const int height,
+                                const int num_components,
+                                const unsigned char* src_data);
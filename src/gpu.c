@@ -1,10 +1,5 @@
 #include "gpu.h"
-
-static void gpu_panic()
-{
-    sgl_log("Something went wrong with OpenCL.\n");
-    exit(EXIT_FAILURE);
-}
+#include "opencl_jpeg_cl.h"  // gpu_kernel_source. See embed_kernel.py.
 
 #if 0
 static void CL_CALLBACK gpui_context_notify(const char* errinfo, const void* db, size_t s, void* ud)
@@ -41,6 +36,9 @@ void gpu_handle_cl_error(cl_int err)
     case CL_OUT_OF_RESOURCES:
         sgl_log("%s\n", "CL_OUT_OF_RESOURCES");
         break;
+    case CL_MEM_OBJECT_ALLOCATION_FAILURE:
+        sgl_log("%s\n", "CL_MEM_OBJECT_ALLOCATION_FAILURE");
+        break;
     case CL_OUT_OF_HOST_MEMORY:
         sgl_log("%s\n", "CL_OUT_OF_HOST_MEMORY");
         break;
@@ -62,21 +60,148 @@ void gpu_handle_cl_error(cl_int err)
     }
 }
 
-GPUInfo* gpu_init()
+#define GPU_BUILD_OPTIONS "-cl-std=CL1.1"
+
+// FNV-1a
+static uint64_t gpui_hash(uint64_t hash, const void* data, size_t size)
+{
+    const uint8_t* bytes = (const uint8_t*)data;
+    for ( size_t i = 0; i < size; ++i ) {
+        hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static uint64_t gpui_hash_device_info(uint64_t hash, cl_device_id device, cl_device_info param)
+{
+    size_t size = 0;
+    if ( clGetDeviceInfo(device, param, 0, NULL, &size) == CL_SUCCESS && size > 0 ) {
+        char* info = sgl_calloc(size + 1, 1);
+        clGetDeviceInfo(device, param, size, info, NULL);
+        hash = gpui_hash(hash, info, size);
+        sgl_free(info);
+    }
+    return hash;
+}
+
+// Built programs are cached in cache_dir, named after the device, its driver
+// and the kernel source, so a new driver or an edited kernel never loads a
+// stale binary.
+static void gpui_binary_path(char* out, size_t out_size, const char* cache_dir, cl_device_id device)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    hash = gpui_hash_device_info(hash, device, CL_DEVICE_NAME);
+    hash = gpui_hash_device_info(hash, device, CL_DEVICE_VENDOR);
+    hash = gpui_hash_device_info(hash, device, CL_DEVICE_VERSION);
+    hash = gpui_hash_device_info(hash, device, CL_DRIVER_VERSION);
+    hash = gpui_hash(hash, GPU_BUILD_OPTIONS, sizeof(GPU_BUILD_OPTIONS));
+    hash = gpui_hash(hash, gpu_kernel_source, sizeof(gpu_kernel_source));
+    snprintf(out, out_size, "%s/%016" PRIx64 ".clbin", cache_dir, hash);
+}
+
+// Returns NULL if there is no usable binary at path.
+static cl_program gpui_load_binary(cl_context context, cl_device_id device, const char* path)
+{
+    int64_t size = 0;
+    char* binary = sgl_slurp_file(path, &size);
+    if ( !binary ) {
+        return NULL;
+    }
+    if ( size <= 0 ) {
+        sgl_free(binary);
+        return NULL;
+    }
+    size_t binary_size = (size_t)size;
+    cl_int binary_status = CL_SUCCESS;
+    cl_int err = CL_SUCCESS;
+    cl_program program = clCreateProgramWithBinary(context, 1, &device, &binary_size,
+                                                   (const unsigned char**)&binary,
+                                                   &binary_status, &err);
+    sgl_free(binary);
+    if ( err != CL_SUCCESS || binary_status != CL_SUCCESS ) {
+        if ( program ) {
+            clReleaseProgram(program);
+        }
+        return NULL;
+    }
+    if ( clBuildProgram(program, 1, &device, GPU_BUILD_OPTIONS, NULL, NULL) != CL_SUCCESS ) {
+        clReleaseProgram(program);
+        return NULL;
+    }
+    return program;
+}
+
+// Best effort. The next run builds from source if this fails.
+static void gpui_save_binary(cl_program program, const char* path)
+{
+    size_t size = 0;
+    if ( clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizeof(size), &size, NULL) != CL_SUCCESS ||
+         size == 0 ) {
+        return;
+    }
+    unsigned char* binary = sgl_malloc(size);
+    unsigned char* binaries[1] = { binary };
+    if ( clGetProgramInfo(program, CL_PROGRAM_BINARIES, sizeof(binaries), binaries, NULL) == CL_SUCCESS ) {
+        char tmp_path[1024];
+        snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+        FILE* fd = fopen(tmp_path, "wb");
+        if ( fd ) {
+            b32 written = fwrite(binary, 1, size, fd) == size;
+            written &= fclose(fd) == 0;
+            if ( !written || !evolve_replace_file(tmp_path, path) ) {
+                remove(tmp_path);
+            }
+        }
+    }
+    sgl_free(binary);
+}
+
+static cl_program gpui_build_from_source(cl_context context, cl_device_id device)
+{
+    const char* source = gpu_kernel_source;
+    cl_int err = CL_SUCCESS;
+    cl_program program = clCreateProgramWithSource(context, 1, &source, NULL, &err);
+    if ( err != CL_SUCCESS ) {
+        gpu_handle_cl_error(err);
+        return NULL;
+    }
+    err = clBuildProgram(program, 1, &device, GPU_BUILD_OPTIONS, NULL, NULL);
+    if ( err == CL_BUILD_PROGRAM_FAILURE ) {
+        size_t sz = 0;
+        clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, 0, NULL, &sz);
+        char* log = sgl_malloc(sz);
+        clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, sz, log, NULL);
+        sgl_log ("%s\n", log);
+        sgl_free(log);
+    }
+    if ( err != CL_SUCCESS ) {
+        gpu_handle_cl_error(err);
+        clReleaseProgram(program);
+        return NULL;
+    }
+    return program;
+}
+
+// Sets up the first device of the first platform. Returns NULL if there is
+// none that works, in which case the caller encodes on the CPU. The built
+// program is cached in cache_dir, unless it is NULL.
+GPUInfo* gpu_init(const char* cache_dir, int profile)
 {
     GPUInfo* gpu_info = NULL;
-#define ERR_CHECK if ( err != CL_SUCCESS ) { ok = false; gpu_handle_cl_error(err); goto err; }
-    b32 ok = true;
+#define ERR_CHECK if ( err != CL_SUCCESS ) { gpu_handle_cl_error(err); goto err; }
     cl_int err = CL_SUCCESS;
+    cl_platform_id* platforms = NULL;
+    cl_device_id* devices = NULL;
+    cl_program program = NULL;
 
     cl_uint num_platforms = 0;
     err = clGetPlatformIDs(0, NULL, &num_platforms);
-    if ( err != CL_SUCCESS ) {
-        gpu_handle_cl_error(err);
-        gpu_panic();
+    if ( err != CL_SUCCESS || num_platforms == 0 ) {
+        sgl_log("No OpenCL platform.\n");
+        return NULL;
     }
 
-    cl_platform_id*   platforms   = sgl_calloc(sizeof(cl_platform_id), num_platforms);
+    platforms = sgl_calloc(sizeof(cl_platform_id), num_platforms);
     clGetPlatformIDs(num_platforms, platforms, NULL);
 
     for ( cl_uint pi = 0; pi < num_platforms; ++pi ) {
@@ -98,7 +223,7 @@ GPUInfo* gpu_init()
             size_t str_len = 0;
             clGetPlatformInfo(platform, requested_infos[i], 0, NULL, &str_len);
             if ( str_len > 0 ) {
-                char* info = sgl_calloc(sizeof(str_len) + 1, 1);
+                char* info = sgl_calloc(str_len + 1, 1);
                 clGetPlatformInfo(platform, requested_infos[i], str_len, info, NULL);
                 sgl_log("CL INFO: %s -- %s\n", requested_infos_str[i], info);
                 sgl_free(info);
@@ -111,19 +236,21 @@ GPUInfo* gpu_init()
     }
 
     cl_uint num_devices = 0;
-    if ( clGetDeviceIDs(platforms[0], CL_DEVICE_TYPE_ALL, 0, NULL, &num_devices) != CL_SUCCESS ) {
-        gpu_panic();
+    err = clGetDeviceIDs(platforms[0], CL_DEVICE_TYPE_ALL, 0, NULL, &num_devices);
+    if ( err != CL_SUCCESS || num_devices == 0 ) {
+        sgl_log("No OpenCL device.\n");
+        goto err;
     }
 
-    cl_device_id* devices = sgl_calloc(sizeof(cl_device_id), num_devices);
+    devices = sgl_calloc(sizeof(cl_device_id), num_devices);
     err = clGetDeviceIDs(platforms[0], CL_DEVICE_TYPE_ALL, num_devices, devices, 0);
     ERR_CHECK;
 
     // TODO: use clGetDeviceInfo if we ever need to know all the infos
     if (num_devices > 1) {
-        sgl_log ( "More than one device available...\n" );
+        sgl_log ( "More than one device available. Using the first one.\n" );
     }
-
+    cl_device_id device = devices[0];
 
     cl_context_properties context_properties[] = {
         CL_CONTEXT_PLATFORM, (cl_context_properties)(platforms[0]),
@@ -131,99 +258,176 @@ GPUInfo* gpu_init()
     };
 
     gpu_info = sgl_calloc(sizeof(GPUInfo), 1);
+    // Only the device we use, so that programs have a single binary.
     gpu_info->context = clCreateContext(context_properties,
-                                        num_devices,
-                                        devices,
+                                        1,
+                                        &device,
                                         NULL, // CALLBACK
                                         //gpui_context_notify,
                                         NULL, /* user_data */
                                         &err);
     ERR_CHECK;
 
-    // Compile the program.
-    int64_t file_contents_count;
-    // Assuming that we are running from the root project directory...
-    char* file_contents =  sgl_slurp_file("src/opencl_jpeg.cl", &file_contents_count);
-    if (!file_contents) {
-        goto end;
+    // Get the program, from the cache if it is there.
+    {
+        uint64_t begin_us = evolve_time_us();
+        char binary_path[1024] = {0};
+        if ( cache_dir ) {
+            gpui_binary_path(binary_path, sizeof(binary_path), cache_dir, device);
+            program = gpui_load_binary(gpu_info->context, device, binary_path);
+        }
+        b32 cached = program != NULL;
+        if ( !program ) {
+            program = gpui_build_from_source(gpu_info->context, device);
+            if ( !program ) {
+                goto err;
+            }
+            if ( cache_dir ) {
+                gpui_save_binary(program, binary_path);
+            }
+        }
+        sgl_log("OpenCL program %s in %" PRIu64 "us\n",
+                cached ? "loaded from cache" : "built from source", evolve_time_us() - begin_us);
     }
 
-    cl_program program = clCreateProgramWithSource(gpu_info->context,
-                                                   1,
-                                                   &file_contents,
-                                                   NULL,
-                                                   &err);
-
-    sgl_free(file_contents);
-
-    ERR_CHECK;
-
-    err = clBuildProgram(program, 1, &devices[0],
-                         "-cl-std=CL1.1",  // build options...
-                         NULL, // callback
-                         NULL // user data
-                        );
-
-    if (err == CL_BUILD_PROGRAM_FAILURE) {
-        size_t sz = 0;
-        clGetProgramBuildInfo(program,
-                              devices[0],
-                              CL_PROGRAM_BUILD_LOG,
-                              0,
-                              NULL,
-                              &sz);
-        char* log = sgl_malloc(sz);
-        clGetProgramBuildInfo(program,
-                              devices[0],
-                              CL_PROGRAM_BUILD_LOG,
-                              sz,
-                              log,
-                              NULL);
-        sgl_log ("%s\n", log);
-        sgl_free(log);
+    // Create command queue.
+    // Out of order, so that the upload of one batch can run next to the
+    // kernels of the other. Every command names what it waits for, so an in
+    // order queue gives the same results, only with less overlap.
+    {
+        cl_command_queue_properties properties = CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE;
+        if ( profile ) {
+            properties |= CL_QUEUE_PROFILING_ENABLE;
+        }
+        cl_command_queue queue = clCreateCommandQueue(gpu_info->context, device, properties, &err);
+        if ( err == CL_INVALID_QUEUE_PROPERTIES ) {
+            sgl_log("OpenCL device has no out-of-order queues. Uploads will wait for kernels.\n");
+            properties &= ~(cl_command_queue_properties)CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE;
+            queue = clCreateCommandQueue(gpu_info->context, device, properties, &err);
+        }
+        ERR_CHECK;
+        gpu_info->queue = queue;
+        gpu_info->profile = profile;
     }
 
+    gpu_info->encode_kernel = clCreateKernel(program, "cl_encode_population", &err);
     ERR_CHECK;
-
-    // Create command queue.
-    // TODO: Perf win for out-of-order excecution? Prolly not much and would need more queues.
-    cl_command_queue queue = clCreateCommandQueue(gpu_info->context,
-                                                  devices[0],
-                                                  0,  //cl_command_queue_properties
-                                                  &err);
+    gpu_info->reduce_kernel = clCreateKernel(program, "cl_reduce_population", &err);
     ERR_CHECK;
-
-    gpu_info->queue = queue;
-
-    cl_kernel kernel = clCreateKernel(program, "cl_encode_and_write_MCU", &err);
-
-    ERR_CHECK;
-
-    gpu_info->kernel = kernel;
+    // The kernels keep the program alive.
+    clReleaseProgram(program);
 
     goto end;
 err:
-    sgl_free(gpu_info);
+    if ( program ) {
+        clReleaseProgram(program);
+    }
+    if ( gpu_info ) {
+        if ( gpu_info->encode_kernel ) {
+            clReleaseKernel(gpu_info->encode_kernel);
+        }
+        if ( gpu_info->reduce_kernel ) {
+            clReleaseKernel(gpu_info->reduce_kernel);
+        }
+        if ( gpu_info->queue ) {
+            clReleaseCommandQueue(gpu_info->queue);
+        }
+        if ( gpu_info->context ) {
+            clReleaseContext(gpu_info->context);
+        }
+        sgl_free(gpu_info);
+    }
+    gpu_info = NULL;
 end:
     sgl_free(platforms);
-    sgl_free(devices);
+    if ( devices ) {
+        sgl_free(devices);
+    }
     return gpu_info;
 #undef ERR_CHECK
 }
 
+static void gpui_release_batch(GPUBatchBuffers* buffers)
+{
+    cl_mem* mems[] = {
+        &buffers->qt_mem,
+        &buffers->partial_bits_mem,
+        &buffers->partial_mse_mem,
+        &buffers->bits_mem,
+        &buffers->mse_mem,
+    };
+    for ( uint32_t i = 0; i < sgl_array_count(mems); ++i ) {
+        if ( *mems[i] ) {
+            clReleaseMemObject(*mems[i]);
+            *mems[i] = NULL;
+        }
+    }
+    buffers->capacity = 0;
+}
+
 void gpu_deinit(GPUInfo* gpu_info)
 {
     if (gpu_info) {
-        clReleaseMemObject(gpu_info->huffman_len_mem);
-        clReleaseMemObject(gpu_info->bitcount_array_mem);
-        clReleaseMemObject(gpu_info->mse_mem);
-        clReleaseMemObject(gpu_info->mcu_array_mem);
-        clReleaseMemObject(gpu_info->qt_mem);
+        for ( int set = 0; set < GPU_NUM_BATCH_SETS; ++set ) {
+            gpui_release_batch(&gpu_info->batch_sets[set]);
+        }
+        // NULL if gpu_setup_buffers failed or was never called.
+        if ( gpu_info->huffman_len_mem ) {
+            clReleaseMemObject(gpu_info->huffman_len_mem);
+        }
+        if ( gpu_info->mcu_array_mem ) {
+            clReleaseMemObject(gpu_info->mcu_array_mem);
+        }
+        clReleaseKernel(gpu_info->encode_kernel);
+        clReleaseKernel(gpu_info->reduce_kernel);
+        clReleaseCommandQueue(gpu_info->queue);
 
         clReleaseContext(gpu_info->context);
     }
 }
 
+// Makes room in buffer set `set` for batches of num_tables tables. Buffers
+// only grow, so this is free once the largest batch has been seen. The caller
+// makes sure that no command still uses the set. Returns false on error.
+int gpu_reserve_batch(GPUInfo* gpu_info, int set, int num_tables)
+{
+    GPUBatchBuffers* buffers = &gpu_info->batch_sets[set];
+    if ( num_tables <= buffers->capacity ) {
+        return true;
+    }
+    gpui_release_batch(buffers);
+
+    int ok = true;
+#define ERR_CHECK if ( err != CL_SUCCESS ) { ok = false; gpu_handle_cl_error(err); goto err; }
+    cl_int err;
+    size_t num_partials = (size_t)num_tables * gpu_info->num_groups;
+
+    buffers->qt_mem = clCreateBuffer(gpu_info->context, CL_MEM_READ_ONLY,
+                                     (size_t)num_tables * 64 * sizeof(float), NULL, &err);
+    ERR_CHECK;
+    // Only the device touches the partial sums.
+    buffers->partial_bits_mem = clCreateBuffer(gpu_info->context, CL_MEM_READ_WRITE,
+                                               num_partials * sizeof(uint32_t), NULL, &err);
+    ERR_CHECK;
+    buffers->partial_mse_mem = clCreateBuffer(gpu_info->context, CL_MEM_READ_WRITE,
+                                              num_partials * sizeof(uint64_t), NULL, &err);
+    ERR_CHECK;
+    buffers->bits_mem = clCreateBuffer(gpu_info->context, CL_MEM_WRITE_ONLY,
+                                       (size_t)num_tables * sizeof(uint32_t), NULL, &err);
+    ERR_CHECK;
+    buffers->mse_mem = clCreateBuffer(gpu_info->context, CL_MEM_WRITE_ONLY,
+                                      (size_t)num_tables * sizeof(uint64_t), NULL, &err);
+    ERR_CHECK;
+
+    buffers->capacity = num_tables;
+    goto end;
+err:
+    gpui_release_batch(buffers);
+end:
+    return ok;
+#undef ERR_CHECK
+}
+
 // This function uploads data used by every kernel call that doesn't change during the program's lifetime.
 //
 // Passes in the huffman table for luma dc buffers. 1/6th of the data that the
@@ -256,39 +460,19 @@ int gpu_setup_buffers(GPUInfo* gpu_info,
     ERR_CHECK;
 
     gpu_info->mcu_array_mem = mcu_array_mem;
+    gpu_info->num_blocks = num_blocks;
+    gpu_info->num_groups = (num_blocks + DJE_GPU_GROUP_SIZE - 1) / DJE_GPU_GROUP_SIZE;
 
-    cl_mem bitcount_array = clCreateBuffer(gpu_info->context,
-                                           CL_MEM_WRITE_ONLY,  // Result buffer. Only written to.
-                                           num_blocks * sizeof(uint32_t),
-                                           NULL,
-                                           &err);
-    ERR_CHECK;
-
-    gpu_info->bitcount_array_mem = bitcount_array;
-
-    cl_mem mse = clCreateBuffer(gpu_info->context,
-                                CL_MEM_WRITE_ONLY,  // Result buffer. Only written to.
-                                num_blocks * sizeof(uint64_t),
-                                NULL,
-                                &err);
-    ERR_CHECK;
-
-    gpu_info->mse_mem = mse;
-
-    cl_mem qt = clCreateBuffer(gpu_info->context,
-                               CL_MEM_READ_ONLY,
-                               64 * sizeof(float),
-                               NULL,
-                               &err);
-    ERR_CHECK;
-
-    gpu_info->qt_mem = qt;
+    for ( int set = 0; set < GPU_NUM_BATCH_SETS; ++set ) {
+        if ( !gpu_reserve_batch(gpu_info, set, 1) ) {
+            goto err;
+        }
+    }
 
     goto end;
 err:
     ok = false;
-    // Handle error case...
-    assert(!"Failed to setup buffer");
+    // gpu_deinit releases whatever was created.
 end:
     return ok;
 #undef ERR_CHECK
@@ -2,28 +2,45 @@
 
 #include <opencl.h>
 
+// Device buffers for one batch of tables. Sized for capacity tables.
+typedef struct GPUBatchBuffers_s {
+    int                 capacity;
+    cl_mem              qt_mem;            // AA&N post-processed quantization matrices. [table][64]
+    cl_mem              partial_bits_mem;  // Sums of each group. [table][num_groups]
+    cl_mem              partial_mse_mem;
+    cl_mem              bits_mem;          // Sums of each table. [table]
+    cl_mem              mse_mem;
+} GPUBatchBuffers;
+
+// One batch can be uploaded while the other is encoded or read back.
+#define GPU_NUM_BATCH_SETS 2
+
 typedef struct GPUInfo_s {
     cl_context          context;
-    cl_command_queue    queue;
+    cl_command_queue    queue;  // Out of order when the device allows it. Commands are chained with events.
+    int                 profile;  // The queue records timestamps. See dje_gpu_finish.
+    int                 failed;   // Set after an OpenCL error. Encodes go to the CPU from then on.
     cl_mem              huffman_len_mem;
 
-    // Result buffers.
-    cl_mem              bitcount_array_mem;
-    cl_mem              mse_mem;
-
     // Input buffers
     cl_mem              mcu_array_mem;
-    cl_mem              qt_mem;  // AA&N post-processed quantization matrix.
+    int                 num_blocks;
+    int                 num_groups;  // Of DJE_GPU_GROUP_SIZE blocks.
+
+    GPUBatchBuffers     batch_sets[GPU_NUM_BATCH_SETS];
 
-    cl_kernel           kernel;
+    cl_kernel           encode_kernel;  // cl_encode_population
+    cl_kernel           reduce_kernel;  // cl_reduce_population
 } GPUInfo;
 
-GPUInfo* gpu_init();
+GPUInfo* gpu_init(const char* cache_dir, int profile);
 
 int gpu_setup_buffers(GPUInfo* gpu_info,
                       uint8_t* huffsize,
                       int num_blocks, DJEBlock* y_blocks);
 
+int gpu_reserve_batch(GPUInfo* gpu_info, int set, int num_tables);
+
 void gpu_handle_cl_error(cl_int err);
 
 void gpu_deinit(GPUInfo* gpu_info);
@@ -0,0 +1,384 @@
+/**
+ * image_source.c
+ *
+ *  Where the pixels of the source image come from.
+ *
+ *  Uncompressed formats are memory-mapped and read in place: binary PPM,
+ *  PAM, BMP (24 and 32 bits, top-down or bottom-up) and raw RGB, RGBA, BGR,
+ *  BGRA or planar files with dimensions given on the command line. Nothing
+ *  is decoded or copied, and only the rows being read need to be resident.
+ *  Everything else goes through stb_image, which decodes the whole image
+ *  into memory.
+ *
+ *  The layout of the pixels is described by a DJEImage, which the prelude
+ *  reads directly. tiny_jpeg wants packed RGB rows, so image_source_packed
+ *  makes a packed copy for it, but only for layouts that aren't packed
+ *  already and only when something asks for it.
+ */
+
+// A read-only mapping of a whole file.
+typedef struct
+{
+    void*       data;
+    size_t      size;
+#if defined(_WIN32)
+    HANDLE      file;
+    HANDLE      file_mapping;
+#endif
+} MappedFile;
+
+void mapped_file_close(MappedFile* file)
+{
+    if ( !file->data ) {
+        return;
+    }
+#if defined(_WIN32)
+    UnmapViewOfFile(file->data);
+    CloseHandle(file->file_mapping);
+    CloseHandle(file->file);
+#else
+    munmap(file->data, file->size);
+#endif
+    memset(file, 0, sizeof(MappedFile));
+}
+
+// Maps the file at path. Returns false if it doesn't exist or is empty.
+b32 mapped_file_open(MappedFile* file, const char* path)
+{
+    memset(file, 0, sizeof(MappedFile));
+#if defined(_WIN32)
+    file->file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                             FILE_ATTRIBUTE_NORMAL, NULL);
+    if ( file->file == INVALID_HANDLE_VALUE ) {
+        return false;
+    }
+    LARGE_INTEGER size;
+    if ( !GetFileSizeEx(file->file, &size) || size.QuadPart == 0 ) {
+        CloseHandle(file->file);
+        return false;
+    }
+    file->size = (size_t)size.QuadPart;
+    file->file_mapping = CreateFileMappingA(file->file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if ( file->file_mapping ) {
+        file->data = MapViewOfFile(file->file_mapping, FILE_MAP_READ, 0, 0, 0);
+    }
+    if ( !file->data ) {
+        if ( file->file_mapping ) {
+            CloseHandle(file->file_mapping);
+        }
+        CloseHandle(file->file);
+        return false;
+    }
+#else
+    int fd = open(path, O_RDONLY);
+    if ( fd < 0 ) {
+        return false;
+    }
+    struct stat st;
+    if ( fstat(fd, &st) != 0 || st.st_size == 0 ) {
+        close(fd);
+        return false;
+    }
+    file->size = (size_t)st.st_size;
+    void* data = mmap(NULL, file->size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if ( data == MAP_FAILED ) {
+        return false;
+    }
+    file->data = data;
+#endif
+    return true;
+}
+
+typedef enum
+{
+    ImageLayout_RGB,
+    ImageLayout_RGBA,
+    ImageLayout_BGR,
+    ImageLayout_BGRA,
+    ImageLayout_PLANAR,  // All of R, then G, then B.
+} ImageLayout;
+
+typedef struct
+{
+    DJEImage                image;
+    int                     num_components;  // Of the packed pixels.
+
+    MappedFile              file;     // When the pixels are read in place.
+    unsigned char*          decoded;  // When they come from stb_image.
+    unsigned char*          packed;   // Copy made by image_source_packed, or NULL.
+} ImageSource;
+
+// Describes an interleaved layout, in place.
+static void image_source_set_layout(ImageSource* source, const unsigned char* first_row,
+                                    int width, int height, ptrdiff_t row_stride,
+                                    int pixel_stride, b32 bgr)
+{
+    DJEImage* image = &source->image;
+    image->pixels = first_row;
+    image->width = width;
+    image->height = height;
+    image->row_stride = row_stride;
+    image->pixel_stride = pixel_stride;
+    image->channel_offset[0] = bgr ? 2 : 0;
+    image->channel_offset[1] = 1;
+    image->channel_offset[2] = bgr ? 0 : 2;
+    source->num_components = (bgr || pixel_stride < 3 || pixel_stride > 4) ? 3 : pixel_stride;
+}
+
+// Reads an unsigned integer from a PNM header, skipping whitespace and comments.
+static b32 image_source_pnm_int(const uint8_t* data, size_t size, size_t* pos, int* out)
+{
+    size_t i = *pos;
+    for ( ;; ) {
+        while ( i < size && (data[i] == ' ' || data[i] == '\t' || data[i] == '\r' || data[i] == '\n') ) {
+            ++i;
+        }
+        if ( i < size && data[i] == '#' ) {
+            while ( i < size && data[i] != '\n' ) {
+                ++i;
+            }
+            continue;
+        }
+        break;
+    }
+    int64_t value = 0;
+    size_t begin = i;
+    while ( i < size && data[i] >= '0' && data[i] <= '9' && value < INT32_MAX ) {
+        value = value * 10 + (data[i] - '0');
+        ++i;
+    }
+    if ( i == begin || value >= INT32_MAX ) {
+        return false;
+    }
+    *out = (int)value;
+    *pos = i;
+    return true;
+}
+
+// True if size - pos bytes hold height rows of row_size bytes.
+static b32 image_source_fits(size_t size, size_t pos, size_t row_size, int height)
+{
+    return pos <= size && row_size > 0 && (size - pos) / row_size >= (size_t)height;
+}
+
+// Binary PPM with 8-bit samples.
+static b32 image_source_map_ppm(ImageSource* source)
+{
+    const uint8_t* data = (const uint8_t*)source->file.data;
+    size_t size = source->file.size;
+    if ( size < 2 || data[0] != 'P' || data[1] != '6' ) {
+        return false;
+    }
+    size_t pos = 2;
+    int width, height, maxval;
+    if ( !image_source_pnm_int(data, size, &pos, &width) ||
+         !image_source_pnm_int(data, size, &pos, &height) ||
+         !image_source_pnm_int(data, size, &pos, &maxval) ||
+         maxval != 255 || width == 0 || height == 0 ) {
+        return false;
+    }
+    ++pos;  // A single whitespace character ends the header.
+    if ( !image_source_fits(size, pos, (size_t)width * 3, height) ) {
+        return false;
+    }
+    image_source_set_layout(source, data + pos, width, height, (ptrdiff_t)width * 3, 3, false);
+    return true;
+}
+
+// PAM with 8-bit RGB or RGB_ALPHA tuples.
+static b32 image_source_map_pam(ImageSource* source)
+{
+    const uint8_t* data = (const uint8_t*)source->file.data;
+    size_t size = source->file.size;
+    if ( size < 3 || memcmp(data, "P7\n", 3) != 0 ) {
+        return false;
+    }
+    int width = 0, height = 0, depth = 0, maxval = 0;
+    size_t pos = 3;
+    for ( ;; ) {
+        size_t end = pos;
+        while ( end < size && data[end] != '\n' ) {
+            ++end;
+        }
+        if ( end == size ) {
+            return false;
+        }
+        char line[64] = {0};
+        size_t len = (end - pos < sizeof(line) - 1) ? end - pos : sizeof(line) - 1;
+        memcpy(line, data + pos, len);
+        pos = end + 1;
+        if ( !strncmp(line, "ENDHDR", 6) ) {
+            break;
+        }
+        sscanf(line, "WIDTH %d", &width);
+        sscanf(line, "HEIGHT %d", &height);
+        sscanf(line, "DEPTH %d", &depth);
+        sscanf(line, "MAXVAL %d", &maxval);
+    }
+    if ( width <= 0 || height <= 0 || maxval != 255 || (depth != 3 && depth != 4) ||
+         !image_source_fits(size, pos, (size_t)width * depth, height) ) {
+        return false;
+    }
+    image_source_set_layout(source, data + pos, width, height, (ptrdiff_t)width * depth, depth, false);
+    return true;
+}
+
+static uint32_t image_source_le32(const uint8_t* p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// Uncompressed BMP, 24 bits, or 32 bits with the usual BGRA masks.
+static b32 image_source_map_bmp(ImageSource* source)
+{
+    const uint8_t* data = (const uint8_t*)source->file.data;
+    size_t size = source->file.size;
+    if ( size < 54 || data[0] != 'B' || data[1] != 'M' ) {
+        return false;
+    }
+    uint32_t offset      = image_source_le32(data + 10);
+    uint32_t header_size = image_source_le32(data + 14);
+    int32_t  width       = (int32_t)image_source_le32(data + 18);
+    int32_t  height      = (int32_t)image_source_le32(data + 22);
+    int      bpp         = data[28] | (data[29] << 8);
+    uint32_t compression = image_source_le32(data + 30);
+    if ( header_size < 40 || width <= 0 || height == 0 || height == INT32_MIN ) {
+        return false;
+    }
+    if ( bpp == 32 && compression == 3 ) {  // BI_BITFIELDS. Only the layout of BI_RGB is read in place.
+        if ( size < 14 + 40 + 12 ||
+             image_source_le32(data + 54) != 0x00ff0000 ||
+             image_source_le32(data + 58) != 0x0000ff00 ||
+             image_source_le32(data + 62) != 0x000000ff ) {
+            return false;
+        }
+    } else if ( compression != 0 || (bpp != 24 && bpp != 32) ) {
+        return false;
+    }
+    b32 bottom_up = height > 0;
+    if ( !bottom_up ) {
+        height = -height;
+    }
+    size_t row_size = ((size_t)width * bpp + 31) / 32 * 4;
+    if ( !image_source_fits(size, offset, row_size, height) ) {
+        return false;
+    }
+    const unsigned char* first_row = data + offset;
+    ptrdiff_t row_stride = (ptrdiff_t)row_size;
+    if ( bottom_up ) {
+        first_row += (size_t)(height - 1) * row_size;
+        row_stride = -row_stride;
+    }
+    image_source_set_layout(source, first_row, width, height, row_stride, bpp / 8, true);
+    return true;
+}
+
+// Maps the image at path if it can be read in place, decodes it otherwise.
+b32 image_source_open(ImageSource* source, const char* path)
+{
+    memset(source, 0, sizeof(ImageSource));
+    if ( mapped_file_open(&source->file, path) ) {
+        if ( image_source_map_ppm(source) || image_source_map_pam(source) ||
+             image_source_map_bmp(source) ) {
+            return true;
+        }
+        mapped_file_close(&source->file);
+    }
+    int width, height, num_components;
+    source->decoded = stbi_load(path, &width, &height, &num_components, 0);
+    if ( !source->decoded ) {
+        return false;
+    }
+    if ( num_components < 3 ) {
+        // Gray. Read the one channel as R, G and B.
+        image_source_set_layout(source, source->decoded, width, height,
+                                (ptrdiff_t)width * num_components, num_components, false);
+        source->image.channel_offset[1] = 0;
+        source->image.channel_offset[2] = 0;
+        // image_source_packed expands it to RGB.
+        source->num_components = 3;
+        return true;
+    }
+    image_source_set_layout(source, source->decoded, width, height,
+                            (ptrdiff_t)width * num_components, num_components, false);
+    return true;
+}
+
+// Maps a headerless file of width x height 8-bit pixels in layout.
+b32 image_source_open_raw(ImageSource* source, const char* path, int width, int height,
+                          ImageLayout layout)
+{
+    memset(source, 0, sizeof(ImageSource));
+    if ( width <= 0 || height <= 0 || !mapped_file_open(&source->file, path) ) {
+        return false;
+    }
+    const unsigned char* data = (const unsigned char*)source->file.data;
+    int pixel_stride = (layout == ImageLayout_RGBA || layout == ImageLayout_BGRA) ? 4 :
+                       (layout == ImageLayout_PLANAR) ? 1 : 3;
+    int num_planes = (layout == ImageLayout_PLANAR) ? 3 : 1;
+    if ( (size_t)width * height * pixel_stride * num_planes > source->file.size ) {
+        sgl_log("%s is smaller than a %dx%d image.\n", path, width, height);
+        mapped_file_close(&source->file);
+        return false;
+    }
+    image_source_set_layout(source, data, width, height, (ptrdiff_t)width * pixel_stride, pixel_stride,
+                            layout == ImageLayout_BGR || layout == ImageLayout_BGRA);
+    if ( layout == ImageLayout_PLANAR ) {
+        ptrdiff_t plane_size = (ptrdiff_t)width * height;
+        source->image.channel_offset[0] = 0;
+        source->image.channel_offset[1] = plane_size;
+        source->image.channel_offset[2] = 2 * plane_size;
+    }
+    return true;
+}
+
+// Pixels that are already in memory, packed, owned by the caller.
+void image_source_from_memory(ImageSource* source, const unsigned char* data,
+                              int width, int height, int num_components)
+{
+    memset(source, 0, sizeof(ImageSource));
+    image_source_set_layout(source, data, width, height, (ptrdiff_t)width * num_components,
+                            num_components, false);
+}
+
+// Top-down rows of num_components interleaved samples in RGB order, which is
+// what tiny_jpeg reads. Makes a copy the first time if the source is laid
+// out differently.
+const unsigned char* image_source_packed(ImageSource* source)
+{
+    DJEImage* image = &source->image;
+    int n = source->num_components;
+    if ( image->pixel_stride == n && image->row_stride == (ptrdiff_t)image->width * n &&
+         image->channel_offset[0] == 0 && image->channel_offset[1] == 1 &&
+         image->channel_offset[2] == 2 ) {
+        return image->pixels;
+    }
+    if ( !source->packed ) {
+        sgl_log("Making a packed copy of the image for the JPEG writer.\n");
+        source->packed = sgl_malloc((size_t)image->width * image->height * 3);
+        unsigned char* out = source->packed;
+        for ( int y = 0; y < image->height; ++y ) {
+            const unsigned char* row = image->pixels + y * image->row_stride;
+            for ( int x = 0; x < image->width; ++x ) {
+                const unsigned char* pixel = row + (ptrdiff_t)x * image->pixel_stride;
+                *out++ = pixel[image->channel_offset[0]];
+                *out++ = pixel[image->channel_offset[1]];
+                *out++ = pixel[image->channel_offset[2]];
+            }
+        }
+    }
+    return source->packed;
+}
+
+void image_source_close(ImageSource* source)
+{
+    mapped_file_close(&source->file);
+    if ( source->decoded ) {
+        stbi_image_free(source->decoded);
+    }
+    if ( source->packed ) {
+        sgl_free(source->packed);
+    }
+    memset(source, 0, sizeof(ImageSource));
+}
@@ -0,0 +1,284 @@
+/**
+ * islands.c
+ *
+ *  Island model. Every island is an independent population that evolves on
+ *  its own thread with its own seed, using the same operators as the main loop.
+ *  Every migration_interval generations, each island sends copies of its best
+ *  elements to another island, which replace its worst ones.
+ *
+ *  Islands only share the read-only data in FitnessContext (the image blocks
+ *  and huffman tables). Evaluation is done with dje_encode_serial so that no
+ *  island ever waits for another one.
+ */
+
+#define ISLAND_MAX_MIGRANTS 16
+
+typedef enum
+{
+    IslandTopology_RING,    // Island i sends to island i+1
+    IslandTopology_RANDOM,  // Island i sends to a random island other than itself.
+} IslandTopology;
+
+typedef struct
+{
+    int             num_islands;  // 0 means "don't use the island model"
+    IslandTopology  topology;
+    int             migration_interval;  // In generations.
+    int             num_migrants;
+    int             num_generations;
+    int             population_size;  // Per island.
+    double          time_limit;  // In seconds. 0 means no limit.
+} IslandParams;
+
+typedef struct Island_s Island;
+
+typedef struct
+{
+    IslandParams*   params;
+    FitnessContext* fitness_ctx;
+    Island*         islands;
+    uint64_t        begin_us;
+    SglSemaphore*   done_semaphore;
+
+    // Best fitness over every island, protected by best_mutex. New bests
+    // are posted to writer, if not NULL.
+    BestWriter*     writer;
+    SglMutex*       best_mutex;
+    float           best_fitness;
+} IslandModel;
+
+struct Island_s
+{
+    int                 id;
+    IslandModel*        model;
+    Arena               arena;
+    uint64_t            seed;
+
+    // Migrants sent to this island, with their step sizes. Protected by
+    // inbox_mutex. Once full, inbox_next is the oldest slot.
+    SglMutex*           inbox_mutex;
+    Population          inbox;
+    int                 inbox_next;
+
+    // Written by the island thread once it is done.
+    PopulationElement   winner;
+};
+
+IslandParams island_default_params()
+{
+    IslandParams params = {0};
+    params.num_islands = 0;
+    params.topology = IslandTopology_RING;
+    params.migration_interval = 5;
+    params.num_migrants = 2;
+    params.population_size = INITIAL_GENERATION_COUNT;
+    return params;
+}
+
+// population must be ranked with at least num_migrants head ranks.
+static void island_send_migrants(Island* island, Population* population, int generation)
+{
+    IslandModel* model = island->model;
+    int num_islands = model->params->num_islands;
+    if (num_islands < 2) {
+        return;
+    }
+
+    int dest_id = 0;
+    switch (model->params->topology) {
+    case IslandTopology_RING: {
+        dest_id = (island->id + 1) % num_islands;
+    } break;
+    case IslandTopology_RANDOM: {
+        GARng rng = ga_rng_key(island->seed, GA_STREAM_MIGRATION, (uint32_t)generation);
+        dest_id = (island->id + 1 + ga_rand(&rng) % (num_islands - 1)) % num_islands;
+    } break;
+    }
+
+    Island* dest = &model->islands[dest_id];
+
+    int num_migrants = model->params->num_migrants;
+    if (num_migrants > population->num_ranked) {
+        num_migrants = population->num_ranked;
+    }
+
+    sgl_mutex_lock(dest->inbox_mutex);
+    for (int i = 0; i < num_migrants; ++i) {
+        // When the inbox is full, overwrite the oldest migrants.
+        if (dest->inbox.count < ISLAND_MAX_MIGRANTS) {
+            population_push_from(&dest->inbox, population, population->order[i]);
+        } else {
+            population_set(&dest->inbox, dest->inbox_next, population, population->order[i]);
+            dest->inbox_next = (dest->inbox_next + 1) % ISLAND_MAX_MIGRANTS;
+        }
+    }
+    sgl_mutex_unlock(dest->inbox_mutex);
+}
+
+// Migrants replace the worst elements in population. Leaves population ranked.
+static void island_receive_migrants(Island* island, Population* population)
+{
+    int num_migrants = island->model->params->num_migrants;
+
+    sgl_mutex_lock(island->inbox_mutex);
+    int received = island->inbox.count;
+    if (received > population->count) {
+        received = population->count;
+    }
+    population_rank(population, num_migrants, received > 0 ? received : 1);
+    for (int i = 0; i < received; ++i) {
+        int idx = population->order[population->count - 1 - i];
+        population_set(population, idx, &island->inbox, i);
+        // Not bred here, so it says nothing about this island's operators.
+        population->op[idx] = NONE;
+        population->parent_fitness[idx] = FLT_MAX;
+    }
+    island->inbox.count = 0;
+    island->inbox_next = 0;
+    sgl_mutex_unlock(island->inbox_mutex);
+
+    if (received) {
+        population_rank(population, num_migrants, 1);
+    }
+}
+
+static void island_thread(void* data)
+{
+    Island* island = (Island*)data;
+    IslandModel* model = island->model;
+    IslandParams* params = model->params;
+
+    // Parent and child populations, swapped every generation.
+    Population populations[2] = {
+        population_init(&island->arena, params->population_size),
+        population_init(&island->arena, params->population_size),
+    };
+    Population* population = &populations[0];
+    Population* children   = &populations[1];
+    Arena eval_arena = arena_push(&island->arena, arena_available_space(&island->arena));
+
+    fill_initial_population(population, params->population_size, island->seed);
+    OperatorRates rates = operator_rates_default();
+
+    float last_winner_fitness = FLT_MAX;
+    int convergence_hits = 0;
+    // Breeding is not elitist, so the best element can be lost. Keep it.
+    island->winner.fitness = FLT_MAX;
+
+    for ( int gen_i = 0; ; ++gen_i ) {
+        for ( int elem_i = 0; elem_i < population->count; ++elem_i ) {
+            population->fitness[elem_i] = evaluate_fitness_serial(model->fitness_ctx, &eval_arena,
+                                                                  population->tables[elem_i]);
+        }
+
+        // Before migrants overwrite elements bred here.
+        operator_rates_update_from(&rates, population);
+        island_receive_migrants(island, population);
+
+        float winner_fitness = population->fitness[population->order[0]];
+        float worst_fitness  = population->fitness[population->order[population->num_ranked - 1]];
+        if ( winner_fitness < island->winner.fitness ) {
+            island->winner = population_element(population, 0);
+        }
+
+        if ( model->writer ) {
+            sgl_mutex_lock(model->best_mutex);
+            if ( winner_fitness < model->best_fitness ) {
+                model->best_fitness = winner_fitness;
+                best_writer_post(model->writer, population->tables[population->order[0]], winner_fitness);
+            }
+            sgl_mutex_unlock(model->best_mutex);
+        }
+
+        sgl_log("Island %d Gen %d Best: %f Worst: %f\n",
+                island->id, gen_i+1, winner_fitness, worst_fitness);
+
+        float fdiff = winner_fitness - last_winner_fitness;
+        if ( ABS(fdiff) < 0.0001f ) {
+            ++convergence_hits;
+        } else {
+            convergence_hits = 0;
+        }
+
+        if ( gen_i == params->num_generations || convergence_hits == CONVERGENCE_LIMIT ||
+             (params->time_limit > 0 &&
+              evolve_time_us() - model->begin_us > (uint64_t)(params->time_limit * 1000000)) ) {
+            break;
+        }
+
+        last_winner_fitness = winner_fitness;
+
+        if ( params->migration_interval > 0 && (gen_i + 1) % params->migration_interval == 0 ) {
+            island_send_migrants(island, population, gen_i);
+        }
+
+        breed_population(population, &rates, children, params->population_size, island->seed, gen_i);
+
+        Population* tmp = population;
+        population = children;
+        children = tmp;
+    }
+
+    sgl_semaphore_signal(model->done_semaphore);
+}
+
+// Runs params->num_islands populations in parallel and returns the best element found.
+// If writer is not NULL, every new best element of any island is posted to it.
+//
+// Memory for every island is taken from arena.
+PopulationElement island_evolve(IslandParams* params, FitnessContext* fitness_ctx, Arena* arena,
+                                BestWriter* writer, uint64_t seed)
+{
+    int num_islands = params->num_islands;
+    if (params->num_migrants > ISLAND_MAX_MIGRANTS) {
+        params->num_migrants = ISLAND_MAX_MIGRANTS;
+    }
+
+    IslandModel model = {0};
+    model.params = params;
+    model.fitness_ctx = fitness_ctx;
+    model.islands = sgl_calloc(sizeof(Island), num_islands);
+    model.done_semaphore = sgl_create_semaphore(0);
+    model.writer = writer;
+    model.best_mutex = sgl_create_mutex();
+    model.best_fitness = FLT_MAX;
+
+    size_t island_memory = arena_available_space(arena) / num_islands;
+
+    for ( int i = 0; i < num_islands; ++i ) {
+        Island* island = &model.islands[i];
+        island->id = i;
+        island->model = &model;
+        island->arena = arena_push(arena, island_memory);
+        island->seed = ga_rng_key(seed, GA_STREAM_ISLAND, (uint32_t)i).state;
+        island->inbox_mutex = sgl_create_mutex();
+        island->inbox = population_init(&island->arena, ISLAND_MAX_MIGRANTS);
+    }
+
+    model.begin_us = evolve_time_us();
+    for ( int i = 0; i < num_islands; ++i ) {
+        sgl_create_thread(island_thread, &model.islands[i]);
+    }
+
+    for ( int i = 0; i < num_islands; ++i ) {
+        sgl_semaphore_wait(model.done_semaphore);
+    }
+
+    PopulationElement winner = model.islands[0].winner;
+    for ( int i = 1; i < num_islands; ++i ) {
+        if (model.islands[i].winner.fitness < winner.fitness) {
+            winner = model.islands[i].winner;
+        }
+    }
+
+    sgl_log("Best island fitness: %f\n", winner.fitness);
+
+    for ( int i = 0; i < num_islands; ++i ) {
+        sgl_destroy_mutex(model.islands[i].inbox_mutex);
+    }
+    sgl_free(model.islands);
+    sgl_destroy_mutex(model.best_mutex);
+    sgl_destroy_semaphore(model.done_semaphore);
+
+    return winner;
+}
@@ -1,8 +1,16 @@
 
 #include <stb/stb_image.h>
 
-#if defined(__linux__)
+#if !defined(_WIN32)
 #include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#else
+#include <windows.h>
+#include <psapi.h>
 #endif
 
 #include "libserg.h"
@@ -27,7 +35,7 @@ typedef uint32_t b32;
 
 // ----
 
-#include "gpu.c"
+#include "memory.c"
 
 uint8_t optimal_table[64] =
 {
@@ -43,22 +51,39 @@ uint8_t optimal_table[64] =
 
 #define INITIAL_GENERATION_COUNT 48
 
-typedef struct
+// Microseconds since an arbitrary point in time.
+uint64_t evolve_time_us()
 {
-    uint8_t     table[64];
-    float       fitness;
-} PopulationElement;
+#if defined(_WIN32)
+    LARGE_INTEGER frequency, counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (uint64_t)(counter.QuadPart * 1000000 / frequency.QuadPart);
+#else
+    struct timespec ts = {0};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+#endif
+}
 
-int pe_comp(const void* va, const void* vb)
+// Renames tmp_path over path, replacing it. Files written to a temporary path
+// and then renamed are never seen half written.
+int evolve_replace_file(const char* tmp_path, const char* path)
 {
-    PopulationElement* a = (PopulationElement*)va;
-    PopulationElement* b = (PopulationElement*)vb;
+#if defined(_WIN32)
+    return MoveFileExA(tmp_path, path, MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+    return rename(tmp_path, path) == 0;
+#endif
+}
 
-    float precision = 100000.0f;
+#include "gpu.c"
 
-    int c = (int)(a->fitness*precision - b->fitness*precision);
-    return c;
-}
+typedef struct
+{
+    uint8_t     table[64];
+    float       fitness;
+} PopulationElement;
 
 typedef enum
 {
@@ -70,41 +95,320 @@ typedef enum
 } EvolutionOption;
 
 
-PopulationElement* clone_population(PopulationElement* orig)
+// Counter-based generator (splitmix64). A stream is keyed by (seed, stream,
+// index). Breeding keys it with (seed, generation, child index), so a child
+// only depends on which child it is, not on which thread breeds it or in
+// which order. Runs are reproducible for any number of threads.
+typedef struct
+{
+    uint64_t state;
+} GARng;
+
+#define GA_STREAM_INITIAL   0xffffffff  // Initial population.
+#define GA_STREAM_ISLAND    0xfffffffe  // Per-island seeds.
+#define GA_STREAM_MIGRATION 0xfffffffd  // Migration destinations.
+#define GA_STREAM_STEADY    0xfffffffc  // Steady-state children.
+#define GA_STREAM_TEMPERING 0xfffffffb  // Parallel tempering chains.
+
+uint64_t ga_mix64(uint64_t z)
+{
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+GARng ga_rng_key(uint64_t seed, uint32_t stream, uint32_t index)
+{
+    GARng rng;
+    rng.state = ga_mix64(seed ^ ga_mix64(((uint64_t)stream << 32) | index));
+    return rng;
+}
+
+int ga_rand(GARng* rng)
+{
+    rng->state += 0x9e3779b97f4a7c15ULL;
+    return (int)(ga_mix64(rng->state) >> 33);
+}
+
+#include "population.c"
+#include "operators.c"
+#include "surrogate.c"
+#include "image_source.c"
+#include "tiled.c"
+#include "jpeg_input.c"
+
+// Everything needed to turn the result of an encode into a fitness value.
+typedef struct
+{
+    DJEState    base_state;
+    GPUInfo*    gpu_info;         // NULL, or failed, means encodes run on the CPU.
+    uint64_t    base_bit_count;   // Size of the optimal (1-table) encoding, in bytes.
+    uint64_t    optimal_mse;
+    uint64_t    budget_bits;      // Estimated size limit in budget mode, in bits. 0 means no limit.
+    Tiled*      tiled;            // Encode a strip at a time. NULL means whole-image encodes.
+} FitnessContext;
+
+float fitness_from_result(FitnessContext* ctx, EvalResult* result)
+{
+    uint64_t other_bit_count = result->bit_count / 8;
+
+    float compression_ratio = (float)other_bit_count / (float)ctx->base_bit_count;
+    float error_ratio       = (float)(result->mse) / ctx->optimal_mse;
+
+    float fitness = error_ratio + 10*(compression_ratio);
+    if (ctx->budget_bits) {
+        // Only quality counts under the budget. Over it, any table is worse
+        // than every table that fits, but still well under
+        // POPULATION_INVALID_FITNESS.
+        fitness = error_ratio;
+        if (result->bit_count > ctx->budget_bits) {
+            float over = (float)(result->bit_count - ctx->budget_bits) / (float)ctx->budget_bits;
+            fitness += 100 + 100 * ((over > 5) ? 5 : over);
+        }
+    }
+    if (error_ratio < 1.0f) {
+        fitness += 1000;
+    }
+    return fitness;
+}
+
+// Uses the GPU or the block worker pool. Only one thread may call this at a time.
+// If out_result is not NULL, the raw bit count and error are written to it.
+float evaluate_fitness(FitnessContext* ctx, Arena* arena, uint8_t* table, EvalResult* out_result)
 {
-    PopulationElement* result = NULL;
-    for (int i = 0; i < sb_count(orig); ++i) {
-        sb_push(result, orig[i]);
+    EvalResult result;
+    if (ctx->tiled) {
+        tiled_encode(ctx->tiled, (uint8_t(*)[64])table, 1, &result);
+    } else {
+        arena_reset(arena);
+        DJEState state = ctx->base_state;
+        state.arena = arena;
+        dje_encode_main(&state, ctx->gpu_info, table);
+        result.bit_count = state.bit_count;
+        result.mse = state.mse;
+    }
+    if (out_result) {
+        *out_result = result;
+    }
+    return fitness_from_result(ctx, &result);
+}
+
+// Moves the device timestamps of a batch that was waited for with
+// -cl-profile to the clock of evolve_time_us. The upload was queued at the end
+// of dje_gpu_launch, at launched_us, which ties the two clocks together to
+// within the time it takes to queue the commands.
+static void gpu_batch_host_times(DJEGPUBatch* batch, uint64_t launched_us,
+                                 uint64_t* out_begin_us, uint64_t* out_end_us)
+{
+    *out_begin_us = launched_us + (batch->begin_ns - batch->queued_ns) / 1000;
+    *out_end_us = launched_us + (batch->end_ns - batch->queued_ns) / 1000;
+}
+
+// Evaluates every element of population. results gets the raw result of each
+// element.
+void evaluate_population(FitnessContext* ctx, Arena* arena, Population* population,
+                         EvalResult* results)
+{
+    if (ctx->tiled) {
+        // Every strip is extracted once for the whole population.
+        tiled_encode(ctx->tiled, population->tables, population->count, results);
+        for ( int elem_i = 0; elem_i < population->count; ++elem_i ) {
+            population->fitness[elem_i] = fitness_from_result(ctx, &results[elem_i]);
+        }
+        return;
+    }
+    if (ctx->gpu_info && !ctx->gpu_info->failed) {
+        // The whole population goes to the device in one launch.
+        arena_reset(arena);
+        DJEState state = ctx->base_state;
+        state.arena = arena;
+        uint64_t* bit_counts = arena_alloc_array(arena, population->count, uint64_t);
+        uint64_t* mse = arena_alloc_array(arena, population->count, uint64_t);
+        uint64_t launch_us = evolve_time_us();
+        DJEGPUBatch batch;
+        if ( dje_gpu_launch(&state, ctx->gpu_info, 0, population->tables, population->count, &batch) ) {
+            uint64_t launched_us = evolve_time_us();
+            if ( dje_gpu_finish(&state, ctx->gpu_info, &batch, bit_counts, mse) ) {
+                uint64_t fitness_us = evolve_time_us();
+                for ( int elem_i = 0; elem_i < population->count; ++elem_i ) {
+                    results[elem_i].bit_count = bit_counts[elem_i];
+                    results[elem_i].mse = mse[elem_i];
+                    population->fitness[elem_i] = fitness_from_result(ctx, &results[elem_i]);
+                }
+                if (ctx->gpu_info->profile) {
+                    uint64_t device_begin_us, device_end_us;
+                    gpu_batch_host_times(&batch, launched_us, &device_begin_us, &device_end_us);
+                    sgl_log("CL batch of %d tables: host launch 0-%" PRIu64 "us, device %" PRIu64 "-%" PRIu64
+                            "us, host fitness %" PRIu64 "-%" PRIu64 "us\n",
+                            batch.count, launched_us - launch_us,
+                            device_begin_us - launch_us, device_end_us - launch_us,
+                            fitness_us - launch_us, evolve_time_us() - launch_us);
+                }
+                return;
+            }
+        }
+        // The device failed and is not used again. The whole population is
+        // encoded on the CPU below.
+    }
+    for ( int elem_i = 0; elem_i < population->count; ++elem_i ) {
+        population->fitness[elem_i] = evaluate_fitness(ctx, arena, population->tables[elem_i],
+                                                       &results[elem_i]);
     }
-    return result;
 }
 
-PopulationElement grab_element(PopulationElement* population, int start, int* out_idx)
+// Reentrant version of evaluate_fitness. Every block is encoded on the calling
+// thread.
+float evaluate_fitness_serial(FitnessContext* ctx, Arena* arena, uint8_t* table)
 {
-    int count = sb_count(population);
-    int uniform_number = 1 + (rand() % count);
+    arena_reset(arena);
+    DJEState state = ctx->base_state;
+    state.arena = arena;
+    dje_encode_serial(&state, table);
+    EvalResult result = { state.bit_count, state.mse };
+    return fitness_from_result(ctx, &result);
+}
 
-    // Cumulative
-    double pareto_number = 1.0 - (1.0 / (double)uniform_number);
+void fill_initial_population(Population* population, int count, uint64_t seed)
+{
+    population->count = 0;
+    for (int i = 0; i < count; ++i) {
+        uint8_t table[64] = {0};
+        GARng rng = ga_rng_key(seed, GA_STREAM_INITIAL, (uint32_t)i);
 
-    int pareto_index = count - (int) (pareto_number * (double)count ) - 2;
+        if (i == 0) {
+            memcpy(table, optimal_table, 64*sizeof(uint8_t));
+        }
+        else for ( int ti = 1; ti < 64; ++ti )
+        {
+            table[ti] = (uint8_t)(1 + (ga_rand(&rng) % 25));
+        }
+        table[0] = 1;
 
-    if (pareto_index < 0) {
-        pareto_index = 0;
+        population_push(population, table, FLT_MAX);
     }
-    if ( pareto_index < start ) {
-        pareto_index = start;
+}
+
+// Fills population with table and count - 1 random variations of it.
+void fill_population_around(Population* population, int count, uint8_t* table, uint64_t seed)
+{
+    population->count = 0;
+    population_push(population, table, FLT_MAX);
+    for (int i = 1; i < count; ++i) {
+        uint8_t child[64];
+        GARng rng = ga_rng_key(seed, GA_STREAM_INITIAL, (uint32_t)i);
+        for ( int ti = 0; ti < 64; ++ti ) {
+            int val = table[ti];
+            if (ga_rand(&rng) % 4 == 0) {
+                val += -4 + ga_rand(&rng) % 9;
+            }
+            child[ti] = (uint8_t)((val < 1) ? 1 : ((val > 255) ? 255 : val));
+        }
+        population_push(population, child, FLT_MAX);
     }
+}
 
-    if ( out_idx )
-        *out_idx = pareto_index;
+// Breeds one child from parents into element ci of children, with its
+// breeding state. parents must be ranked. rates may be NULL for the default
+// operator rates.
+void breed_child(Population* parents, OperatorRates* rates, Population* children, int ci,
+                 GARng* rng)
+{
+    uint8_t* child = children->tables[ci];
+    uint8_t* child_steps = children->steps[ci];
+
+    EvolutionOption process_select = operator_pick(rates, rng);
+
+    int rank = grab_element(parents, 0, rng);
+    int parent = parents->order[rank];
+    memcpy(child, parents->tables[parent], 64);
+    memcpy(child_steps, parents->steps[parent], 64);
+
+    switch (process_select) {
+    case MUTATION: {
+        operator_mutate(child, child_steps, ga_rand(rng) % 64, rng);
+    } break;
+    case CROSSOVER: {
+        int father = parents->order[grab_element(parents, rank+1, rng)];
+        for ( int i = 0; i < 64; ++i )
+        {
+            int zi = djei_zig_zag[i];
+            if ( ga_rand(rng) % 2 ) {
+                child[zi] = parents->tables[father][zi];
+                child_steps[zi] = parents->steps[father][zi];
+            }
+        }
+    } break;
+    case REPRODUCTION:
+    default:
+        break;
+    }
+    children->op[ci] = (uint8_t)process_select;
+    children->parent_fitness[ci] = parents->fitness[parent];
+    for (int j = 0; j < 64; ++j) {
+        if (child[j] <= 0) {
+            sgl_assert(!"FAIL");
+        }
+    }
+}
 
-    PopulationElement elem = population[pareto_index];
+// Fills children with count elements bred from parents, which must be ranked.
+// rates may be NULL for the default operator rates. Every child gets its own
+// random stream, keyed by seed, generation and its index, so the result does
+// not depend on the order in which children are bred.
+void breed_population(Population* parents, OperatorRates* rates, Population* children, int count,
+                      uint64_t seed, int generation)
+{
+    assert(count <= children->capacity);
+    for ( int ei = 0; ei < count; ++ei ) {
+        GARng rng = ga_rng_key(seed, (uint32_t)generation, (uint32_t)ei);
+        breed_child(parents, rates, children, ei, &rng);
+        children->fitness[ei] = FLT_MAX;
+        children->order[ei] = ei;
+    }
+    children->count = count;
+}
 
-    return elem;
+// Breeds factor * count candidates and keeps the count of them that the
+// surrogate predicts to be best. Their predicted fitness is written to
+// predicted. candidates must have room for factor * count elements.
+void breed_population_screened(Population* parents, OperatorRates* rates,
+                               Population* candidates, Population* children,
+                               int count, int factor, uint64_t seed, int generation,
+                               FitnessContext* ctx, Surrogate* surrogate, float* predicted)
+{
+    breed_population(parents, rates, candidates, count * factor, seed, generation);
+    for ( int i = 0; i < candidates->count; ++i ) {
+        EvalResult result = surrogate_predict(surrogate, candidates->tables[i]);
+        candidates->fitness[i] = fitness_from_result(ctx, &result);
+    }
+    population_select_best(candidates, count);
+
+    children->count = 0;
+    for ( int i = 0; i < count; ++i ) {
+        int idx = candidates->order[i];
+        predicted[i] = candidates->fitness[idx];
+        int ci = population_push_from(children, candidates, idx);
+        children->fitness[ci] = FLT_MAX;
+    }
 }
 
-int main()
+#define CONVERGENCE_LIMIT 10  // If we are withing the convergence threshold 4 times in a row, end evolution loop.
+
+#include "best_writer.c"
+#include "islands.c"
+#include "steady_state.c"
+#include "pipeline.c"
+#include "cmaes.c"
+#include "memetic.c"
+#include "tempering.c"
+#include "pareto.c"
+#include "budget.c"
+#include "exact.c"
+#include "optimizer.c"
+#include "prelude_cache.c"
+#include "checkpoint.c"
+
+int main(int argc, char** argv)
 {
 #if 1
     int use_gpu = true;
@@ -112,138 +416,526 @@ int main()
     int use_gpu = false;
 #endif
 
+    char* fname =
+            "diego.bmp";
+            //"pluto.bmp";
+            //"in.bmp";
+            //"in_klay.bmp";
+
+    int population_size = INITIAL_GENERATION_COUNT;
+    int num_threads = 8;  // Size of the block worker pool.
+    int surrogate_factor = 0;  // Children bred per evaluated child. 0 means no surrogate.
+    OptimizerKind optimizer_kind = OptimizerKind_GA;
+    float target_fitness = 0;  // Log when the best fitness gets this low.
+    uint64_t seed = 0;
+    int seed_given = false;
+
+    IslandParams island_params = island_default_params();
+    SteadyStateParams steady_params = steady_state_default_params();
+    PipelineParams pipeline_params = pipeline_default_params();
+    MemeticParams memetic_params = memetic_default_params();
+    TemperingParams tempering_params = tempering_default_params();
+    ParetoParams pareto_params = pareto_default_params();
+    BudgetParams budget_params = budget_default_params();
+    ExactParams exact_params = exact_default_params();
+    TiledParams tiled_params = tiled_default_params();
+    int huge_pages = false;
+    int raw_width = 0;  // Read fname as a headerless file of this size.
+    int raw_height = 0;
+    ImageLayout raw_layout = ImageLayout_RGB;
+    const char* cl_cache_dir = NULL;  // Where built OpenCL programs go. NULL means no cache. Set by -cl-cache.
+    int cl_profile = false;  // Log host and device timestamps of every GPU batch.
+    int requantize = false;  // fname is a JPEG. Evaluate and write its own coefficients.
+    double time_limit = 0;  // In seconds. 0 means no limit.
+    int anytime = false;  // Write every new best table to out_evolved.jpg as it is found.
+    int checkpoint_interval = 0;  // In generations. 0 means no snapshots.
+    const char* checkpoint_path = "evolve.ckpt";
+    int resume = false;
+    const char* prelude_dir = NULL;  // Where prelude caches go. NULL means no cache.
+
+    for ( int i = 1; i < argc; ++i ) {
+        if ( !strcmp(argv[i], "-population") && i + 1 < argc ) {
+            population_size = atoi(argv[++i]);
+            if (population_size < 2) {
+                sgl_log("Population size must be at least 2.\n");
+                exit(EXIT_FAILURE);
+            }
+        } else if ( !strcmp(argv[i], "-seed") && i + 1 < argc ) {
+            seed = strtoull(argv[++i], NULL, 10);
+            seed_given = true;
+        } else if ( !strcmp(argv[i], "-threads") && i + 1 < argc ) {
+            num_threads = atoi(argv[++i]);
+            if (num_threads < 1) {
+                sgl_log("Need at least one thread.\n");
+                exit(EXIT_FAILURE);
+            }
+        } else if ( !strcmp(argv[i], "-islands") && i + 1 < argc ) {
+            island_params.num_islands = atoi(argv[++i]);
+        } else if ( !strcmp(argv[i], "-topology") && i + 1 < argc ) {
+            ++i;
+            if ( !strcmp(argv[i], "ring") ) {
+                island_params.topology = IslandTopology_RING;
+            } else if ( !strcmp(argv[i], "random") ) {
+                island_params.topology = IslandTopology_RANDOM;
+            } else {
+                sgl_log("Unknown topology %s. Expected ring or random.\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+        } else if ( !strcmp(argv[i], "-migration-interval") && i + 1 < argc ) {
+            island_params.migration_interval = atoi(argv[++i]);
+        } else if ( !strcmp(argv[i], "-migrants") && i + 1 < argc ) {
+            island_params.num_migrants = atoi(argv[++i]);
+        } else if ( !strcmp(argv[i], "-steady") && i + 1 < argc ) {
+            steady_params.num_workers = atoi(argv[++i]);
+        } else if ( !strcmp(argv[i], "-pipeline") ) {
+            pipeline_params.enabled = true;
+        } else if ( !strcmp(argv[i], "-optimizer") && i + 1 < argc ) {
+            ++i;
+            if ( !strcmp(argv[i], "ga") ) {
+                optimizer_kind = OptimizerKind_GA;
+            } else if ( !strcmp(argv[i], "cmaes") ) {
+                optimizer_kind = OptimizerKind_CMAES;
+            } else {
+                sgl_log("Unknown optimizer %s. Expected ga or cmaes.\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+        } else if ( !strcmp(argv[i], "-target") && i + 1 < argc ) {
+            target_fitness = (float)atof(argv[++i]);
+        } else if ( !strcmp(argv[i], "-memetic") && i + 1 < argc ) {
+            memetic_params.num_elites = atoi(argv[++i]);
+        } else if ( !strcmp(argv[i], "-memetic-interval") && i + 1 < argc ) {
+            memetic_params.interval = atoi(argv[++i]);
+        } else if ( !strcmp(argv[i], "-tempering") && i + 1 < argc ) {
+            tempering_params.num_chains = atoi(argv[++i]);
+        } else if ( !strcmp(argv[i], "-proposals") && i + 1 < argc ) {
+            tempering_params.max_proposals = atoll(argv[++i]);
+        } else if ( !strcmp(argv[i], "-time-limit") && i + 1 < argc ) {
+            time_limit = atof(argv[++i]);
+        } else if ( !strcmp(argv[i], "-anytime") ) {
+            anytime = true;
+        } else if ( !strcmp(argv[i], "-checkpoint") && i + 1 < argc ) {
+            checkpoint_interval = atoi(argv[++i]);
+        } else if ( !strcmp(argv[i], "-checkpoint-file") && i + 1 < argc ) {
+            checkpoint_path = argv[++i];
+        } else if ( !strcmp(argv[i], "-resume") ) {
+            resume = true;
+        } else if ( !strcmp(argv[i], "-prelude-cache") && i + 1 < argc ) {
+            prelude_dir = argv[++i];
+        } else if ( !strcmp(argv[i], "-pareto") && i + 1 < argc ) {
+            pareto_params.num_levels = atoi(argv[++i]);
+        } else if ( !strcmp(argv[i], "-pareto-out") && i + 1 < argc ) {
+            pareto_params.out_path = argv[++i];
+        } else if ( !strcmp(argv[i], "-budget") && i + 1 < argc ) {
+            budget_params.max_bytes = (uint32_t)strtoul(argv[++i], NULL, 10);
+        } else if ( !strcmp(argv[i], "-raw") && i + 3 < argc ) {
+            raw_width = atoi(argv[++i]);
+            raw_height = atoi(argv[++i]);
+            const char* layout = argv[++i];
+            if ( !strcmp(layout, "rgb") ) {
+                raw_layout = ImageLayout_RGB;
+            } else if ( !strcmp(layout, "rgba") ) {
+                raw_layout = ImageLayout_RGBA;
+            } else if ( !strcmp(layout, "bgr") ) {
+                raw_layout = ImageLayout_BGR;
+            } else if ( !strcmp(layout, "bgra") ) {
+                raw_layout = ImageLayout_BGRA;
+            } else if ( !strcmp(layout, "planar") ) {
+                raw_layout = ImageLayout_PLANAR;
+            } else {
+                sgl_log("Unknown raw layout %s. Use rgb, rgba, bgr, bgra or planar.\n", layout);
+                exit(EXIT_FAILURE);
+            }
+        } else if ( !strcmp(argv[i], "-cpu") ) {
+            use_gpu = false;
+        } else if ( !strcmp(argv[i], "-cl-cache") && i + 1 < argc ) {
+            cl_cache_dir = argv[++i];
+        } else if ( !strcmp(argv[i], "-no-cl-cache") ) {
+            cl_cache_dir = NULL;
+        } else if ( !strcmp(argv[i], "-cl-profile") ) {
+            cl_profile = true;
+        } else if ( !strcmp(argv[i], "-requantize") ) {
+            requantize = true;
+        } else if ( !strcmp(argv[i], "-huge-pages") ) {
+            huge_pages = true;
+        } else if ( !strcmp(argv[i], "-tiled") && i + 1 < argc ) {
+            tiled_params.strip_rows = atoi(argv[++i]);
+        } else if ( !strcmp(argv[i], "-exact") && i + 1 < argc ) {
+            exact_params.num_exact = atoi(argv[++i]);
+        } else if ( !strcmp(argv[i], "-surrogate") && i + 1 < argc ) {
+            surrogate_factor = atoi(argv[++i]);
+            if (surrogate_factor < 2) {
+                sgl_log("-surrogate needs at least 2 children bred per evaluated child.\n");
+                exit(EXIT_FAILURE);
+            }
+        } else if ( argv[i][0] != '-' ) {
+            fname = argv[i];
+        } else {
+            sgl_log("Unknown option %s\n", argv[i]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (optimizer_kind != OptimizerKind_GA &&
+        (island_params.num_islands > 0 || steady_params.num_workers > 0 ||
+         tempering_params.num_chains > 0 || pareto_params.num_levels > 0)) {
+        sgl_log("Islands, the steady state GA, parallel tempering and the pareto mode only work with -optimizer ga.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (budget_params.max_bytes > 0 &&
+        (island_params.num_islands > 0 || steady_params.num_workers > 0 ||
+         tempering_params.num_chains > 0 || pareto_params.num_levels > 0)) {
+        sgl_log("-budget only works with the generational optimizers.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (exact_params.num_exact > 0 &&
+        (island_params.num_islands > 0 || steady_params.num_workers > 0 ||
+         tempering_params.num_chains > 0 || pareto_params.num_levels > 0 ||
+         memetic_params.num_elites > 0)) {
+        sgl_log("-exact only works with the generational optimizers, without -memetic.\n");
+        exit(EXIT_FAILURE);
+    }
+    if ((checkpoint_interval > 0 || resume) &&
+        (island_params.num_islands > 0 || steady_params.num_workers > 0 ||
+         tempering_params.num_chains > 0 || pareto_params.num_levels > 0)) {
+        sgl_log("Snapshots only work with the generational optimizers.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (pipeline_params.enabled &&
+        (optimizer_kind != OptimizerKind_GA || surrogate_factor > 0 ||
+         island_params.num_islands > 0 || steady_params.num_workers > 0 ||
+         tempering_params.num_chains > 0 || pareto_params.num_levels > 0 ||
+         memetic_params.num_elites > 0 || budget_params.max_bytes > 0 ||
+         exact_params.num_exact > 0 || checkpoint_interval > 0 || resume)) {
+        sgl_log("-pipeline does not work with -optimizer cmaes, -surrogate, -islands, -steady, -tempering, "
+                "-pareto, -memetic, -budget, -exact or snapshots.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (time_limit > 0) {
+        // With a deadline, the best table so far is always on disk.
+        anytime = true;
+        island_params.time_limit = time_limit;
+        steady_params.time_limit = time_limit;
+        pipeline_params.time_limit = time_limit;
+        tempering_params.time_limit = time_limit;
+        pareto_params.time_limit = time_limit;
+        // Stop on time, not on proposals.
+        tempering_params.max_proposals = INT64_MAX;
+    }
+
+    // -budget and -exact run tiny_jpeg on the whole image, which takes a
+    // packed copy of it.
+    if (tiled_params.strip_rows > 0 &&
+        (island_params.num_islands > 0 || steady_params.num_workers > 0 ||
+         tempering_params.num_chains > 0 || pareto_params.num_levels > 0 ||
+         memetic_params.num_elites > 0 || budget_params.max_bytes > 0 ||
+         exact_params.num_exact > 0 || checkpoint_interval > 0 || resume ||
+         prelude_dir)) {
+        sgl_log("-tiled only works with the generational optimizers, without -memetic, -budget, -exact, "
+                "snapshots or -prelude-cache.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (requantize &&
+        (tiled_params.strip_rows > 0 || raw_width > 0 || budget_params.max_bytes > 0 ||
+         exact_params.num_exact > 0 || checkpoint_interval > 0 || resume || prelude_dir)) {
+        sgl_log("-requantize does not work with -tiled, -raw, -budget, -exact, snapshots or -prelude-cache.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Islands, steady-state workers and tempering chains evaluate on their
+    // own threads, one block at a time. They do not go through the GPU.
+    // Neither do strips, which would need a new upload each, nor JPEG
+    // coefficients, which the kernel would transform again from samples.
+    if (island_params.num_islands > 0 || steady_params.num_workers > 0 ||
+        tempering_params.num_chains > 0 || tiled_params.strip_rows > 0 || requantize) {
+        use_gpu = false;
+    }
+
+    // OpenCL is only touched once it is known to be used. Without a working
+    // device, dje_init starts the CPU workers instead.
     GPUInfo* gpu_info = NULL;
     if (use_gpu) {
-        gpu_info = gpu_init();
+        gpu_info = gpu_init(cl_cache_dir, cl_profile);
         if (!gpu_info) {
-            sgl_log("Could not init GPGPU.\n");
-            exit(EXIT_FAILURE);
+            sgl_log("Could not init GPGPU. Encoding on %d CPU threads.\n", num_threads);
         }
     }
 
-    size_t memsz = 1L * 1024 * 1024 * 1024;
-    Arena root_arena = arena_init(sgl_calloc(memsz, 1), memsz);
-    if (!root_arena.ptr) {
-        sgl_log("Can't allocate memory. Exiting\n");
-        exit(EXIT_FAILURE);
+    // Resuming needs the prelude cache, so snapshots imply one.
+    if ((checkpoint_interval > 0 || resume) && !prelude_dir) {
+        prelude_dir = ".";
     }
 
     int w, h, ncomp;
-    char* fname =
-            "diego.bmp";
-            //"pluto.bmp";
-            //"in.bmp";
-            //"in_klay.bmp";
-    unsigned char* data = stbi_load(fname, &w, &h, &ncomp, 0);
-
-    if ( !data ) {
-        printf("stb_image failed to load image.\n");
+    ImageSource source = {0};
+    JpegInput jpeg_input = {0};
+    b32 have_image = false;
+    PreludeCache prelude_cache = {0};
+    uint64_t image_hash = 0;
+    b32 have_hash = false;
+    if (resume) {
+        if (!checkpoint_read_header(checkpoint_path, &seed, &image_hash)) {
+            sgl_log("Could not read %s\n", checkpoint_path);
+            exit(EXIT_FAILURE);
+        }
+        seed_given = true;
+        have_hash = true;
+    } else if (prelude_dir) {
+        have_hash = prelude_hash_file(fname, &image_hash);
+    }
+    char prelude_path[1024] = {0};
+    if (prelude_dir && have_hash) {
+        prelude_cache_path(prelude_path, sizeof(prelude_path), prelude_dir, image_hash);
+        uint64_t begin_us = evolve_time_us();
+        if (prelude_cache_open(&prelude_cache, prelude_path, image_hash)) {
+            image_source_from_memory(&source, prelude_cache.data, prelude_cache.width,
+                                     prelude_cache.height, prelude_cache.num_components);
+            have_image = true;
+            sgl_log("Mapped %s in %" PRIu64 "us\n", prelude_path, evolve_time_us() - begin_us);
+        }
+    }
+    if (requantize) {
+        uint64_t begin_us = evolve_time_us();
+        have_image = jpeg_input_open(&jpeg_input, fname);
+        if (have_image) {
+            sgl_log("Read the coefficients of %s in %" PRIu64 "us\n", fname,
+                    evolve_time_us() - begin_us);
+        }
+    } else if (!have_image) {
+        have_image = (raw_width > 0) ?
+                image_source_open_raw(&source, fname, raw_width, raw_height, raw_layout) :
+                image_source_open(&source, fname);
+    }
+    if ( !have_image ) {
+        printf("Could not load %s.\n", fname);
         exit(EXIT_FAILURE);
     }
+    if (requantize) {
+        w     = jpeg_input.width;
+        h     = jpeg_input.height;
+        ncomp = jpeg_input.num_components;
+    } else {
+        w     = source.image.width;
+        h     = source.image.height;
+        ncomp = source.num_components;
+    }
 
-    srand((unsigned int)(*data));
+    if (!seed_given) {
+        seed = requantize ? jpeg_input.y_blocks[0].d[0] :
+                source.image.pixels[source.image.channel_offset[0]];
+    }
+    sgl_log("Seed: %" PRIu64 "\n", seed);
 
-    FILE* plot_file = fopen("evo.dat", "w");
+    FILE* plot_file = fopen("evo.dat", resume ? "a" : "w");
     assert (plot_file);
 
-    size_t size = (size_t)2 * 1024 * 1024 * 1024;
-    void* memory = sgl_calloc(size, 1);
-    if ( !memory ) {
-        sgl_log("Could not allocate enough memory for the parallel encoder.n");
-        return EXIT_FAILURE;
+    // Sized for the blocks that exist at once: a strip in tiled mode, the
+    // whole image otherwise.
+    int64_t num_arena_blocks = (int64_t)((w + 7) / 8) *
+            ((tiled_params.strip_rows > 0 && tiled_params.strip_rows < h) ?
+             (tiled_params.strip_rows + 7) / 8 : (h + 7) / 8);
+    int num_workers = 1;
+    if (island_params.num_islands > num_workers)  num_workers = island_params.num_islands;
+    if (steady_params.num_workers > num_workers)  num_workers = steady_params.num_workers;
+    if (tempering_params.num_chains > num_workers) num_workers = tempering_params.num_chains;
+    size_t memsz = memory_root_size(num_arena_blocks, num_workers);
+    Arena root_arena = arena_init(memory_reserve(memsz, huge_pages), memsz);
+    if (!root_arena.ptr) {
+        sgl_log("Can't reserve %zu MB of memory. Exiting\n", memsz / (1024 * 1024));
+        exit(EXIT_FAILURE);
     }
 
-    DJEState base_state = dje_init(&root_arena, gpu_info, w, h, ncomp, data);
+    // Blocks are read straight from the source. Tiled mode reads them later,
+    // a strip at a time.
+    DJEImage prelude_image = source.image;
+    if (tiled_params.strip_rows > 0) {
+        prelude_image.pixels = NULL;
+    }
+    prelude_image.width = w;
+    prelude_image.height = h;
+    DJEState base_state = dje_init(&root_arena, &gpu_info, num_threads, &prelude_image,
+                                   requantize ? jpeg_input.y_blocks : prelude_cache.y_blocks);
+    if (requantize) {
+        // Already transformed. No encode runs fdct.
+        base_state.dct_blocks = jpeg_input.dct_blocks;
+    } else if (prelude_cache.file.data) {
+        // Every CPU encode reads the cached DCT instead of running fdct.
+        base_state.dct_blocks = prelude_cache.dct_blocks;
+    } else if (prelude_path[0]) {
+        prelude_cache_write(prelude_path, image_hash, &base_state, w, h, ncomp,
+                            image_source_packed(&source));
+    }
+    if (memetic_params.num_elites > 0 || tempering_params.num_chains > 0 ||
+        pareto_params.num_levels > 0) {
+        dje_delta_prepare(&base_state);
+    }
 
 
     // Optimal state -- The result obtained from using a 1-table. Minimum
     // compression. Maximum quality. The best quality possible for baseline
     // JPEG.
-    DJEState optimal_state = base_state;
-    dje_encode_main(&optimal_state, gpu_info, optimal_table);
-
-    PopulationElement* population = NULL;
-
-    // ---- Fill initial population.
-
-    for (int i = 0; i < INITIAL_GENERATION_COUNT; ++i) {
-        PopulationElement e = {0};
-
-        if (i == 0) {
-            memcpy(e.table, optimal_table, 64*sizeof(uint8_t));
-        }
-        else for ( int ti = 1; ti < 64; ++ti )
-        {
-            e.table[ti] = 1 + (rand() % 25);
-        }
-        e.table[0] = 1;
+    FitnessContext fitness_ctx = {0};
+    fitness_ctx.base_state     = base_state;
+    fitness_ctx.gpu_info       = gpu_info;
+    EvalResult optimal_result;
+    if (tiled_params.strip_rows > 0) {
+        fitness_ctx.tiled = arena_alloc_elem(&root_arena, Tiled);
+        tiled_init(fitness_ctx.tiled, &tiled_params, &root_arena, &source,
+                   &fitness_ctx.base_state, num_threads);
+        tiled_encode(fitness_ctx.tiled, (uint8_t(*)[64])optimal_table, 1, &optimal_result);
+        sgl_log("Tiled: optimal table estimated at %" PRIu64 " bits.\n", optimal_result.bit_count);
+    } else {
+        DJEState optimal_state = base_state;
+        dje_encode_main(&optimal_state, gpu_info, optimal_table);
+        optimal_result.bit_count = optimal_state.bit_count;
+        optimal_result.mse = optimal_state.mse;
+    }
+    fitness_ctx.base_bit_count = optimal_result.bit_count / 8;
+    fitness_ctx.optimal_mse    = optimal_result.mse;
+
+    Memetic* memetic = NULL;
+    if (memetic_params.num_elites > 0) {
+        memetic = arena_alloc_elem(&root_arena, Memetic);
+        memset(memetic, 0, sizeof(Memetic));
+        memetic->params = memetic_params;
+        memetic->fitness_ctx = &fitness_ctx;
+        size_t cache_size = (size_t)base_state.num_blocks *
+                (64 * sizeof(int16_t) + sizeof(uint32_t) + sizeof(uint64_t)) + 1024;
+        memetic->arena = arena_push(&root_arena, cache_size);
+    }
 
-        e.fitness = FLT_MAX;
+    Optimizer* optimizer = arena_alloc_elem(&root_arena, Optimizer);
+    optimizer_init(optimizer, optimizer_kind, &root_arena, &fitness_ctx, population_size,
+                   surrogate_factor, memetic, seed);
+    EvalResult* results = arena_alloc_array(&root_arena, population_size, EvalResult);
+
+    Budget* budget = NULL;
+    if (budget_params.max_bytes > 0) {
+        budget = arena_alloc_elem(&root_arena, Budget);
+        memset(budget, 0, sizeof(Budget));
+        budget->params         = budget_params;
+        budget->fitness_ctx    = &fitness_ctx;
+        budget->width          = w;
+        budget->height         = h;
+        budget->num_components = ncomp;
+        budget->data           = image_source_packed(&source);
+    }
 
-        sb_push(population, e);
+    Exact* exact = NULL;
+    if (exact_params.num_exact > 0) {
+        exact = arena_alloc_elem(&root_arena, Exact);
+        exact_init(exact, &exact_params, &root_arena, &fitness_ctx, w, h, ncomp,
+                   image_source_packed(&source));
     }
 
     // Arena used once per item every generation
     Arena iter_arena = arena_push(&root_arena, arena_available_space(&root_arena));
 
-    uint32_t base_bit_count   = optimal_state.bit_count / 8;
     float last_winner_fitness = FLT_MAX;
 
     int convergence_hits = 0;
-#define CONVERGENCE_LIMIT 10  // If we are withing the convergence threshold 4 times in a row, end evolution loop.
 
     int num_generations = 500;
 
-#ifdef _WIN32
-    LARGE_INTEGER run_measure_begin;
-    QueryPerformanceCounter(&run_measure_begin);
-#elif __linux__
-    struct timespec ts = {0};
-    clock_gettime(CLOCK_REALTIME, &ts);
-#endif
+    PopulationElement winner = {0};
+    winner.fitness = FLT_MAX;
 
-    // Evolution loop ----
-    for ( int gen_i = 0; ; ++gen_i ) {
-        PopulationElement* old_population = clone_population(population);
-        sb_free(population);
-        population = NULL;
+    int64_t num_evaluations = 0;
+    b32 target_reached = false;
 
+    uint64_t run_begin_us = evolve_time_us();
 
-        // --- Evaluate fitness
+    BestWriter best_writer_storage;
+    BestWriter* best_writer = NULL;
+    if (anytime) {
+        best_writer = &best_writer_storage;
+        best_writer_start(best_writer, "out_evolved.jpg", w, h, ncomp,
+                          requantize ? NULL : image_source_packed(&source),
+                          requantize ? &jpeg_input : NULL);
+    }
+
+    if (budget) {
+        budget_calibrate(budget, &iter_arena);
+        optimizer_start_from(optimizer, budget->base_table);
+    }
 
-        float fitness_sum = 0;
-        for ( int elem_i = 0; elem_i < sb_count(old_population); ++elem_i ) {
-            arena_reset(&iter_arena);
-            DJEState state = base_state;
-            state.arena = &iter_arena;
-            dje_encode_main(&state, gpu_info, old_population[elem_i].table);
+    int first_generation = 0;
+    if (resume) {
+        LoopState loop = {0};
+        if (!checkpoint_read(checkpoint_path, &loop, optimizer, population_size)) {
+            exit(EXIT_FAILURE);
+        }
+        first_generation    = loop.generation;
+        convergence_hits    = loop.convergence_hits;
+        num_evaluations     = loop.num_evaluations;
+        last_winner_fitness = loop.last_winner_fitness;
+        winner              = loop.winner;
+        if (exact) {
+            exact->correction  = loop.exact_correction;
+            exact->num_encodes = loop.exact_encodes;
+        }
+        sgl_log("Resuming after generation %d. Best: %f\n", first_generation, winner.fitness);
+    }
 
-            uint32_t other_bit_count = state.bit_count / 8;
+    if (island_params.num_islands > 0) {
+        island_params.num_generations = num_generations;
+        island_params.population_size = population_size;
+        winner = island_evolve(&island_params, &fitness_ctx, &iter_arena, best_writer, seed);
+    }
+    else if (steady_params.num_workers > 0) {
+        steady_params.population_size = population_size;
+        winner = steady_state_evolve(&steady_params, &fitness_ctx, &iter_arena,
+                                     plot_file, best_writer, seed);
+    }
+    else if (pipeline_params.enabled) {
+        pipeline_params.max_batches = num_generations;
+        pipeline_params.population_size = population_size;
+        winner = pipeline_evolve(&pipeline_params, &fitness_ctx, &iter_arena,
+                                 plot_file, best_writer, seed);
+    }
+    else if (tempering_params.num_chains > 0) {
+        winner = tempering_evolve(&tempering_params, &fitness_ctx, &iter_arena, best_writer, seed);
+    }
+    else if (pareto_params.num_levels > 0) {
+        pareto_params.num_generations = num_generations;
+        winner = pareto_evolve(&pareto_params, &fitness_ctx, &iter_arena, plot_file,
+                               best_writer, population_size, seed);
+    }
+    // Evolution loop ----
+    else for ( int gen_i = first_generation; ; ++gen_i ) {
 
-            float compression_ratio = (float)other_bit_count / (float)base_bit_count;
-            float error_ratio       = (float)(state.mse) / optimal_state.mse;
+        Population* population = optimizer_ask(optimizer, gen_i);
 
-            float fitness = error_ratio + 10*(compression_ratio);
-            if (error_ratio < 1.0f) {
-                fitness += 1000;
-            }
+        // --- Evaluate fitness
 
-            old_population[elem_i].fitness = fitness;
+        evaluate_population(&fitness_ctx, &iter_arena, population, results);
+        num_evaluations += population->count;
+        if (exact) {
+            exact_correct(exact, population, results);
         }
 
-        // Sort by fitness.
-        qsort(old_population, sb_count(old_population), sizeof(PopulationElement), pe_comp);
-        float winner_fitness = old_population[0].fitness;
+        optimizer_tell(optimizer, results);
+
+        float winner_fitness = population->fitness[population->order[0]];
+        if ( winner_fitness < winner.fitness ) {
+            winner = population_element(population, 0);
+            if (best_writer) {
+                best_writer_post(best_writer, winner.table, winner.fitness);
+            }
+        }
 
         // --- Output
 
-        // Find worst (our horrible janky hack adds 1000 to elements with numerical errors.)
-        while (sb_peek(old_population).fitness > 900)
-            sb_pop(old_population);
+        // Output best and worst. (Worst excludes elements with numerical errors.)
+        float worst_fitness = population->fitness[population->order[population->num_ranked - 1]];
+        sgl_log("Gen %d \nBest: %f\nWorst: %f\nEvaluations: %" PRId64 "\n",
+                gen_i+1, winner_fitness, worst_fitness, num_evaluations);
 
-        // Output best and worst.
-        sgl_log("Gen %d \nBest: %f\nWorst: %f\n",
-                gen_i+1, old_population[0].fitness, old_population[sb_count(old_population) - 1].fitness);
+        if ( !target_reached && winner.fitness <= target_fitness ) {
+            target_reached = true;
+            sgl_log("Reached target fitness %f after %" PRId64 " evaluations, %" PRIu64 "us\n",
+                    target_fitness, num_evaluations, evolve_time_us() - run_begin_us);
+        }
 
         float fdiff = winner_fitness - last_winner_fitness;
         sgl_log("(Diff is %f)\n", fdiff);
@@ -257,159 +949,78 @@ int main()
         }
 
         if ( gen_i == num_generations || convergence_hits == CONVERGENCE_LIMIT) {
-            population = old_population;
+            break;
+        }
+        if ( time_limit > 0 && evolve_time_us() - run_begin_us > (uint64_t)(time_limit * 1000000) ) {
+            sgl_log("Time limit reached.\n");
             break;
         }
 
         last_winner_fitness = winner_fitness;
 
         char buffer[1024];
-        snprintf(buffer, 1024, "%d %f %f\n", gen_i+1, old_population[0].fitness, sb_peek(old_population).fitness);
+        snprintf(buffer, 1024, "%d %f %f\n", gen_i+1, winner_fitness, worst_fitness);
         fwrite(buffer, strlen(buffer), 1, plot_file);
 
-        assert ( population == NULL );
-
-
-        // ---- Create new population
-
-        /* int prob_mutation = 70; */
-        /* int prob_crossover = 25; */
-        /* int prob_reproduction = 5; */
-#if 1
-        int prob_mutation = 80;
-        int prob_crossover = 15;
-        int prob_reproduction = 5;
-
-        for ( size_t ei = 0; ei < INITIAL_GENERATION_COUNT; ++ei ) {
-            EvolutionOption process_select = NONE;
-
-            int dieroll = rand() % 100;
-
-            if (dieroll < prob_reproduction) {
-                process_select = REPRODUCTION;
-            } else if (dieroll < prob_crossover) {
-                process_select = CROSSOVER;
-            } else {
-                process_select = MUTATION;
-            }
-#else
-        int prob_crossover = 85;
-        int prob_reproduction = 10;
-        int prob_mutation = 5;
-
-        for ( size_t ei = 0; ei < INITIAL_GENERATION_COUNT; ++ei ) {
-            EvolutionOption process_select = NONE;
-
-            int dieroll = rand() % 100;
-
-            if (dieroll < prob_mutation) {
-                process_select = MUTATION;
-            } else if (dieroll < prob_reproduction) {
-                process_select = REPRODUCTION;
-            } else {
-                process_select = CROSSOVER;
-            }
-#endif
-
-            switch (process_select) {
-            case MUTATION:
-                {
-                    PopulationElement e = grab_element(old_population, 0, NULL);
-                    size_t idx = rand() % 64;
-                    int val = e.table[idx];
-                    val += -4 + rand() % 8;
-                    if (val <= 0)
-                    {
-                        val = 1;
-                    }
-                    else if ( val > 255 )
-                    {
-                        val = 255;
-                    }
-                    e.table[idx] = (uint8_t)val;
-                    sb_push(population, e);
-                } break;
-            case CROSSOVER: {
-
-#if 0
-                PopulationElement children[2] = { 0 };
-                PopulationElement parents[2];
-                int idx = 0;
-                parents[0] = grab_element(old_population, 0, &idx);
-                parents[1] = grab_element(old_population, idx+1, NULL);
-
-                size_t crosspoint = rand() % 64;
-                for ( int i = 0; i < 64; ++i ) {
-                    if ( ei < crosspoint ) {
-                        children[0].table[djei_zig_zag[i]] = parents[0].table[djei_zig_zag[i]];
-                        children[1].table[djei_zig_zag[i]] = parents[1].table[djei_zig_zag[i]];
-                    } else {
-                        children[0].table[djei_zig_zag[i]] = parents[1].table[djei_zig_zag[i]];
-                        children[1].table[djei_zig_zag[i]] = parents[0].table[djei_zig_zag[i]];
-                    }
-                }
-                sb_push(population, children[0]);
-                sb_push(population, children[1]);
-#else
-                int idx = 0;
-                PopulationElement child = {0};
-                PopulationElement parents[2];
-                parents[0] = grab_element(old_population, 0, &idx);
-                parents[1] = grab_element(old_population, idx+1, NULL);
-                for ( int i = 0; i < 64; ++i )
-                {
-                    int d = rand() % 2;
-                    child.table[djei_zig_zag[i]] = parents[d].table[djei_zig_zag[i]];
-                }
-                sb_push(population, child);
-#endif
-
-            } break;
-            case REPRODUCTION: {
-                sb_push(population, grab_element(old_population, 0, NULL));
-            } break;
-            default:
-                break;
-            }
-            for (int j = 0; j < 64; ++j) {
-                if (sb_peek(population).table[j] <= 0) {
-                    sgl_assert(!"FAIL");
-                }
+        if (checkpoint_interval > 0 && (gen_i + 1) % checkpoint_interval == 0) {
+            fflush(plot_file);
+            LoopState loop = {0};
+            loop.generation          = gen_i + 1;
+            loop.convergence_hits    = convergence_hits;
+            loop.num_evaluations     = num_evaluations;
+            loop.last_winner_fitness = last_winner_fitness;
+            loop.winner              = winner;
+            if (exact) {
+                loop.exact_correction = exact->correction;
+                loop.exact_encodes    = exact->num_encodes;
             }
+            checkpoint_write(checkpoint_path, &loop, optimizer, population_size, seed, image_hash);
         }
+    }
+    fclose(plot_file);
 
-        sgl_log("Population count: %d\n", sb_count(population));
-
-        // Safety. No invalid tables because JPEG is fragile.
-        for (int i = 0; i < sb_count(population); ++i) {
-            for (int ei = 0; ei < 64; ++ei) {
-                if (population[i].table[ei] <= 0) {
-                    sgl_assert ( !"FAIL" );
-                }
-            }
+    if (island_params.num_islands == 0 && steady_params.num_workers == 0 &&
+        tempering_params.num_chains == 0 && pareto_params.num_levels == 0 &&
+        !pipeline_params.enabled) {
+        optimizer_finish(optimizer);
+        sgl_log("Total evaluations: %" PRId64 "\n", num_evaluations);
+        if (exact) {
+            sgl_log("Exact encodes: %" PRId64 "\n", exact->num_encodes);
         }
-
     }
-    fclose(plot_file);
 
-#if defined(_WIN32_)
-    LARGE_INTEGER run_measure_end;
-    QueryPerformanceCounter(&run_measure_end);
-    sgl_log("Total run time: %" PRIu64 "ns \n", run_measure_end.QuadPart - run_measure_begin.QuadPart);
-#elif __linux__
-    struct timespec ts_end = {0};
-    clock_gettime(CLOCK_REALTIME, &ts_end);
-    sgl_log("Total run time: %" PRIu64 "us \n", (ts_end.tv_nsec - ts.tv_nsec) / 1000);
-#endif
+    b32 past_deadline = time_limit > 0 &&
+            evolve_time_us() - run_begin_us > (uint64_t)(time_limit * 1000000);
+    if (memetic && !past_deadline) {
+        float fitness = winner.fitness;
+        uint64_t begin_us = evolve_time_us();
+        winner.fitness = memetic_refine(memetic, winner.table, winner.fitness);
+        sgl_log("Memetic: winner %f -> %f in %" PRIu64 "us. %" PRId64 " tries, %" PRId64 " improvements.\n",
+                fitness, winner.fitness, evolve_time_us() - begin_us,
+                memetic->num_tries, memetic->num_improvements);
+    }
 
+    if (budget) {
+        budget_confirm(budget, &iter_arena, &winner);
+    }
 
-    // Sort by fitness.
-    qsort(population, INITIAL_GENERATION_COUNT, sizeof(PopulationElement), pe_comp);
+    sgl_log("Total run time: %" PRIu64 "us \n", evolve_time_us() - run_begin_us);
 
-    tje_encode_to_file_with_qt("out_evolved.jpg", population[0].table, w, h, ncomp, data);
+    if (best_writer) {
+        // budget_confirm coarsens the winner until it fits, so its table
+        // replaces any posted one, even with a worse fitness.
+        best_writer_finish(best_writer, winner.table, budget ? -FLT_MAX : winner.fitness);
+    } else {
+        if (requantize) {
+            jpeg_input_write(&jpeg_input, "out_evolved.jpg", winner.table);
+        } else {
+            tje_encode_to_file_with_qt("out_evolved.jpg", winner.table, w, h, ncomp,
+                                       image_source_packed(&source));
+        }
+    }
 
     // print winning table
-    uint8_t* table = population[0].table;
+    uint8_t* table = winner.table;
     for (int j = 0; j < 8; ++j) {
         for (int i = 0; i < 8; ++i) {
             sgl_log("%3i%s", table[j*8+i], (i<8) ? " ": "");
@@ -418,8 +1029,12 @@ int main()
     }
 
     gpu_deinit(gpu_info);
-    stbi_image_free(data);
-    sgl_free(root_arena.ptr);
+    image_source_close(&source);
+    jpeg_input_close(&jpeg_input);
+    prelude_cache_close(&prelude_cache);
+    sgl_log("Peak memory: %" PRIu64 " MB (%zu MB reserved)\n",
+            memory_peak_bytes() / (1024 * 1024), memsz / (1024 * 1024));
+    memory_release(root_arena.ptr, memsz);
     sgl_free(gpu_info);
 
     return EXIT_SUCCESS;
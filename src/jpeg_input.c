@@ -0,0 +1,662 @@
+/**
+ * jpeg_input.c
+ *
+ *  Re-quantization of images that are already JPEG.
+ *
+ *  The entropy-coded data of a baseline JPEG is decoded straight into
+ *  quantized coefficient blocks. The luma blocks are handed to the
+ *  evaluator already transformed: dequantized with the file's own tables
+ *  and scaled the way fdct outputs them, so no encode runs the forward
+ *  DCT. The output file is written from the same coefficients of every
+ *  component, re-quantized with the evolved table, so chroma is never
+ *  decoded at all.
+ *
+ *  The only inverse transform is the one that gives the luma samples the
+ *  error is measured against. It runs once per block, when the file is
+ *  read.
+ *
+ *  Only sequential Huffman JPEGs with 8-bit samples, one or three
+ *  components and a single scan are read. Progressive and arithmetic-coded
+ *  files are refused.
+ */
+
+#define JPEG_INPUT_MAX_COMPONENTS 3
+
+typedef struct
+{
+    int32_t     max_code[17];    // Largest code of each length, or -1 if there is none.
+    int32_t     value_offset[17];
+    uint8_t     values[256];
+    b32         defined;
+} JpegInputHuffman;
+
+typedef struct
+{
+    int         id;
+    int         h_samp;  // Sampling factors.
+    int         v_samp;
+    int         qt_id;
+    int         dc_table;
+    int         ac_table;
+    int         blocks_per_row;  // Of the whole MCU grid, padding included.
+    int         num_block_rows;
+    int16_t*    coeffs;   // [num_block_rows * blocks_per_row * 64], quantized, natural order.
+    uint16_t    qt[64];   // Table that coeffs were quantized with, natural order.
+} JpegInputComponent;
+
+typedef struct
+{
+    int                 width;
+    int                 height;
+    int                 num_components;  // 1 or 3.
+    int                 mcus_per_row;
+    int                 num_mcu_rows;
+    JpegInputComponent  components[JPEG_INPUT_MAX_COMPONENTS];
+
+    // Luma, as dje_init would extract it from pixels. Aligned to a cache line.
+    int                 num_blocks;
+    DJEBlock*           y_blocks;
+    DJEDCTBlock*        dct_blocks;
+    void*               blocks_memory;
+} JpegInput;
+
+// Reads the entropy-coded segment, one bit at a time.
+typedef struct
+{
+    const uint8_t*  ptr;
+    const uint8_t*  end;
+    uint32_t        buffer;
+    int             count;      // Bits left in buffer.
+    b32             at_marker;  // Only zeros come out once a marker is reached.
+} JpegInputBits;
+
+static uint16_t jpeg_input_be16(const uint8_t* p)
+{
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static int jpeg_input_bit(JpegInputBits* bits)
+{
+    if ( bits->count == 0 ) {
+        uint8_t byte = 0;
+        if ( !bits->at_marker && bits->ptr < bits->end ) {
+            byte = *bits->ptr++;
+            if ( byte == 0xff ) {
+                if ( bits->ptr < bits->end && *bits->ptr == 0 ) {
+                    ++bits->ptr;  // Stuffed zero.
+                } else {
+                    --bits->ptr;
+                    bits->at_marker = true;
+                    byte = 0;
+                }
+            }
+        }
+        bits->buffer = byte;
+        bits->count = 8;
+    }
+    --bits->count;
+    return (bits->buffer >> bits->count) & 1;
+}
+
+static int jpeg_input_receive_extend(JpegInputBits* bits, int size)
+{
+    int value = 0;
+    for ( int i = 0; i < size; ++i ) {
+        value = (value << 1) | jpeg_input_bit(bits);
+    }
+    if ( size > 0 && value < (1 << (size - 1)) ) {
+        value -= (1 << size) - 1;
+    }
+    return value;
+}
+
+// Returns -1 for a code that is not in the table.
+static int jpeg_input_decode(JpegInputBits* bits, JpegInputHuffman* table)
+{
+    int32_t code = 0;
+    for ( int len = 1; len <= 16; ++len ) {
+        code = (code << 1) | jpeg_input_bit(bits);
+        if ( code <= table->max_code[len] ) {
+            return table->values[code + table->value_offset[len]];
+        }
+    }
+    return -1;
+}
+
+// Builds table from the BITS and HUFFVAL of a DHT segment (JPEG C.2 and F.2.2.3).
+static void jpeg_input_build_huffman(JpegInputHuffman* table, const uint8_t* counts,
+                                     const uint8_t* values, int num_values)
+{
+    memset(table, 0, sizeof(JpegInputHuffman));
+    memcpy(table->values, values, num_values);
+    int32_t code = 0;
+    int k = 0;
+    for ( int len = 1; len <= 16; ++len ) {
+        int count = counts[len - 1];
+        table->value_offset[len] = k - code;
+        table->max_code[len] = count ? code + count - 1 : -1;
+        code = (code + count) << 1;
+        k += count;
+    }
+    table->defined = true;
+}
+
+// Decodes one block into coeffs, in natural order. Returns false on bad data.
+static b32 jpeg_input_decode_block(JpegInputBits* bits, JpegInputHuffman* dc, JpegInputHuffman* ac,
+                                   int* pred, const uint8_t* natural_order, int16_t* coeffs)
+{
+    int t = jpeg_input_decode(bits, dc);
+    if ( t < 0 || t > 11 ) {
+        return false;
+    }
+    *pred += jpeg_input_receive_extend(bits, t);
+    coeffs[0] = (int16_t)*pred;
+    for ( int k = 1; k < 64; ) {
+        int rs = jpeg_input_decode(bits, ac);
+        if ( rs < 0 ) {
+            return false;
+        }
+        int run = rs >> 4;
+        int size = rs & 15;
+        if ( size == 0 ) {
+            if ( run != 15 ) {
+                break;  // EOB
+            }
+            k += 16;
+            continue;
+        }
+        k += run;
+        if ( k > 63 ) {
+            return false;
+        }
+        coeffs[natural_order[k++]] = (int16_t)jpeg_input_receive_extend(bits, size);
+    }
+    return true;
+}
+
+// Skips to just past the next RSTn marker.
+static void jpeg_input_restart(JpegInputBits* bits)
+{
+    while ( bits->ptr + 1 < bits->end &&
+            !(bits->ptr[0] == 0xff && bits->ptr[1] >= 0xd0 && bits->ptr[1] <= 0xd7) ) {
+        ++bits->ptr;
+    }
+    bits->ptr += 2;
+    if ( bits->ptr > bits->end ) {
+        bits->ptr = bits->end;
+    }
+    bits->count = 0;
+    bits->at_marker = false;
+}
+
+static b32 jpeg_input_decode_scan(JpegInput* input, JpegInputBits* bits,
+                                  JpegInputHuffman* huffman,  // [4 DC, 4 AC]
+                                  int restart_interval, const uint8_t* natural_order)
+{
+    int pred[JPEG_INPUT_MAX_COMPONENTS] = {0};
+    int num_mcus = input->mcus_per_row * input->num_mcu_rows;
+    for ( int mcu = 0; mcu < num_mcus; ++mcu ) {
+        if ( restart_interval > 0 && mcu > 0 && mcu % restart_interval == 0 ) {
+            jpeg_input_restart(bits);
+            memset(pred, 0, sizeof(pred));
+        }
+        int mcu_x = mcu % input->mcus_per_row;
+        int mcu_y = mcu / input->mcus_per_row;
+        for ( int ci = 0; ci < input->num_components; ++ci ) {
+            JpegInputComponent* comp = &input->components[ci];
+            for ( int v = 0; v < comp->v_samp; ++v ) {
+                for ( int u = 0; u < comp->h_samp; ++u ) {
+                    size_t bi = (size_t)(mcu_y * comp->v_samp + v) * comp->blocks_per_row +
+                            (size_t)mcu_x * comp->h_samp + u;
+                    if ( !jpeg_input_decode_block(bits, &huffman[comp->dc_table],
+                                                  &huffman[4 + comp->ac_table], &pred[ci],
+                                                  natural_order, comp->coeffs + bi * 64) ) {
+                        return false;
+                    }
+                }
+            }
+        }
+    }
+    return true;
+}
+
+// Builds the luma blocks that the evaluator reads.
+static void jpeg_input_prepare_luma(JpegInput* input)
+{
+    JpegInputComponent* luma = &input->components[0];
+    int blocks_per_row = (input->width + 7) / 8;
+    int num_block_rows = (input->height + 7) / 8;
+    input->num_blocks = blocks_per_row * num_block_rows;
+    // One spare block of each kind for the alignment.
+    size_t size = (size_t)(input->num_blocks + 1) * (sizeof(DJEBlock) + sizeof(DJEDCTBlock));
+    input->blocks_memory = sgl_malloc(size);
+    uintptr_t base = ((uintptr_t)input->blocks_memory + sizeof(DJEBlock) - 1) &
+            ~(uintptr_t)(sizeof(DJEBlock) - 1);
+    input->y_blocks = (DJEBlock*)base;
+    input->dct_blocks = (DJEDCTBlock*)(input->y_blocks + input->num_blocks);
+
+    for ( int by = 0; by < num_block_rows; ++by ) {
+        for ( int bx = 0; bx < blocks_per_row; ++bx ) {
+            int bi = by * blocks_per_row + bx;
+            const int16_t* coeffs = luma->coeffs + ((size_t)by * luma->blocks_per_row + bx) * 64;
+            short dequantized[64];
+            for ( int i = 0; i < 64; ++i ) {
+                int value = coeffs[i] * luma->qt[i];
+                if ( value > INT16_MAX ) value = INT16_MAX;
+                if ( value < INT16_MIN ) value = INT16_MIN;
+                dequantized[i] = (short)value;
+                // djei_pqt_entry(i, 1) is what fdct output is multiplied by
+                // to get the coefficient at quality 1.
+                input->dct_blocks[bi].d[i] = (float)value / djei_pqt_entry(i, 1);
+            }
+            idct_block(input->y_blocks[bi].d, 8, dequantized);
+        }
+    }
+}
+
+void jpeg_input_close(JpegInput* input)
+{
+    for ( int ci = 0; ci < JPEG_INPUT_MAX_COMPONENTS; ++ci ) {
+        if ( input->components[ci].coeffs ) {
+            sgl_free(input->components[ci].coeffs);
+        }
+    }
+    if ( input->blocks_memory ) {
+        sgl_free(input->blocks_memory);
+    }
+    memset(input, 0, sizeof(JpegInput));
+}
+
+// Reads the coefficients of the JPEG at path. Returns false, and says why,
+// if it can't be read or is not a kind of JPEG this file reads.
+b32 jpeg_input_open(JpegInput* input, const char* path)
+{
+    memset(input, 0, sizeof(JpegInput));
+    MappedFile file;
+    if ( !mapped_file_open(&file, path) ) {
+        return false;
+    }
+    const uint8_t* data = (const uint8_t*)file.data;
+    const uint8_t* end = data + file.size;
+
+    uint8_t natural_order[64];
+    for ( int i = 0; i < 64; ++i ) {
+        natural_order[djei_zig_zag[i]] = (uint8_t)i;
+    }
+    uint16_t tables[4][64] = {0};
+    JpegInputHuffman huffman[8] = {0};  // 4 DC, 4 AC
+    int restart_interval = 0;
+    b32 have_frame = false;
+    b32 have_scan = false;
+    const char* error = NULL;
+
+    const uint8_t* p = data;
+    if ( file.size < 4 || p[0] != 0xff || p[1] != 0xd8 ) {
+        error = "not a JPEG";
+    }
+    p += 2;
+    while ( !error ) {
+        while ( p < end && *p != 0xff ) {
+            ++p;  // Garbage before a marker. Tolerated, like most decoders do.
+        }
+        while ( p < end && *p == 0xff ) {
+            ++p;  // Fill bytes.
+        }
+        if ( p >= end ) {
+            error = "no EOI";
+            break;
+        }
+        uint8_t marker = *p++;
+        if ( marker == 0xd9 ) {
+            break;  // EOI
+        }
+        if ( marker == 0 || (marker >= 0xd0 && marker <= 0xd7) ) {
+            continue;  // A stuffed byte or a restart marker, outside of a scan.
+        }
+        if ( end - p < 2 || jpeg_input_be16(p) < 2 || jpeg_input_be16(p) > end - p ) {
+            error = "truncated segment";
+            break;
+        }
+        const uint8_t* segment = p + 2;
+        const uint8_t* segment_end = p + jpeg_input_be16(p);
+        p = segment_end;
+
+        if ( marker == 0xdb ) {  // DQT
+            const uint8_t* q = segment;
+            while ( q < segment_end && !error ) {
+                int precision = *q >> 4;
+                int id = *q & 15;
+                ++q;
+                if ( id > 3 || segment_end - q < 64 * (precision + 1) ) {
+                    error = "bad DQT";
+                    break;
+                }
+                for ( int k = 0; k < 64; ++k ) {
+                    tables[id][natural_order[k]] = precision ? jpeg_input_be16(q + 2 * k) : q[k];
+                }
+                q += 64 * (precision + 1);
+            }
+        } else if ( marker == 0xc4 ) {  // DHT
+            const uint8_t* q = segment;
+            while ( q < segment_end && !error ) {
+                if ( segment_end - q < 17 ) {
+                    error = "bad DHT";
+                    break;
+                }
+                int table_class = q[0] >> 4;
+                int id = q[0] & 15;
+                int num_values = 0;
+                for ( int i = 0; i < 16; ++i ) {
+                    num_values += q[1 + i];
+                }
+                if ( table_class > 1 || id > 3 || num_values > 256 ||
+                     segment_end - q < 17 + num_values ) {
+                    error = "bad DHT";
+                    break;
+                }
+                jpeg_input_build_huffman(&huffman[table_class * 4 + id], q + 1, q + 17, num_values);
+                q += 17 + num_values;
+            }
+        } else if ( marker == 0xdd ) {  // DRI
+            if ( segment_end - segment < 2 ) {
+                error = "bad DRI";
+                break;
+            }
+            restart_interval = jpeg_input_be16(segment);
+        } else if ( marker == 0xc0 || marker == 0xc1 ) {  // SOF0, SOF1: sequential, Huffman.
+            if ( have_frame || segment_end - segment < 6 ) {
+                error = "bad SOF";
+                break;
+            }
+            int num_components = segment[5];
+            input->height = jpeg_input_be16(segment + 1);
+            input->width = jpeg_input_be16(segment + 3);
+            input->num_components = num_components;
+            if ( segment[0] != 8 ) {
+                error = "only 8-bit samples are read";
+                break;
+            }
+            if ( (num_components != 1 && num_components != 3) ||
+                 segment_end - segment < 6 + 3 * num_components ||
+                 input->width == 0 || input->height == 0 ) {
+                error = "bad SOF";
+                break;
+            }
+            int max_h = 1;
+            int max_v = 1;
+            for ( int ci = 0; ci < num_components; ++ci ) {
+                JpegInputComponent* comp = &input->components[ci];
+                const uint8_t* spec = segment + 6 + 3 * ci;
+                comp->id = spec[0];
+                comp->h_samp = spec[1] >> 4;
+                comp->v_samp = spec[1] & 15;
+                comp->qt_id = spec[2];
+                if ( comp->h_samp < 1 || comp->h_samp > 4 || comp->v_samp < 1 ||
+                     comp->v_samp > 4 || comp->qt_id > 3 ) {
+                    error = "bad SOF";
+                    break;
+                }
+                if ( num_components == 1 ) {
+                    // A single component is never interleaved. Its MCU is one block.
+                    comp->h_samp = comp->v_samp = 1;
+                }
+                if ( comp->h_samp > max_h ) max_h = comp->h_samp;
+                if ( comp->v_samp > max_v ) max_v = comp->v_samp;
+            }
+            if ( !error && (input->components[0].h_samp != max_h ||
+                            input->components[0].v_samp != max_v) ) {
+                // Luma blocks would not be the 8x8 pixel blocks the evaluator measures.
+                error = "subsampled luma is not read";
+            }
+            if ( error ) {
+                break;
+            }
+            input->mcus_per_row = (input->width + 8 * max_h - 1) / (8 * max_h);
+            input->num_mcu_rows = (input->height + 8 * max_v - 1) / (8 * max_v);
+            for ( int ci = 0; ci < num_components; ++ci ) {
+                JpegInputComponent* comp = &input->components[ci];
+                comp->blocks_per_row = input->mcus_per_row * comp->h_samp;
+                comp->num_block_rows = input->num_mcu_rows * comp->v_samp;
+                comp->coeffs = sgl_calloc((size_t)comp->blocks_per_row * comp->num_block_rows * 64,
+                                          sizeof(int16_t));
+            }
+            have_frame = true;
+        } else if ( (marker >= 0xc2 && marker <= 0xcf) && marker != 0xc4 && marker != 0xc8 &&
+                    marker != 0xcc ) {
+            error = "only sequential Huffman JPEGs are read";
+        } else if ( marker == 0xda ) {  // SOS
+            if ( !have_frame || have_scan || segment_end - segment < 1 ||
+                 segment[0] != input->num_components ||
+                 segment_end - segment < 4 + 2 * segment[0] ) {
+                error = have_scan ? "only single-scan JPEGs are read" : "bad SOS";
+                break;
+            }
+            for ( int si = 0; si < segment[0]; ++si ) {
+                JpegInputComponent* comp = &input->components[si];
+                const uint8_t* spec = segment + 1 + 2 * si;
+                comp->dc_table = spec[1] >> 4;
+                comp->ac_table = spec[1] & 15;
+                if ( spec[0] != comp->id || comp->dc_table > 3 || comp->ac_table > 3 ||
+                     !huffman[comp->dc_table].defined || !huffman[4 + comp->ac_table].defined ) {
+                    error = "bad SOS";
+                    break;
+                }
+                memcpy(comp->qt, tables[comp->qt_id], sizeof(comp->qt));
+            }
+            if ( error ) {
+                break;
+            }
+            JpegInputBits bits = {0};
+            bits.ptr = segment_end;
+            bits.end = end;
+            if ( !jpeg_input_decode_scan(input, &bits, huffman, restart_interval, natural_order) ) {
+                error = "corrupt entropy-coded data";
+                break;
+            }
+            p = bits.ptr;
+            have_scan = true;
+        }
+        // Everything else (APPn, COM) is skipped.
+    }
+    if ( !error && !have_scan ) {
+        error = "no scan";
+    }
+    mapped_file_close(&file);
+    if ( error ) {
+        sgl_log("Can't re-quantize %s: %s.\n", path, error);
+        jpeg_input_close(input);
+        return false;
+    }
+    jpeg_input_prepare_luma(input);
+    return true;
+}
+
+// ==== Output
+
+typedef struct
+{
+    FILE*       fd;
+    uint32_t    buffer;
+    int         count;  // Bits in buffer.
+} JpegInputWriter;
+
+static void jpeg_input_put_bits(JpegInputWriter* writer, uint32_t bits, int count)
+{
+    writer->buffer = (writer->buffer << count) | (bits & ((1u << count) - 1));
+    writer->count += count;
+    while ( writer->count >= 8 ) {
+        writer->count -= 8;
+        uint8_t byte = (uint8_t)(writer->buffer >> writer->count);
+        fputc(byte, writer->fd);
+        if ( byte == 0xff ) {
+            fputc(0, writer->fd);
+        }
+    }
+}
+
+static void jpeg_input_put_word(FILE* fd, int word)
+{
+    fputc((word >> 8) & 0xff, fd);
+    fputc(word & 0xff, fd);
+}
+
+// Coefficient i of comp, re-quantized from comp's table to q.
+static int jpeg_input_requantize(const JpegInputComponent* comp, const int16_t* coeffs, int i, int q)
+{
+    int value = coeffs[i] * comp->qt[i];
+    int r = (value >= 0) ? (value + q / 2) / q : -((-value + q / 2) / q);
+    // Largest magnitudes the default Huffman tables have codes for.
+    int limit = (i == 0) ? 1024 : 1023;
+    if ( r > 1023 ) r = 1023;
+    if ( r < -limit ) r = -limit;
+    return r;
+}
+
+static void jpeg_input_write_block(JpegInputWriter* writer, DJEState* huff, int chroma,
+                                   const JpegInputComponent* comp, const int16_t* coeffs,
+                                   const uint8_t* qt, int* pred)
+{
+    int du[64];  // Zig-zag order.
+    for ( int i = 0; i < 64; ++i ) {
+        du[djei_zig_zag[i]] = jpeg_input_requantize(comp, coeffs, i, qt[djei_zig_zag[i]]);
+    }
+    uint8_t* dc_len = huff->ehuffsize[chroma ? CHROMA_DC : LUMA_DC];
+    uint16_t* dc_code = huff->ehuffcode[chroma ? CHROMA_DC : LUMA_DC];
+    uint8_t* ac_len = huff->ehuffsize[chroma ? CHROMA_AC : LUMA_AC];
+    uint16_t* ac_code = huff->ehuffcode[chroma ? CHROMA_AC : LUMA_AC];
+    uint16_t vli[2];
+
+    int diff = du[0] - *pred;
+    *pred = du[0];
+    if ( diff != 0 ) {
+        djei_calculate_variable_length_int(diff, vli);
+        jpeg_input_put_bits(writer, dc_code[vli[1]], dc_len[vli[1]]);
+        jpeg_input_put_bits(writer, vli[0], vli[1]);
+    } else {
+        jpeg_input_put_bits(writer, dc_code[0], dc_len[0]);
+    }
+
+    int last_non_zero = 0;
+    for ( int i = 63; i > 0; --i ) {
+        if ( du[i] != 0 ) {
+            last_non_zero = i;
+            break;
+        }
+    }
+    int zero_count = 0;
+    for ( int i = 1; i <= last_non_zero; ++i ) {
+        if ( du[i] == 0 ) {
+            if ( ++zero_count == 16 ) {
+                jpeg_input_put_bits(writer, ac_code[0xf0], ac_len[0xf0]);
+                zero_count = 0;
+            }
+            continue;
+        }
+        djei_calculate_variable_length_int(du[i], vli);
+        uint16_t sym = (uint16_t)((zero_count << 4) | vli[1]);
+        jpeg_input_put_bits(writer, ac_code[sym], ac_len[sym]);
+        jpeg_input_put_bits(writer, vli[0], vli[1]);
+        zero_count = 0;
+    }
+    if ( last_non_zero != 63 ) {
+        jpeg_input_put_bits(writer, ac_code[0], ac_len[0]);
+    }
+}
+
+static void jpeg_input_write_dht(FILE* fd, uint8_t* counts, uint8_t* values, int table_class, int id)
+{
+    int num_values = 0;
+    for ( int i = 0; i < 16; ++i ) {
+        num_values += counts[i];
+    }
+    jpeg_input_put_word(fd, 0xffc4);
+    jpeg_input_put_word(fd, 2 + 1 + 16 + num_values);
+    fputc((table_class << 4) | id, fd);
+    fwrite(counts, 1, 16, fd);
+    fwrite(values, 1, num_values, fd);
+}
+
+// Writes the coefficients of input to path, every component re-quantized
+// with qt (zig-zag order, like the tables we evolve), with the same sampling
+// factors as the input and the default Huffman tables.
+b32 jpeg_input_write(const JpegInput* input, const char* path, uint8_t* qt)
+{
+    FILE* fd = fopen(path, "wb");
+    if ( !fd ) {
+        return false;
+    }
+    DJEState huff = {0};
+    djei_huff_expand(&huff);
+    int num_components = input->num_components;
+
+    jpeg_input_put_word(fd, 0xffd8);  // SOI
+    {  // JFIF
+        static const uint8_t app0[] = { 'J', 'F', 'I', 'F', 0, 1, 2, 0, 0, 1, 0, 1, 0, 0 };
+        jpeg_input_put_word(fd, 0xffe0);
+        jpeg_input_put_word(fd, 2 + sizeof(app0));
+        fwrite(app0, 1, sizeof(app0), fd);
+    }
+    jpeg_input_put_word(fd, 0xffdb);  // DQT. The same table for every component.
+    jpeg_input_put_word(fd, 2 + 1 + 64);
+    fputc(0, fd);
+    fwrite(qt, 1, 64, fd);
+
+    jpeg_input_put_word(fd, 0xffc0);  // SOF0
+    jpeg_input_put_word(fd, 8 + 3 * num_components);
+    fputc(8, fd);
+    jpeg_input_put_word(fd, input->height);
+    jpeg_input_put_word(fd, input->width);
+    fputc(num_components, fd);
+    for ( int ci = 0; ci < num_components; ++ci ) {
+        const JpegInputComponent* comp = &input->components[ci];
+        fputc(ci + 1, fd);
+        fputc((comp->h_samp << 4) | comp->v_samp, fd);
+        fputc(0, fd);
+    }
+
+    jpeg_input_write_dht(fd, huff.ht_bits[LUMA_DC], huff.ht_vals[LUMA_DC], DC, 0);
+    jpeg_input_write_dht(fd, huff.ht_bits[LUMA_AC], huff.ht_vals[LUMA_AC], AC, 0);
+    if ( num_components > 1 ) {
+        jpeg_input_write_dht(fd, huff.ht_bits[CHROMA_DC], huff.ht_vals[CHROMA_DC], DC, 1);
+        jpeg_input_write_dht(fd, huff.ht_bits[CHROMA_AC], huff.ht_vals[CHROMA_AC], AC, 1);
+    }
+
+    jpeg_input_put_word(fd, 0xffda);  // SOS
+    jpeg_input_put_word(fd, 6 + 2 * num_components);
+    fputc(num_components, fd);
+    for ( int ci = 0; ci < num_components; ++ci ) {
+        fputc(ci + 1, fd);
+        fputc(ci == 0 ? 0x00 : 0x11, fd);
+    }
+    fputc(0, fd);
+    fputc(63, fd);
+    fputc(0, fd);
+
+    JpegInputWriter writer = {0};
+    writer.fd = fd;
+    int pred[JPEG_INPUT_MAX_COMPONENTS] = {0};
+    for ( int mcu_y = 0; mcu_y < input->num_mcu_rows; ++mcu_y ) {
+        for ( int mcu_x = 0; mcu_x < input->mcus_per_row; ++mcu_x ) {
+            for ( int ci = 0; ci < num_components; ++ci ) {
+                const JpegInputComponent* comp = &input->components[ci];
+                for ( int v = 0; v < comp->v_samp; ++v ) {
+                    for ( int u = 0; u < comp->h_samp; ++u ) {
+                        size_t bi = (size_t)(mcu_y * comp->v_samp + v) * comp->blocks_per_row +
+                                (size_t)mcu_x * comp->h_samp + u;
+                        jpeg_input_write_block(&writer, &huff, ci > 0, comp, comp->coeffs + bi * 64,
+                                               qt, &pred[ci]);
+                    }
+                }
+            }
+        }
+    }
+    // Pad the last byte with ones.
+    if ( writer.count > 0 ) {
+        jpeg_input_put_bits(&writer, 0x7f, 8 - writer.count);
+    }
+    jpeg_input_put_word(fd, 0xffd9);  // EOI
+
+    b32 result = !ferror(fd);
+    result &= fclose(fd) == 0;
+    return result;
+}
@@ -5,13 +5,19 @@
  */
 
 #include <stdlib.h>
+#include <sys/mman.h>
 #include "evolve.h"
 
 int main(int argc, char** argv)
 {
+    // Address space only. Pages are backed when first touched.
     size_t sz = 4 * (1024LL * 1024 * 1024);
-    void* big_chunk_of_memory = calloc(1, sz);
+    void* big_chunk_of_memory = mmap(NULL, sz, PROT_READ | PROT_WRITE,
+                                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (big_chunk_of_memory == MAP_FAILED) {
+        return EXIT_FAILURE;
+    }
     int result = evolve_main(big_chunk_of_memory, sz);
-    free(big_chunk_of_memory);
+    munmap(big_chunk_of_memory, sz);
     return result;
 }
@@ -0,0 +1,111 @@
+/**
+ * memetic.c
+ *
+ *  Local search on the best tables.
+ *
+ *  Near convergence, random +-4 mutations on random entries rarely find the
+ *  last improvements. Instead, the best elements are hill climbed one table
+ *  entry at a time. Every neighbour differs from the current table in a
+ *  single entry, so it is scored with the delta path in dummy_jpeg.h, which
+ *  only re-encodes the blocks whose quantized coefficient changes.
+ *
+ *  Refined tables and their fitness are written back into the population.
+ */
+
+typedef struct
+{
+    int     num_elites;  // Number of best elements to refine. 0 means "off".
+    int     interval;    // Refine every this many generations. 0 means only the final winner.
+    int     max_sweeps;  // Passes over the 64 entries per refinement.
+} MemeticParams;
+
+typedef struct
+{
+    MemeticParams   params;
+    FitnessContext* fitness_ctx;
+    Arena           arena;  // Delta cache. Reset for every table.
+
+    int64_t         num_tries;
+    int64_t         num_improvements;
+} Memetic;
+
+MemeticParams memetic_default_params()
+{
+    MemeticParams params = {0};
+    params.num_elites = 0;
+    params.interval = 0;
+    params.max_sweeps = 4;
+    return params;
+}
+
+// Steps tried around every entry, in order. The first one that improves is
+// taken.
+static const int memetic_steps[] = { -1, 1, -4, 4 };
+
+// Hill climbs table in place and returns its new fitness. fitness is the
+// fitness of table before refining it.
+float memetic_refine(Memetic* memetic, uint8_t* table, float fitness)
+{
+    FitnessContext* ctx = memetic->fitness_ctx;
+    DJEState* state = &ctx->base_state;
+
+    arena_reset(&memetic->arena);
+    DJEDeltaCache cache;
+    dje_delta_init(state, &cache, &memetic->arena, table);
+    EvalResult result = { cache.bit_count, cache.mse_total };
+    float best = fitness_from_result(ctx, &result);
+    if ( fabsf(best - fitness) > 0.0001f ) {
+        // Shouldn't happen: the delta path gives the same result as dje_encode_main.
+        sgl_log("Memetic: cached fitness %f does not match %f\n", best, fitness);
+    }
+
+    for ( int sweep = 0; sweep < memetic->params.max_sweeps; ++sweep ) {
+        b32 improved = false;
+        for ( int ti = 0; ti < 64; ++ti ) {
+            for ( int si = 0; si < (int)sgl_array_count(memetic_steps); ++si ) {
+                int value = cache.qt[ti] + memetic_steps[si];
+                if ( value < 1 || value > 255 ) {
+                    continue;
+                }
+                ++memetic->num_tries;
+                dje_delta_try(state, &cache, ti, (uint8_t)value, &result.bit_count, &result.mse);
+                float f = fitness_from_result(ctx, &result);
+                if ( f < best - 0.00001f ) {
+                    dje_delta_apply(state, &cache, ti, (uint8_t)value);
+                    best = f;
+                    improved = true;
+                    ++memetic->num_improvements;
+                    // Try every step around the new value.
+                    si = -1;
+                }
+            }
+        }
+        if ( !improved ) {
+            break;
+        }
+    }
+
+    memcpy(table, cache.qt, 64);
+    return best;
+}
+
+// Refines the memetic->params.num_elites best elements of population, which
+// must be ranked with that many head ranks. Leaves it ranked.
+void memetic_refine_elites(Memetic* memetic, Population* population)
+{
+    int num_elites = memetic->params.num_elites;
+    if ( num_elites > population->num_ranked ) {
+        num_elites = population->num_ranked;
+    }
+    uint64_t begin_us = evolve_time_us();
+    float before = population->fitness[population->order[0]];
+    for ( int r = 0; r < num_elites; ++r ) {
+        int idx = population->order[r];
+        population->fitness[idx] = memetic_refine(memetic, population->tables[idx],
+                                                  population->fitness[idx]);
+    }
+    population_rank(population, num_elites, 1);
+    sgl_log("Memetic: best %f -> %f in %" PRIu64 "us (%" PRId64 " tries so far)\n",
+            before, population->fitness[population->order[0]],
+            evolve_time_us() - begin_us, memetic->num_tries);
+}
@@ -0,0 +1,87 @@
+/**
+ * memory.c
+ *
+ *  Backing memory for the root arena.
+ *
+ *  The arena is reserved as address space and pages are only backed when
+ *  first touched, so a generous reservation costs nothing, nothing is
+ *  zeroed up front, and the resident size follows what the run actually
+ *  uses. On Windows the reservation is also committed, which charges the
+ *  commit limit, but pages are still only backed when touched.
+ *
+ *  The reservation is sized from the number of blocks, so that large
+ *  images don't run out of arena and small ones don't reserve gigabytes.
+ */
+
+#define MEMORY_BASE_SIZE    (256LL * 1024 * 1024)  // Populations, tables and the rest.
+
+// Bytes of arena that every block may need: the samples, their DCT, a delta
+// cache (memetic search and tempering) and the per-block results of an encode.
+#define MEMORY_PER_BLOCK    (sizeof(DJEBlock) + sizeof(DJEDCTBlock) + \
+                             64 * sizeof(int16_t) + 2 * (sizeof(uint64_t) + sizeof(uint32_t)))
+
+// Size of the root arena for num_blocks blocks, when num_workers threads
+// each encode with their own arena.
+size_t memory_root_size(int64_t num_blocks, int num_workers)
+{
+    if ( num_workers < 1 ) {
+        num_workers = 1;
+    }
+    return (size_t)MEMORY_BASE_SIZE + (size_t)num_blocks * MEMORY_PER_BLOCK * (1 + num_workers);
+}
+
+// Reserves size bytes of zeroed memory, backed on first touch. With
+// huge_pages, asks for transparent huge pages where there are any.
+void* memory_reserve(size_t size, b32 huge_pages)
+{
+#if defined(_WIN32)
+    (void)huge_pages;
+    return VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+    void* ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if ( ptr == MAP_FAILED ) {
+        return NULL;
+    }
+#if defined(MADV_HUGEPAGE)
+    if ( huge_pages ) {
+        madvise(ptr, size, MADV_HUGEPAGE);
+    }
+#else
+    (void)huge_pages;
+#endif
+    return ptr;
+#endif
+}
+
+void memory_release(void* ptr, size_t size)
+{
+#if defined(_WIN32)
+    (void)size;
+    VirtualFree(ptr, 0, MEM_RELEASE);
+#else
+    munmap(ptr, size);
+#endif
+}
+
+// Most memory the process has had resident at once, in bytes.
+uint64_t memory_peak_bytes()
+{
+#if defined(_WIN32)
+    PROCESS_MEMORY_COUNTERS counters = {0};
+    if ( !K32GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)) ) {
+        return 0;
+    }
+    return counters.PeakWorkingSetSize;
+#else
+    struct rusage usage = {0};
+    if ( getrusage(RUSAGE_SELF, &usage) != 0 ) {
+        return 0;
+    }
+#if defined(__MACH__)
+    return (uint64_t)usage.ru_maxrss;  // Bytes.
+#else
+    return (uint64_t)usage.ru_maxrss * 1024;  // Kilobytes.
+#endif
+#endif
+}
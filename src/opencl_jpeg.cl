@@ -21,13 +21,13 @@ void djei_calculate_variable_length_int(int value, ushort out[2])
     out[0] = value & ((1 << out[1]) - 1);
 }
 
-__kernel void cl_encode_and_write_MCU(/*0*/__global DJEBlock* mcu_array,
-                                      /*1*/__global uint* bitcount_array,
-                                      /*2*/__global ulong* out_mse,
-                                      /*3*/__global float* qt,  // Pre-processed quantization matrix.
-                                      /*4*/__constant uchar* huff_ac_len)
+// Size and error of one block, encoded with one table.
+void cl_block_cost(__global const DJEBlock* mcu,
+                   __global const float* qt,  // Pre-processed quantization matrix.
+                   __constant uchar* huff_ac_len,
+                   uint* out_bits,
+                   ulong* out_mse)
 {
-    int block_i = (int)get_global_id(0);
     short du[64];  // Data unit in zig-zag order
 
     // OPT PASS 3. No effect!
@@ -38,13 +38,9 @@ __kernel void cl_encode_and_write_MCU(/*0*/__global DJEBlock* mcu_array,
 #if LOCAL_COPY
     float local_mcu[64];
 #endif
-    // OPT PASS 4 -- SLOWER
-    uchar local_huff_ac_len[257];
-    for (int i = 0; i < 257; ++i) {
-        local_huff_ac_len[i] = huff_ac_len[i];
-    }
     for (int i = 0; i < 64; ++i) {
-        float val = mcu_array[block_i].d[i];
+        // Level shift in registers. Samples are stored as 8 bits.
+        float val = (float)mcu->d[i] - 128.0f;
         dct_mcu[i] = val;
 #if LOCAL_COPY
         local_mcu[i] = val;
@@ -83,14 +79,13 @@ __kernel void cl_encode_and_write_MCU(/*0*/__global DJEBlock* mcu_array,
 #if LOCAL_COPY
         float mcu_i = (local_mcu[i] + 128.0f);
 #else
-        float mcu_i = (mcu_array[block_i].d[i] + 128.0f);
+        float mcu_i = (float)mcu->d[i];
 #endif
         int err = abs((int)(re_i - mcu_i));
         MSE += err;
     }
 
-    out_mse[block_i] = MSE;
-    //out_mse[block_i] = (int)-mcu_array[0].d[block_i];
+    *out_mse = MSE;
 
     ushort vli[2];
 
@@ -119,7 +114,6 @@ __kernel void cl_encode_and_write_MCU(/*0*/__global DJEBlock* mcu_array,
                 // encode (ff,00) == 0xf0
                 //bitcount_array[block_i] += huff_ac_len[0xf0];
                 block_error += huff_ac_len[0xf0];
-                //block_error += local_huff_ac_len[0xf0];
                 zero_count = 0;
             }
         }
@@ -137,7 +131,6 @@ __kernel void cl_encode_and_write_MCU(/*0*/__global DJEBlock* mcu_array,
         //djei_write_bits(state, bitbuffer, location, huff_ac_len[sym1], huff_ac_code[sym1]);
         //bitcount_array[block_i] += huff_ac_len[sym1];
         block_error += huff_ac_len[sym1];
-        //block_error += local_huff_ac_len[sym1];
         // Write symbol 2  --- (AMPLITUDE)
         //djei_write_bits(state, bitbuffer, location, vli[1], vli[0]);
         //bitcount_array[block_i] += vli[1];
@@ -149,7 +142,83 @@ __kernel void cl_encode_and_write_MCU(/*0*/__global DJEBlock* mcu_array,
         //djei_write_bits(state, bitbuffer, location, huff_ac_len[0], huff_ac_code[0]);
         //bitcount_array[block_i] += huff_ac_len[0];
         block_error += huff_ac_len[0];
-        //block_error += local_huff_ac_len[0];
     }
-    bitcount_array[block_i] = block_error;
+    *out_bits = block_error;
+}
+
+// One work-item per (block, table). Dimension 0 runs over blocks, padded to
+// whole groups of DJE_GPU_GROUP_SIZE, and dimension 1 over tables. Each group
+// adds up its blocks in local memory and writes one partial sum per table:
+// partial_*[table_i * num_groups + group_i].
+__kernel void cl_encode_population(/*0*/__global const DJEBlock* mcu_array,
+                                   /*1*/int num_blocks,
+                                   /*2*/__global const float* qts,  // [num_tables][64]
+                                   /*3*/__constant uchar* huff_ac_len,
+                                   /*4*/__global uint* partial_bits,
+                                   /*5*/__global ulong* partial_mse)
+{
+    __local uint  local_bits[DJE_GPU_GROUP_SIZE];
+    __local ulong local_mse[DJE_GPU_GROUP_SIZE];
+
+    int block_i = (int)get_global_id(0);
+    int table_i = (int)get_global_id(1);
+    int lid = (int)get_local_id(0);
+
+    uint bits = 0;
+    ulong mse = 0;
+    if (block_i < num_blocks) {
+        cl_block_cost(mcu_array + block_i, qts + table_i * 64, huff_ac_len, &bits, &mse);
+    }
+    local_bits[lid] = bits;
+    local_mse[lid] = mse;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    for (int stride = DJE_GPU_GROUP_SIZE / 2; stride > 0; stride >>= 1) {
+        if (lid < stride) {
+            local_bits[lid] += local_bits[lid + stride];
+            local_mse[lid] += local_mse[lid + stride];
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+    if (lid == 0) {
+        int num_groups = (int)get_num_groups(0);
+        int group_i = (int)get_group_id(0);
+        partial_bits[table_i * num_groups + group_i] = local_bits[0];
+        partial_mse[table_i * num_groups + group_i] = local_mse[0];
+    }
+}
+
+// One group of DJE_GPU_GROUP_SIZE per table. Adds up the partial sums of
+// cl_encode_population into one (bits, error) pair per table.
+__kernel void cl_reduce_population(/*0*/__global const uint* partial_bits,
+                                   /*1*/__global const ulong* partial_mse,
+                                   /*2*/int num_groups,
+                                   /*3*/__global uint* out_bits,
+                                   /*4*/__global ulong* out_mse)
+{
+    __local uint  local_bits[DJE_GPU_GROUP_SIZE];
+    __local ulong local_mse[DJE_GPU_GROUP_SIZE];
+
+    int table_i = (int)get_group_id(0);
+    int lid = (int)get_local_id(0);
+
+    uint bits = 0;
+    ulong mse = 0;
+    for (int g = lid; g < num_groups; g += DJE_GPU_GROUP_SIZE) {
+        bits += partial_bits[table_i * num_groups + g];
+        mse += partial_mse[table_i * num_groups + g];
+    }
+    local_bits[lid] = bits;
+    local_mse[lid] = mse;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    for (int stride = DJE_GPU_GROUP_SIZE / 2; stride > 0; stride >>= 1) {
+        if (lid < stride) {
+            local_bits[lid] += local_bits[lid + stride];
+            local_mse[lid] += local_mse[lid + stride];
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+    if (lid == 0) {
+        out_bits[table_i] = local_bits[0];
+        out_mse[table_i] = local_mse[0];
+    }
 }
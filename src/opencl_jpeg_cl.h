@@ -0,0 +1,512 @@
+// Generated by src/embed_kernel.py from src/opencl_jpeg.cl. Do not edit.
+
+#pragma once
+
+static const char gpu_kernel_source[] =
+    "// Stuff used by the CPU and GPU implementations of the JPEG fitness function\n"
+    "\n"
+    "\n"
+    "#if defined(__OPENCL_VERSION__)\n"
+    "#define uint8_t uchar\n"
+    "#define stbi_uc uchar\n"
+    "#else\n"
+    "#define __private\n"
+    "#define __constant\n"
+    "#endif\n"
+    "\n"
+    "// Luma samples of one 8x8 block, 0 to 255, in natural order. Exactly one\n"
+    "// cache line. The -128 level shift is done in registers when a block is\n"
+    "// loaded for the DCT.\n"
+    "typedef struct DJEBlock_s {\n"
+    "    uint8_t d[64];\n"
+    "} DJEBlock;\n"
+    "\n"
+    "// DCT coefficients of one block, in natural order.\n"
+    "typedef struct DJEDCTBlock_s {\n"
+    "    float d[64];\n"
+    "} DJEDCTBlock;\n"
+    "\n"
+    "// Work-group size of the OpenCL kernels. Each group adds up the results of\n"
+    "// this many blocks before anything is written to global memory.\n"
+    "#define DJE_GPU_GROUP_SIZE 64\n"
+    "\n"
+    "// Zig-zag order:\n"
+    "__constant uint8_t djei_zig_zag[64] = {\n"
+    "   0,   1,  5,  6, 14, 15, 27, 28,\n"
+    "   2,   4,  7, 13, 16, 26, 29, 42,\n"
+    "   3,   8, 12, 17, 25, 30, 41, 43,\n"
+    "   9,  11, 18, 24, 31, 40, 44, 53,\n"
+    "   10, 19, 23, 32, 39, 45, 52, 54,\n"
+    "   20, 22, 33, 38, 46, 51, 55, 60,\n"
+    "   21, 34, 37, 47, 50, 56, 59, 61,\n"
+    "   35, 36, 48, 49, 57, 58, 62, 63,\n"
+    "};\n"
+    "\n"
+    "// DCT implementation by Thomas G. Lane.\n"
+    "// Obtained through NVIDIA\n"
+    "//  http://developer.download.nvidia.com/SDK/9.5/Samples/vidimaging_samples.html#gpgpu_dct\n"
+    "//\n"
+    "// QUOTE:\n"
+    "//  This implementation is based on Arai, Agui, and Nakajima's algorithm for\n"
+    "//  scaled DCT.  Their original paper (Trans. IEICE E-71(11):1095) is in\n"
+    "//  Japanese, but the algorithm is described in the Pennebaker & Mitchell\n"
+    "//  JPEG textbook (see REFERENCES section in file README).  The following code\n"
+    "//  is based directly on figure 4-8 in P&M.\n"
+    "//\n"
+    "void fdct (float * data)\n"
+    "{\n"
+    "    float tmp0, tmp1, tmp2, tmp3, tmp4, tmp5, tmp6, tmp7;\n"
+    "    float tmp10, tmp11, tmp12, tmp13;\n"
+    "    float z1, z2, z3, z4, z5, z11, z13;\n"
+    "    float *dataptr;\n"
+    "    int ctr;\n"
+    "\n"
+    "    /* Pass 1: process rows. */\n"
+    "\n"
+    "    dataptr = data;\n"
+    "    for ( ctr = 7; ctr >= 0; ctr-- ) {\n"
+    "        tmp0 = dataptr[0] + dataptr[7];\n"
+    "        tmp7 = dataptr[0] - dataptr[7];\n"
+    "        tmp1 = dataptr[1] + dataptr[6];\n"
+    "        tmp6 = dataptr[1] - dataptr[6];\n"
+    "        tmp2 = dataptr[2] + dataptr[5];\n"
+    "        tmp5 = dataptr[2] - dataptr[5];\n"
+    "        tmp3 = dataptr[3] + dataptr[4];\n"
+    "        tmp4 = dataptr[3] - dataptr[4];\n"
+    "\n"
+    "        /* Even part */\n"
+    "\n"
+    "        tmp10 = tmp0 + tmp3;    /* phase 2 */\n"
+    "        tmp13 = tmp0 - tmp3;\n"
+    "        tmp11 = tmp1 + tmp2;\n"
+    "        tmp12 = tmp1 - tmp2;\n"
+    "\n"
+    "        dataptr[0] = tmp10 + tmp11; /* phase 3 */\n"
+    "        dataptr[4] = tmp10 - tmp11;\n"
+    "\n"
+    "        z1 = (tmp12 + tmp13) * ((float) 0.707106781); /* c4 */\n"
+    "        dataptr[2] = tmp13 + z1;    /* phase 5 */\n"
+    "        dataptr[6] = tmp13 - z1;\n"
+    "\n"
+    "        /* Odd part */\n"
+    "\n"
+    "        tmp10 = tmp4 + tmp5;    /* phase 2 */\n"
+    "        tmp11 = tmp5 + tmp6;\n"
+    "        tmp12 = tmp6 + tmp7;\n"
+    "\n"
+    "        /* The rotator is modified from fig 4-8 to avoid extra negations. */\n"
+    "        z5 = (tmp10 - tmp12) * ((float) 0.382683433); /* c6 */\n"
+    "        z2 = ((float) 0.541196100) * tmp10 + z5; /* c2-c6 */\n"
+    "        z4 = ((float) 1.306562965) * tmp12 + z5; /* c2+c6 */\n"
+    "        z3 = tmp11 * ((float) 0.707106781); /* c4 */\n"
+    "\n"
+    "        z11 = tmp7 + z3;        /* phase 5 */\n"
+    "        z13 = tmp7 - z3;\n"
+    "\n"
+    "        dataptr[5] = z13 + z2;  /* phase 6 */\n"
+    "        dataptr[3] = z13 - z2;\n"
+    "        dataptr[1] = z11 + z4;\n"
+    "        dataptr[7] = z11 - z4;\n"
+    "\n"
+    "        dataptr += 8;     /* advance pointer to next row */\n"
+    "    }\n"
+    "\n"
+    "    /* Pass 2: process columns. */\n"
+    "\n"
+    "    dataptr = data;\n"
+    "    for ( ctr = 8-1; ctr >= 0; ctr-- ) {\n"
+    "        tmp0 = dataptr[8*0] + dataptr[8*7];\n"
+    "        tmp7 = dataptr[8*0] - dataptr[8*7];\n"
+    "        tmp1 = dataptr[8*1] + dataptr[8*6];\n"
+    "        tmp6 = dataptr[8*1] - dataptr[8*6];\n"
+    "        tmp2 = dataptr[8*2] + dataptr[8*5];\n"
+    "        tmp5 = dataptr[8*2] - dataptr[8*5];\n"
+    "        tmp3 = dataptr[8*3] + dataptr[8*4];\n"
+    "        tmp4 = dataptr[8*3] - dataptr[8*4];\n"
+    "\n"
+    "        /* Even part */\n"
+    "\n"
+    "        tmp10 = tmp0 + tmp3;    /* phase 2 */\n"
+    "        tmp13 = tmp0 - tmp3;\n"
+    "        tmp11 = tmp1 + tmp2;\n"
+    "        tmp12 = tmp1 - tmp2;\n"
+    "\n"
+    "        dataptr[8*0] = tmp10 + tmp11; /* phase 3 */\n"
+    "        dataptr[8*4] = tmp10 - tmp11;\n"
+    "\n"
+    "        z1 = (tmp12 + tmp13) * ((float) 0.707106781); /* c4 */\n"
+    "        dataptr[8*2] = tmp13 + z1; /* phase 5 */\n"
+    "        dataptr[8*6] = tmp13 - z1;\n"
+    "\n"
+    "        /* Odd part */\n"
+    "\n"
+    "        tmp10 = tmp4 + tmp5;    /* phase 2 */\n"
+    "        tmp11 = tmp5 + tmp6;\n"
+    "        tmp12 = tmp6 + tmp7;\n"
+    "\n"
+    "        /* The rotator is modified from fig 4-8 to avoid extra negations. */\n"
+    "        z5 = (tmp10 - tmp12) * ((float) 0.382683433); /* c6 */\n"
+    "        z2 = ((float) 0.541196100) * tmp10 + z5; /* c2-c6 */\n"
+    "        z4 = ((float) 1.306562965) * tmp12 + z5; /* c2+c6 */\n"
+    "        z3 = tmp11 * ((float) 0.707106781); /* c4 */\n"
+    "\n"
+    "        z11 = tmp7 + z3;        /* phase 5 */\n"
+    "        z13 = tmp7 - z3;\n"
+    "\n"
+    "        dataptr[8*5] = z13 + z2; /* phase 6 */\n"
+    "        dataptr[8*3] = z13 - z2;\n"
+    "        dataptr[8*1] = z11 + z4;\n"
+    "        dataptr[8*7] = z11 - z4;\n"
+    "\n"
+    "        dataptr++;          /* advance pointer to next column */\n"
+    "    }\n"
+    "}\n"
+    "\n"
+    "/////////////////////\n"
+    "//  IDCT from stb_image.h (public domain).\n"
+    "//  which in turn gets it from IJG who take it from:\n"
+    "//      C. Loeffler, A. Ligtenberg and G. Moschytz, \"Practical Fast 1-D DCT\n"
+    "//      Algorithms with 11 Multiplications\", Proc. Int'l. Conf. on Acoustics,\n"
+    "//      Speech, and Signal Processing 1989 (ICASSP '89), pp. 988-991.\n"
+    "//  /////////////////\n"
+    "\n"
+    "// take a -128..127 value and stbi__clamp it and convert to 0..255\n"
+    "\n"
+    "stbi_uc dje_clamp(int x)\n"
+    "{\n"
+    "   // trick to use a single test to catch both cases\n"
+    "   if ((unsigned int) x > 255) {\n"
+    "      if (x < 0) return 0;\n"
+    "      if (x > 255) return 255;\n"
+    "   }\n"
+    "   return (stbi_uc) x;\n"
+    "}\n"
+    "\n"
+    "#define stbi__f2f(x)  ((int) (((x) * 4096 + 0.5)))\n"
+    "#define stbi__fsh(x)  ((x) << 12)\n"
+    "\n"
+    "// derived from jidctint -- DCT_ISLOW\n"
+    "#define STBI__IDCT_1D(s0,s1,s2,s3,s4,s5,s6,s7) \\\n"
+    "   int t0,t1,t2,t3,p1,p2,p3,p4,p5,x0,x1,x2,x3; \\\n"
+    "   p2 = s2;                                    \\\n"
+    "   p3 = s6;                                    \\\n"
+    "   p1 = (p2+p3) * stbi__f2f(0.5411961f);       \\\n"
+    "   t2 = p1 + p3*stbi__f2f(-1.847759065f);      \\\n"
+    "   t3 = p1 + p2*stbi__f2f( 0.765366865f);      \\\n"
+    "   p2 = s0;                                    \\\n"
+    "   p3 = s4;                                    \\\n"
+    "   t0 = stbi__fsh(p2+p3);                      \\\n"
+    "   t1 = stbi__fsh(p2-p3);                      \\\n"
+    "   x0 = t0+t3;                                 \\\n"
+    "   x3 = t0-t3;                                 \\\n"
+    "   x1 = t1+t2;                                 \\\n"
+    "   x2 = t1-t2;                                 \\\n"
+    "   t0 = s7;                                    \\\n"
+    "   t1 = s5;                                    \\\n"
+    "   t2 = s3;                                    \\\n"
+    "   t3 = s1;                                    \\\n"
+    "   p3 = t0+t2;                                 \\\n"
+    "   p4 = t1+t3;                                 \\\n"
+    "   p1 = t0+t3;                                 \\\n"
+    "   p2 = t1+t2;                                 \\\n"
+    "   p5 = (p3+p4)*stbi__f2f( 1.175875602f);      \\\n"
+    "   t0 = t0*stbi__f2f( 0.298631336f);           \\\n"
+    "   t1 = t1*stbi__f2f( 2.053119869f);           \\\n"
+    "   t2 = t2*stbi__f2f( 3.072711026f);           \\\n"
+    "   t3 = t3*stbi__f2f( 1.501321110f);           \\\n"
+    "   p1 = p5 + p1*stbi__f2f(-0.899976223f);      \\\n"
+    "   p2 = p5 + p2*stbi__f2f(-2.562915447f);      \\\n"
+    "   p3 = p3*stbi__f2f(-1.961570560f);           \\\n"
+    "   p4 = p4*stbi__f2f(-0.390180644f);           \\\n"
+    "   t3 += p1+p4;                                \\\n"
+    "   t2 += p2+p3;                                \\\n"
+    "   t1 += p2+p4;                                \\\n"
+    "   t0 += p1+p3;\n"
+    "\n"
+    "#if !defined(__OPENCL_VERSION__)\n"
+    "static void idct_block(uint8_t *out, int out_stride, short data[64])\n"
+    "#else\n"
+    "static void idct_block(__private uint8_t* out, int out_stride, __private short* data)\n"
+    "#endif\n"
+    "{\n"
+    "    int i,val[64],*v=val;\n"
+    "    __private stbi_uc *o;\n"
+    "    short *d = data;\n"
+    "\n"
+    "    // columns\n"
+    "    for (i=0; i < 8; ++i,++d, ++v) {\n"
+    "        // if all zeroes, shortcut -- this avoids dequantizing 0s and IDCTing\n"
+    "        if (d[ 8]==0 && d[16]==0 && d[24]==0 && d[32]==0\n"
+    "            && d[40]==0 && d[48]==0 && d[56]==0) {\n"
+    "            //    no shortcut                 0     seconds\n"
+    "            //    (1|2|3|4|5|6|7)==0          0     seconds\n"
+    "            //    all separate               -0.047 seconds\n"
+    "            //    1 && 2|3 && 4|5 && 6|7:    -0.047 seconds\n"
+    "            int dcterm = d[0] << 2;\n"
+    "            v[0] = v[8] = v[16] = v[24] = v[32] = v[40] = v[48] = v[56] = dcterm;\n"
+    "        } else {\n"
+    "            STBI__IDCT_1D(d[ 0],d[ 8],d[16],d[24],d[32],d[40],d[48],d[56])\n"
+    "                    // constants scaled things up by 1<<12; let's bring them back\n"
+    "                    // down, but keep 2 extra bits of precision\n"
+    "                    x0 += 512; x1 += 512; x2 += 512; x3 += 512;\n"
+    "            v[ 0] = (x0+t3) >> 10;\n"
+    "            v[56] = (x0-t3) >> 10;\n"
+    "            v[ 8] = (x1+t2) >> 10;\n"
+    "            v[48] = (x1-t2) >> 10;\n"
+    "            v[16] = (x2+t1) >> 10;\n"
+    "            v[40] = (x2-t1) >> 10;\n"
+    "            v[24] = (x3+t0) >> 10;\n"
+    "            v[32] = (x3-t0) >> 10;\n"
+    "        }\n"
+    "    }\n"
+    "\n"
+    "    for (i=0, v=val, o=out;\n"
+    "         i < 8;\n"
+    "         ++i,v+=8,o+=out_stride) {\n"
+    "        // no fast case since the first 1D IDCT spread components out\n"
+    "        STBI__IDCT_1D(v[0],v[1],v[2],v[3],v[4],v[5],v[6],v[7])\n"
+    "                // constants scaled things up by 1<<12, plus we had 1<<2 from first\n"
+    "                // loop, plus horizontal and vertical each scale by sqrt(8) so together\n"
+    "                // we've got an extra 1<<3, so 1<<17 total we need to remove.\n"
+    "                // so we want to round that, which means adding 0.5 * 1<<17,\n"
+    "                // aka 65536. Also, we'll end up with -128 to 127 that we want\n"
+    "                // to encode as 0..255 by adding 128, so we'll add that before the shift\n"
+    "                x0 += 65536 + (128<<17);\n"
+    "        x1 += 65536 + (128<<17);\n"
+    "        x2 += 65536 + (128<<17);\n"
+    "        x3 += 65536 + (128<<17);\n"
+    "        // tried computing the shifts into temps, or'ing the temps to see\n"
+    "        // if any were out of range, but that was slower\n"
+    "        o[0] = dje_clamp((x0+t3) >> 17);\n"
+    "        o[7] = dje_clamp((x0-t3) >> 17);\n"
+    "        o[1] = dje_clamp((x1+t2) >> 17);\n"
+    "        o[6] = dje_clamp((x1-t2) >> 17);\n"
+    "        o[2] = dje_clamp((x2+t1) >> 17);\n"
+    "        o[5] = dje_clamp((x2-t1) >> 17);\n"
+    "        o[3] = dje_clamp((x3+t0) >> 17);\n"
+    "        o[4] = dje_clamp((x3-t0) >> 17);\n"
+    "    }\n"
+    "}\n"
+    "\n"
+    "// Buffer objects that we need;\n"
+    "//  -\n"
+    "\n"
+    "// Single huffman table for luminance AC coefficients.\n"
+    "/* __constant uchar ehuffsize[257]; */\n"
+    "/* __constant uchar ehuffcode[256]; */\n"
+    "\n"
+    "void djei_calculate_variable_length_int(int value, ushort out[2])\n"
+    "{\n"
+    "    int abs_val = value;\n"
+    "    if ( value < 0 ) {\n"
+    "        abs_val = -abs_val;\n"
+    "        --value;\n"
+    "    }\n"
+    "    out[1] = 1;\n"
+    "    while( abs_val >>= 1 ) {\n"
+    "        ++out[1];\n"
+    "    }\n"
+    "    out[0] = value & ((1 << out[1]) - 1);\n"
+    "}\n"
+    "\n"
+    "// Size and error of one block, encoded with one table.\n"
+    "void cl_block_cost(__global const DJEBlock* mcu,\n"
+    "                   __global const float* qt,  // Pre-processed quantization matrix.\n"
+    "                   __constant uchar* huff_ac_len,\n"
+    "                   uint* out_bits,\n"
+    "                   ulong* out_mse)\n"
+    "{\n"
+    "    short du[64];  // Data unit in zig-zag order\n"
+    "\n"
+    "    // OPT PASS 3. No effect!\n"
+    "    uint block_error = 0;\n"
+    "\n"
+    "#define LOCAL_COPY 0\n"
+    "    float dct_mcu[64];\n"
+    "#if LOCAL_COPY\n"
+    "    float local_mcu[64];\n"
+    "#endif\n"
+    "    for (int i = 0; i < 64; ++i) {\n"
+    "        // Level shift in registers. Samples are stored as 8 bits.\n"
+    "        float val = (float)mcu->d[i] - 128.0f;\n"
+    "        dct_mcu[i] = val;\n"
+    "#if LOCAL_COPY\n"
+    "        local_mcu[i] = val;\n"
+    "#endif\n"
+    "    }\n"
+    "    fdct(dct_mcu);\n"
+    "\n"
+    "    // OPT PASS 2 (no effect)\n"
+    "    /* float local_qt[64]; */\n"
+    "    /* for (int i = 0; i < 64; ++i) { */\n"
+    "    /*     local_qt[i] = qt[i]; */\n"
+    "    /* } */\n"
+    "\n"
+    "    for ( int i = 0; i < 64; ++i ) {\n"
+    "        float fval = dct_mcu[i];\n"
+    "        fval *= qt[i];\n"
+    "        fval = floor(fval + 1024 + 0.5f);\n"
+    "        fval -= 1024;\n"
+    "        short val = (short)fval;\n"
+    "        du[djei_zig_zag[i]] = val;\n"
+    "    }\n"
+    "\n"
+    "    uchar decomp[64];\n"
+    "    float re[64];  // Reconstructed image =)\n"
+    "\n"
+    "    // Note: stb uses w_cap as out_stride..\n"
+    "    idct_block(decomp, 8, du);\n"
+    "    for ( int id = 0; id < 64; ++id )\n"
+    "        re[id] = (float)decomp[id];\n"
+    "\n"
+    "    ulong MSE = 0;\n"
+    "\n"
+    "    for ( int i = 0; i < 64; ++i ) {\n"
+    "        float re_i = (re[i]);\n"
+    "        // OPT PASS 1 --\n"
+    "#if LOCAL_COPY\n"
+    "        float mcu_i = (local_mcu[i] + 128.0f);\n"
+    "#else\n"
+    "        float mcu_i = (float)mcu->d[i];\n"
+    "#endif\n"
+    "        int err = abs((int)(re_i - mcu_i));\n"
+    "        MSE += err;\n"
+    "    }\n"
+    "\n"
+    "    *out_mse = MSE;\n"
+    "\n"
+    "    ushort vli[2];\n"
+    "\n"
+    "    // ==== Encode AC coefficients ====\n"
+    "\n"
+    "    int last_non_zero_i = 0;\n"
+    "    // Find the last non-zero element.\n"
+    "    for ( int i = 63; i > 0; --i ) {\n"
+    "        if (du[i] != 0) {\n"
+    "            last_non_zero_i = i;\n"
+    "            break;\n"
+    "        }\n"
+    "    }\n"
+    "\n"
+    "    // We are starting from zero, because delta-encoding the DC coefficient\n"
+    "    // introduces a data dependency.\n"
+    "    // We would rather have an algorithm that is no longer JPEG but that is\n"
+    "    // data parallel and that will help us generate a good table.\n"
+    "    for (int i = 1; i <= last_non_zero_i; ++i) {\n"
+    "        // If zero, increase count. If >=15, encode (FF,00)\n"
+    "        int zero_count = 0;\n"
+    "        while (du[i] == 0) {\n"
+    "            ++zero_count;\n"
+    "            ++i;\n"
+    "            if (zero_count == 16) {\n"
+    "                // encode (ff,00) == 0xf0\n"
+    "                //bitcount_array[block_i] += huff_ac_len[0xf0];\n"
+    "                block_error += huff_ac_len[0xf0];\n"
+    "                zero_count = 0;\n"
+    "            }\n"
+    "        }\n"
+    "\n"
+    "        djei_calculate_variable_length_int(du[i], vli);\n"
+    "\n"
+    "        if ( i == 0 && vli[1] >= 10) {\n"
+    "            // There is no code for this coefficient. ignore.\n"
+    "            continue;\n"
+    "        }\n"
+    "\n"
+    "        ushort sym1 = ((ushort)zero_count << 4) | vli[1];\n"
+    "\n"
+    "        // Write symbol 1  --- (RUNLENGTH, SIZE)\n"
+    "        //djei_write_bits(state, bitbuffer, location, huff_ac_len[sym1], huff_ac_code[sym1]);\n"
+    "        //bitcount_array[block_i] += huff_ac_len[sym1];\n"
+    "        block_error += huff_ac_len[sym1];\n"
+    "        // Write symbol 2  --- (AMPLITUDE)\n"
+    "        //djei_write_bits(state, bitbuffer, location, vli[1], vli[0]);\n"
+    "        //bitcount_array[block_i] += vli[1];\n"
+    "        block_error += vli[1];\n"
+    "    }\n"
+    "\n"
+    "    if (last_non_zero_i != 63) {\n"
+    "        // write EOB HUFF(00,00)\n"
+    "        //djei_write_bits(state, bitbuffer, location, huff_ac_len[0], huff_ac_code[0]);\n"
+    "        //bitcount_array[block_i] += huff_ac_len[0];\n"
+    "        block_error += huff_ac_len[0];\n"
+    "    }\n"
+    "    *out_bits = block_error;\n"
+    "}\n"
+    "\n"
+    "// One work-item per (block, table). Dimension 0 runs over blocks, padded to\n"
+    "// whole groups of DJE_GPU_GROUP_SIZE, and dimension 1 over tables. Each group\n"
+    "// adds up its blocks in local memory and writes one partial sum per table:\n"
+    "// partial_*[table_i * num_groups + group_i].\n"
+    "__kernel void cl_encode_population(/*0*/__global const DJEBlock* mcu_array,\n"
+    "                                   /*1*/int num_blocks,\n"
+    "                                   /*2*/__global const float* qts,  // [num_tables][64]\n"
+    "                                   /*3*/__constant uchar* huff_ac_len,\n"
+    "                                   /*4*/__global uint* partial_bits,\n"
+    "                                   /*5*/__global ulong* partial_mse)\n"
+    "{\n"
+    "    __local uint  local_bits[DJE_GPU_GROUP_SIZE];\n"
+    "    __local ulong local_mse[DJE_GPU_GROUP_SIZE];\n"
+    "\n"
+    "    int block_i = (int)get_global_id(0);\n"
+    "    int table_i = (int)get_global_id(1);\n"
+    "    int lid = (int)get_local_id(0);\n"
+    "\n"
+    "    uint bits = 0;\n"
+    "    ulong mse = 0;\n"
+    "    if (block_i < num_blocks) {\n"
+    "        cl_block_cost(mcu_array + block_i, qts + table_i * 64, huff_ac_len, &bits, &mse);\n"
+    "    }\n"
+    "    local_bits[lid] = bits;\n"
+    "    local_mse[lid] = mse;\n"
+    "    barrier(CLK_LOCAL_MEM_FENCE);\n"
+    "    for (int stride = DJE_GPU_GROUP_SIZE / 2; stride > 0; stride >>= 1) {\n"
+    "        if (lid < stride) {\n"
+    "            local_bits[lid] += local_bits[lid + stride];\n"
+    "            local_mse[lid] += local_mse[lid + stride];\n"
+    "        }\n"
+    "        barrier(CLK_LOCAL_MEM_FENCE);\n"
+    "    }\n"
+    "    if (lid == 0) {\n"
+    "        int num_groups = (int)get_num_groups(0);\n"
+    "        int group_i = (int)get_group_id(0);\n"
+    "        partial_bits[table_i * num_groups + group_i] = local_bits[0];\n"
+    "        partial_mse[table_i * num_groups + group_i] = local_mse[0];\n"
+    "    }\n"
+    "}\n"
+    "\n"
+    "// One group of DJE_GPU_GROUP_SIZE per table. Adds up the partial sums of\n"
+    "// cl_encode_population into one (bits, error) pair per table.\n"
+    "__kernel void cl_reduce_population(/*0*/__global const uint* partial_bits,\n"
+    "                                   /*1*/__global const ulong* partial_mse,\n"
+    "                                   /*2*/int num_groups,\n"
+    "                                   /*3*/__global uint* out_bits,\n"
+    "                                   /*4*/__global ulong* out_mse)\n"
+    "{\n"
+    "    __local uint  local_bits[DJE_GPU_GROUP_SIZE];\n"
+    "    __local ulong local_mse[DJE_GPU_GROUP_SIZE];\n"
+    "\n"
+    "    int table_i = (int)get_group_id(0);\n"
+    "    int lid = (int)get_local_id(0);\n"
+    "\n"
+    "    uint bits = 0;\n"
+    "    ulong mse = 0;\n"
+    "    for (int g = lid; g < num_groups; g += DJE_GPU_GROUP_SIZE) {\n"
+    "        bits += partial_bits[table_i * num_groups + g];\n"
+    "        mse += partial_mse[table_i * num_groups + g];\n"
+    "    }\n"
+    "    local_bits[lid] = bits;\n"
+    "    local_mse[lid] = mse;\n"
+    "    barrier(CLK_LOCAL_MEM_FENCE);\n"
+    "    for (int stride = DJE_GPU_GROUP_SIZE / 2; stride > 0; stride >>= 1) {\n"
+    "        if (lid < stride) {\n"
+    "            local_bits[lid] += local_bits[lid + stride];\n"
+    "            local_mse[lid] += local_mse[lid + stride];\n"
+    "        }\n"
+    "        barrier(CLK_LOCAL_MEM_FENCE);\n"
+    "    }\n"
+    "    if (lid == 0) {\n"
+    "        out_bits[table_i] = local_bits[0];\n"
+    "        out_mse[table_i] = local_mse[0];\n"
+    "    }\n"
+    "}\n";
@@ -0,0 +1,126 @@
+/**
+ * operators.c
+ *
+ *  Self-adaptive breeding.
+ *
+ *  The probability of each operator follows how often it has bred children
+ *  better than their parent lately (probability matching, with a floor so
+ *  that no operator dies out). Reproduction never beats its parent, so it
+ *  quickly falls to the floor instead of spending evaluations on copies.
+ *
+ *  Mutation step sizes live in the genome, one per table entry. A child
+ *  inherits the steps of its parent and mutation perturbs the step before
+ *  using it, so step sizes that breed good children spread along with them.
+ */
+
+#define OPERATOR_COUNT      3      // MUTATION, CROSSOVER and REPRODUCTION.
+#define OPERATOR_MIN_RATE   0.05f
+#define OPERATOR_DECAY      0.7f   // Weight of older generations in the success rates.
+#define OPERATOR_MAX_STEP   64
+
+typedef struct
+{
+    float   rate[OPERATOR_COUNT];     // Probability of each operator. Adds up to 1.
+    float   quality[OPERATOR_COUNT];  // Decayed success rate.
+    int     num_tries[OPERATOR_COUNT];      // Since the last update.
+    int     num_successes[OPERATOR_COUNT];
+} OperatorRates;
+
+OperatorRates operator_rates_default()
+{
+    OperatorRates rates = {0};
+    rates.rate[MUTATION - MUTATION]     = 0.80f;
+    rates.rate[CROSSOVER - MUTATION]    = 0.15f;
+    rates.rate[REPRODUCTION - MUTATION] = 0.05f;
+    for ( int i = 0; i < OPERATOR_COUNT; ++i ) {
+        rates.quality[i] = rates.rate[i];
+    }
+    return rates;
+}
+
+// Picks an operator. rates may be NULL for the default rates.
+EvolutionOption operator_pick(OperatorRates* rates, GARng* rng)
+{
+    static OperatorRates default_rates = { { 0.80f, 0.15f, 0.05f } };
+    if ( !rates ) {
+        rates = &default_rates;
+    }
+    float u = (float)(ga_rand(rng) % 10000) / 10000.0f;
+    float cumulative = 0;
+    for ( int i = 0; i < OPERATOR_COUNT - 1; ++i ) {
+        cumulative += rates->rate[i];
+        if ( u < cumulative ) {
+            return (EvolutionOption)(MUTATION + i);
+        }
+    }
+    return (EvolutionOption)(MUTATION + OPERATOR_COUNT - 1);
+}
+
+// Records the outcome of one evaluated child.
+void operator_rates_record(OperatorRates* rates, int op, float parent_fitness, float fitness)
+{
+    if ( op == NONE || parent_fitness > POPULATION_INVALID_FITNESS ) {
+        return;
+    }
+    int i = op - MUTATION;
+    ++rates->num_tries[i];
+    if ( fitness < parent_fitness ) {
+        ++rates->num_successes[i];
+    }
+}
+
+// Moves the rates towards the success rates recorded since the last update.
+void operator_rates_update(OperatorRates* rates)
+{
+    float sum = 0;
+    for ( int i = 0; i < OPERATOR_COUNT; ++i ) {
+        if ( rates->num_tries[i] > 0 ) {
+            float success = (float)rates->num_successes[i] / (float)rates->num_tries[i];
+            rates->quality[i] = OPERATOR_DECAY * rates->quality[i] + (1 - OPERATOR_DECAY) * success;
+        }
+        rates->num_tries[i] = 0;
+        rates->num_successes[i] = 0;
+        sum += rates->quality[i];
+    }
+    if ( sum <= 0 ) {
+        return;
+    }
+    for ( int i = 0; i < OPERATOR_COUNT; ++i ) {
+        rates->rate[i] = OPERATOR_MIN_RATE +
+                (1 - OPERATOR_COUNT * OPERATOR_MIN_RATE) * rates->quality[i] / sum;
+    }
+}
+
+// Records every bred element of an evaluated population and updates the rates.
+void operator_rates_update_from(OperatorRates* rates, Population* pop)
+{
+    for ( int i = 0; i < pop->count; ++i ) {
+        operator_rates_record(rates, pop->op[i], pop->parent_fitness[i], pop->fitness[i]);
+    }
+    operator_rates_update(rates);
+}
+
+// Mutates entry idx of table with the step size in steps, which is adapted first.
+void operator_mutate(uint8_t* table, uint8_t* steps, int idx, GARng* rng)
+{
+    int step = steps[idx];
+    switch ( ga_rand(rng) % 3 ) {
+    case 0: step = (step * 2 > OPERATOR_MAX_STEP) ? OPERATOR_MAX_STEP : step * 2; break;
+    case 1: step = (step / 2 < 1) ? 1 : step / 2; break;
+    default: break;
+    }
+    steps[idx] = (uint8_t)step;
+
+    // Never zero, so no evaluation is spent on an unchanged table.
+    int delta = 1 + ga_rand(rng) % step;
+    if ( ga_rand(rng) % 2 ) {
+        delta = -delta;
+    }
+    int old_val = table[idx];
+    int val = old_val + delta;
+    if ( val < 1 || val > 255 ) {
+        val = old_val - delta;
+    }
+    val = (val < 1) ? 1 : ((val > 255) ? 255 : val);
+    table[idx] = (uint8_t)val;
+}
@@ -0,0 +1,203 @@
+/**
+ * optimizer.c
+ *
+ *  Common interface for the generational optimizers driven by main().
+ *
+ *  Every generation main() asks the optimizer for a population, evaluates all
+ *  of it with evaluate_population and hands it back. The optimizer ranks it
+ *  and decides what to try next. Evaluation is the only expensive step, so
+ *  main() counts evaluations and time the same way for every backend.
+ */
+
+typedef enum
+{
+    OptimizerKind_GA,
+    OptimizerKind_CMAES,
+} OptimizerKind;
+
+// Generational GA. Optionally pre-screens children with a surrogate.
+typedef struct
+{
+    Population  populations[2];  // Parents and children. Swapped every generation.
+    Population* population;
+    Population* children;
+    int         population_size;
+    uint64_t    seed;
+    OperatorRates rates;
+
+    Surrogate*  surrogate;  // NULL if not screening.
+    int         surrogate_factor;
+    Population  candidates;
+    float*      predicted;  // Predicted fitness of each element in population. FLT_MAX if not screened.
+    int64_t     evaluations_saved;
+
+    Memetic*    memetic;  // NULL if elites are not refined every few generations.
+    int         generation;
+
+    uint8_t     start_table[64];  // Initial population is built around it, if has_start_table.
+    b32         has_start_table;
+} GAOptimizer;
+
+typedef struct
+{
+    OptimizerKind   kind;
+    FitnessContext* fitness_ctx;
+
+    // Only the one for kind is used.
+    GAOptimizer     ga;
+    CMAES           cmaes;
+} Optimizer;
+
+void optimizer_init(Optimizer* opt, OptimizerKind kind, Arena* arena, FitnessContext* fitness_ctx,
+                    int population_size, int surrogate_factor, Memetic* memetic, uint64_t seed)
+{
+    memset(opt, 0, sizeof(Optimizer));
+    opt->kind = kind;
+    opt->fitness_ctx = fitness_ctx;
+
+    switch (kind) {
+    case OptimizerKind_GA: {
+        GAOptimizer* ga = &opt->ga;
+        ga->populations[0] = population_init(arena, population_size);
+        ga->populations[1] = population_init(arena, population_size);
+        ga->population = &ga->populations[0];
+        ga->children = &ga->populations[1];
+        ga->population_size = population_size;
+        ga->seed = seed;
+        ga->rates = operator_rates_default();
+        if (memetic && memetic->params.num_elites > 0 && memetic->params.interval > 0) {
+            ga->memetic = memetic;
+        }
+        if (surrogate_factor > 1) {
+            ga->surrogate = arena_alloc_elem(arena, Surrogate);
+            memset(ga->surrogate, 0, sizeof(Surrogate));
+            ga->surrogate_factor = surrogate_factor;
+            ga->candidates = population_init(arena, population_size * surrogate_factor);
+            ga->predicted = arena_alloc_array(arena, population_size, float);
+            for ( int i = 0; i < population_size; ++i ) {
+                ga->predicted[i] = FLT_MAX;
+            }
+        }
+    } break;
+    case OptimizerKind_CMAES: {
+        cmaes_init(&opt->cmaes, arena, population_size, seed);
+    } break;
+    }
+}
+
+// Starts the search from table instead of from random tables. Call before
+// the first optimizer_ask.
+void optimizer_start_from(Optimizer* opt, uint8_t* table)
+{
+    switch (opt->kind) {
+    case OptimizerKind_GA: {
+        memcpy(opt->ga.start_table, table, 64);
+        opt->ga.has_start_table = true;
+    } break;
+    case OptimizerKind_CMAES: {
+        for ( int i = 0; i < CMAES_DIM; ++i ) {
+            opt->cmaes.mean[i] = log((double)table[i]);
+        }
+        opt->cmaes.sigma = 0.2;
+    } break;
+    }
+}
+
+static Population* ga_ask(GAOptimizer* ga, FitnessContext* fitness_ctx, int generation)
+{
+    if (generation == 0) {
+        if (ga->has_start_table) {
+            fill_population_around(ga->population, ga->population_size, ga->start_table, ga->seed);
+        } else {
+            fill_initial_population(ga->population, ga->population_size, ga->seed);
+        }
+        return ga->population;
+    }
+
+    // Children of the population ranked in the last call to ga_tell.
+    if (ga->surrogate && surrogate_fit(ga->surrogate)) {
+        breed_population_screened(ga->population, &ga->rates, &ga->candidates, ga->children,
+                                  ga->population_size, ga->surrogate_factor, ga->seed,
+                                  generation - 1, fitness_ctx, ga->surrogate, ga->predicted);
+        ga->evaluations_saved += ga->candidates.count - ga->population_size;
+    } else {
+        breed_population(ga->population, &ga->rates, ga->children, ga->population_size, ga->seed,
+                         generation - 1);
+        for ( int i = 0; ga->surrogate && i < ga->population_size; ++i ) {
+            ga->predicted[i] = FLT_MAX;
+        }
+    }
+
+    // Safety. No invalid tables because JPEG is fragile.
+    for (int i = 0; i < ga->children->count; ++i) {
+        for (int ei = 0; ei < 64; ++ei) {
+            if (ga->children->tables[i][ei] <= 0) {
+                sgl_assert ( !"FAIL" );
+            }
+        }
+    }
+
+    Population* tmp = ga->population;
+    ga->population = ga->children;
+    ga->children = tmp;
+    return ga->population;
+}
+
+static void ga_tell(GAOptimizer* ga, EvalResult* results)
+{
+    Population* population = ga->population;
+    if (ga->surrogate) {
+        surrogate_decay(ga->surrogate);
+        for ( int i = 0; i < population->count; ++i ) {
+            surrogate_add(ga->surrogate, population->tables[i], &results[i]);
+        }
+        if (ga->surrogate->fitted) {
+            surrogate_log_accuracy(ga->predicted, population->fitness, population->count,
+                                   ga->evaluations_saved);
+        }
+    }
+    operator_rates_update_from(&ga->rates, population);
+    sgl_log("Operators: mutation %.2f crossover %.2f reproduction %.2f\n",
+            ga->rates.rate[0], ga->rates.rate[1], ga->rates.rate[2]);
+    ++ga->generation;
+    if (ga->memetic && ga->generation % ga->memetic->params.interval == 0) {
+        population_rank(population, ga->memetic->params.num_elites, 1);
+        memetic_refine_elites(ga->memetic, population);
+    } else {
+        population_rank(population, 1, 1);
+    }
+}
+
+// Returns the population to evaluate in this generation.
+Population* optimizer_ask(Optimizer* opt, int generation)
+{
+    switch (opt->kind) {
+    case OptimizerKind_GA:
+        return ga_ask(&opt->ga, opt->fitness_ctx, generation);
+    case OptimizerKind_CMAES:
+        return cmaes_ask(&opt->cmaes);
+    }
+    return NULL;
+}
+
+// Called once the population returned by optimizer_ask has been evaluated.
+// results holds the raw result for each element. Leaves the population
+// ranked, with the best and the worst valid element in place.
+void optimizer_tell(Optimizer* opt, EvalResult* results)
+{
+    switch (opt->kind) {
+    case OptimizerKind_GA: {
+        ga_tell(&opt->ga, results);
+    } break;
+    case OptimizerKind_CMAES: {
+        cmaes_tell(&opt->cmaes);
+    } break;
+    }
+}
+
+void optimizer_finish(Optimizer* opt)
+{
+    if (opt->kind == OptimizerKind_GA && opt->ga.surrogate) {
+        sgl_log("Surrogate saved %" PRId64 " evaluations.\n", opt->ga.evaluations_saved);
+    }
+}
@@ -0,0 +1,449 @@
+/**
+ * pareto.c
+ *
+ *  Multi-objective mode (NSGA-II). Instead of one table for the scalar
+ *  fitness, evolves a set of tables spanning size against error, and writes
+ *  a file that maps quality levels to tables.
+ *
+ *  The two objectives are error_ratio and compression_ratio, the two terms
+ *  of the scalar fitness. Every generation, parents and children are sorted
+ *  into non-dominated fronts and the best half survives, preferring low
+ *  fronts and then large crowding distance. That order is stored as the
+ *  fitness of each element, so breeding is the same breed_population as the
+ *  GA.
+ *
+ *  With two objectives the non-dominated sort is a sort on one objective and
+ *  a sweep over the other, which costs nothing next to one evaluation.
+ *  Evaluations go through the same pool as the GA, against the same prelude
+ *  and DCT cache.
+ */
+
+typedef struct
+{
+    int         num_levels;  // Quality levels written to out_path. 0 means "don't use the pareto mode"
+    const char* out_path;
+    int         num_generations;
+    double      time_limit;  // In seconds. 0 means no limit.
+} ParetoParams;
+
+typedef struct
+{
+    float   error;  // error_ratio
+    float   size;   // compression_ratio
+} ParetoPoint;
+
+typedef struct
+{
+    FitnessContext* fitness_ctx;
+    int             population_size;
+
+    // Parents followed by children. The fitness of each element is its
+    // selection key: front + 1 / (1 + crowding distance).
+    Population      combined;
+    ParetoPoint*    points;     // Objectives of each element of combined.
+    int*            front;
+    float*          crowding;
+    int*            order;      // Scratch for pareto_sort.
+    int*            by_front;   // Scratch for pareto_crowding.
+    int*            front_start;
+
+    Population      parents;
+    ParetoPoint*    parent_points;
+    int*            parent_front;
+    Population      children;
+    EvalResult*     results;
+} Pareto;
+
+ParetoParams pareto_default_params()
+{
+    ParetoParams params = {0};
+    params.num_levels = 0;
+    params.out_path = "pareto_tables.txt";
+    params.num_generations = 500;
+    params.time_limit = 0;
+    return params;
+}
+
+static ParetoPoint pareto_point(FitnessContext* ctx, EvalResult* result)
+{
+    ParetoPoint p;
+    p.size  = (float)(result->bit_count / 8) / (float)ctx->base_bit_count;
+    p.error = (float)result->mse / ctx->optimal_mse;
+    // Same as the +1000 in fitness_from_result. These are numerical errors.
+    if ( p.error < 1.0f ) {
+        p.error = FLT_MAX;
+        p.size = FLT_MAX;
+    }
+    return p;
+}
+
+static b32 pareto_dominates(ParetoPoint a, ParetoPoint b)
+{
+    return a.error <= b.error && a.size <= b.size && (a.error < b.error || a.size < b.size);
+}
+
+static ParetoPoint* pareto_sort_points;  // For pareto_cmp. Only the main thread sorts.
+
+static int pareto_cmp(const void* a, const void* b)
+{
+    ParetoPoint pa = pareto_sort_points[*(const int*)a];
+    ParetoPoint pb = pareto_sort_points[*(const int*)b];
+    if ( pa.error != pb.error ) {
+        return (pa.error < pb.error) ? -1 : 1;
+    }
+    if ( pa.size != pb.size ) {
+        return (pa.size < pb.size) ? -1 : 1;
+    }
+    return 0;
+}
+
+// Assigns every point in combined to a non-dominated front. Front 0 is not
+// dominated by any point. Invalid points go to a front of their own after
+// all others. Returns the number of valid fronts.
+static int pareto_sort(Pareto* p)
+{
+    int count = p->combined.count;
+    ParetoPoint* points = p->points;
+    int* order = p->order;
+    int* front = p->front;
+    // best[f] is the point with the smallest size in front f so far.
+    int* best = p->by_front;
+
+    for ( int i = 0; i < count; ++i ) {
+        order[i] = i;
+    }
+    pareto_sort_points = points;
+    qsort(order, count, sizeof(int), pareto_cmp);
+
+    // In error order, a point is dominated by some point of a front iff it
+    // is dominated by the smallest point of that front.
+    int num_fronts = 0;
+    for ( int oi = 0; oi < count; ++oi ) {
+        int i = order[oi];
+        if ( points[i].error == FLT_MAX ) {
+            front[i] = -1;
+            continue;
+        }
+        int f = 0;
+        while ( f < num_fronts && pareto_dominates(points[best[f]], points[i]) ) {
+            ++f;
+        }
+        if ( f == num_fronts ) {
+            best[num_fronts++] = i;
+        } else if ( points[i].size < points[best[f]].size ) {
+            best[f] = i;
+        }
+        front[i] = f;
+    }
+    for ( int i = 0; i < count; ++i ) {
+        if ( front[i] < 0 ) {
+            front[i] = num_fronts;
+        }
+    }
+    return num_fronts;
+}
+
+// Crowding distance of every point within its front. Needs p->order from pareto_sort.
+static void pareto_crowding(Pareto* p, int num_fronts)
+{
+    int count = p->combined.count;
+    ParetoPoint* points = p->points;
+
+    // Bucket points by front, keeping error order.
+    int* start = p->front_start;
+    memset(start, 0, (num_fronts + 2) * sizeof(int));
+    for ( int i = 0; i < count; ++i ) {
+        ++start[p->front[i] + 1];
+    }
+    for ( int f = 0; f <= num_fronts; ++f ) {
+        start[f + 1] += start[f];
+    }
+    for ( int oi = 0; oi < count; ++oi ) {
+        int i = p->order[oi];
+        p->by_front[start[p->front[i]]++] = i;
+    }
+    // start[f] is now the end of front f.
+
+    int begin = 0;
+    for ( int f = 0; f < num_fronts; ++f ) {
+        int end = start[f];
+        int* members = p->by_front + begin;
+        int n = end - begin;
+        // Sorted by error, so also by decreasing size.
+        float error_range = points[members[n - 1]].error - points[members[0]].error;
+        float size_range  = points[members[0]].size - points[members[n - 1]].size;
+        for ( int k = 0; k < n; ++k ) {
+            if ( k == 0 || k == n - 1 ) {
+                p->crowding[members[k]] = FLT_MAX;
+                continue;
+            }
+            float d = 0;
+            if ( error_range > 0 ) {
+                d += (points[members[k + 1]].error - points[members[k - 1]].error) / error_range;
+            }
+            if ( size_range > 0 ) {
+                d += (points[members[k - 1]].size - points[members[k + 1]].size) / size_range;
+            }
+            p->crowding[members[k]] = d;
+        }
+        begin = end;
+    }
+    for ( int i = begin; i < count; ++i ) {
+        p->crowding[p->by_front[i]] = 0;
+    }
+}
+
+// Sorts p->combined into fronts and writes the selection key of every element to its fitness.
+static void pareto_assign_keys(Pareto* p)
+{
+    int num_fronts = pareto_sort(p);
+    pareto_crowding(p, num_fronts);
+    for ( int i = 0; i < p->combined.count; ++i ) {
+        if ( p->front[i] == num_fronts ) {
+            p->combined.fitness[i] = POPULATION_INVALID_FITNESS + 1;
+        } else {
+            float c = p->crowding[i];
+            p->combined.fitness[i] = (float)p->front[i] + ((c == FLT_MAX) ? 0.0f : 1.0f / (1.0f + c));
+        }
+    }
+}
+
+static float pareto_scalar_fitness(ParetoPoint point)
+{
+    return point.error + 10 * point.size;
+}
+
+// Area dominated by the first front of the parents, up to ref.
+static double pareto_hypervolume(Pareto* p, ParetoPoint ref)
+{
+    int n = 0;
+    int* members = p->order;
+    for ( int i = 0; i < p->parents.count; ++i ) {
+        if ( p->parent_front[i] == 0 ) {
+            members[n++] = i;
+        }
+    }
+    pareto_sort_points = p->parent_points;
+    qsort(members, n, sizeof(int), pareto_cmp);
+
+    double volume = 0;
+    for ( int k = 0; k < n; ++k ) {
+        ParetoPoint a = p->parent_points[members[k]];
+        float next_error = (k + 1 < n) ? p->parent_points[members[k + 1]].error : ref.error;
+        if ( a.error >= ref.error || a.size >= ref.size ) {
+            continue;
+        }
+        if ( next_error > ref.error ) {
+            next_error = ref.error;
+        }
+        volume += (double)(next_error - a.error) * (double)(ref.size - a.size);
+    }
+    return volume;
+}
+
+// Writes params->num_levels tables from the first front, spread evenly in
+// log(error). Level 0 has the lowest error.
+static void pareto_write_levels(Pareto* p, ParetoParams* params)
+{
+    int n = 0;
+    int* members = p->order;
+    for ( int i = 0; i < p->parents.count; ++i ) {
+        if ( p->parent_front[i] != 0 ) {
+            continue;
+        }
+        // Skip duplicate points.
+        b32 duplicate = false;
+        for ( int k = 0; k < n; ++k ) {
+            ParetoPoint a = p->parent_points[members[k]];
+            ParetoPoint b = p->parent_points[i];
+            if ( a.error == b.error && a.size == b.size ) {
+                duplicate = true;
+                break;
+            }
+        }
+        if ( !duplicate ) {
+            members[n++] = i;
+        }
+    }
+    if ( n == 0 ) {
+        sgl_log("No point on the front. Not writing %s\n", params->out_path);
+        return;
+    }
+    pareto_sort_points = p->parent_points;
+    qsort(members, n, sizeof(int), pareto_cmp);
+
+    FILE* fd = fopen(params->out_path, "w");
+    if ( !fd ) {
+        sgl_log("Could not open %s for writing.\n", params->out_path);
+        return;
+    }
+
+    int num_levels = params->num_levels;
+    if ( num_levels > n ) {
+        num_levels = n;
+    }
+    fprintf(fd, "# %d quality levels. Level 0 has the lowest error, the last one the smallest size.\n",
+            num_levels);
+    fprintf(fd, "# level error_ratio compression_ratio estimated_bytes table[64]\n");
+
+    double log_min = log(p->parent_points[members[0]].error);
+    double log_max = log(p->parent_points[members[n - 1]].error);
+    int last = -1;
+    for ( int level = 0; level < num_levels; ++level ) {
+        double target = (num_levels > 1) ?
+                log_min + (log_max - log_min) * level / (num_levels - 1) : log_min;
+        // Nearest point after the last one used, leaving enough for the remaining levels.
+        int k = last + 1;
+        int max_k = n - (num_levels - level);
+        while ( k < max_k &&
+                fabs(log(p->parent_points[members[k + 1]].error) - target) <
+                fabs(log(p->parent_points[members[k]].error) - target) ) {
+            ++k;
+        }
+        last = k;
+
+        int idx = members[k];
+        ParetoPoint point = p->parent_points[idx];
+        fprintf(fd, "%d %f %f %" PRIu64, level, point.error, point.size,
+                (uint64_t)(point.size * p->fitness_ctx->base_bit_count));
+        for ( int ti = 0; ti < 64; ++ti ) {
+            fprintf(fd, " %d", p->parents.tables[idx][ti]);
+        }
+        fprintf(fd, "\n");
+    }
+    fclose(fd);
+    sgl_log("Wrote %d quality levels from %d points on the front to %s\n",
+            num_levels, n, params->out_path);
+}
+
+// Evolves a pareto front and writes it to params->out_path. Returns the
+// element of the front with the best scalar fitness. If writer is not NULL,
+// that element is posted to it whenever it improves.
+//
+// Memory for the populations and for evaluations is taken from arena.
+PopulationElement pareto_evolve(ParetoParams* params, FitnessContext* fitness_ctx,
+                                Arena* arena, FILE* plot_file, BestWriter* writer,
+                                int population_size, uint64_t seed)
+{
+    Pareto p = {0};
+    int n = population_size;
+    p.fitness_ctx     = fitness_ctx;
+    p.population_size = n;
+    p.combined        = population_init(arena, 2 * n);
+    p.points          = arena_alloc_array(arena, 2 * n, ParetoPoint);
+    p.front           = arena_alloc_array(arena, 2 * n, int);
+    p.crowding        = arena_alloc_array(arena, 2 * n, float);
+    p.order           = arena_alloc_array(arena, 2 * n, int);
+    p.by_front        = arena_alloc_array(arena, 2 * n, int);
+    p.front_start     = arena_alloc_array(arena, 2 * n + 2, int);
+    p.parents         = population_init(arena, n);
+    p.parent_points   = arena_alloc_array(arena, n, ParetoPoint);
+    p.parent_front    = arena_alloc_array(arena, n, int);
+    p.children        = population_init(arena, n);
+    p.results         = arena_alloc_array(arena, n, EvalResult);
+    Arena eval_arena  = arena_push(arena, arena_available_space(arena));
+
+    uint64_t begin_us = evolve_time_us();
+    int64_t num_evaluations = 0;
+    ParetoPoint ref = {0};
+    double last_volume = 0;
+    int convergence_hits = 0;
+    float posted_fitness = FLT_MAX;  // Of the last element posted to writer.
+
+    // The first generation of children is the initial population, with no parents.
+    fill_initial_population(&p.children, n, seed);
+
+    for ( int gen_i = 0; ; ++gen_i ) {
+        evaluate_population(fitness_ctx, &eval_arena, &p.children, p.results);
+        num_evaluations += p.children.count;
+
+        // ---- Merge parents and children, and keep the best half.
+        p.combined.count = 0;
+        for ( int i = 0; i < p.parents.count; ++i ) {
+            population_push_from(&p.combined, &p.parents, i);
+            p.points[i] = p.parent_points[i];
+        }
+        for ( int i = 0; i < p.children.count; ++i ) {
+            int ci = population_push_from(&p.combined, &p.children, i);
+            p.points[ci] = pareto_point(fitness_ctx, &p.results[i]);
+        }
+        pareto_assign_keys(&p);
+        population_select_best(&p.combined, n);
+
+        p.parents.count = 0;
+        for ( int r = 0; r < n && r < p.combined.count; ++r ) {
+            int ci = p.combined.order[r];
+            int pi = population_push_from(&p.parents, &p.combined, ci);
+            p.parent_points[pi] = p.points[ci];
+            p.parent_front[pi] = p.front[ci];
+        }
+
+        // ---- Output
+        int front_size = 0;
+        int best = -1;
+        for ( int i = 0; i < p.parents.count; ++i ) {
+            if ( p.parent_front[i] == 0 ) {
+                ++front_size;
+                if ( best < 0 || pareto_scalar_fitness(p.parent_points[i]) <
+                     pareto_scalar_fitness(p.parent_points[best]) ) {
+                    best = i;
+                }
+            }
+        }
+        if ( writer && best >= 0 && pareto_scalar_fitness(p.parent_points[best]) < posted_fitness ) {
+            posted_fitness = pareto_scalar_fitness(p.parent_points[best]);
+            best_writer_post(writer, p.parents.tables[best], posted_fitness);
+        }
+        if ( gen_i == 0 ) {
+            // Reference point for the hypervolume: a bit worse than the
+            // worst initial table on both objectives.
+            for ( int i = 0; i < p.parents.count; ++i ) {
+                if ( p.parent_points[i].error != FLT_MAX ) {
+                    ref.error = fmaxf(ref.error, p.parent_points[i].error * 1.1f);
+                    ref.size  = fmaxf(ref.size,  p.parent_points[i].size * 1.1f);
+                }
+            }
+        }
+        double volume = pareto_hypervolume(&p, ref);
+        sgl_log("Gen %d Front: %d Hypervolume: %f Evaluations: %" PRId64 "\n",
+                gen_i + 1, front_size, volume, num_evaluations);
+        if ( plot_file ) {
+            char buffer[1024];
+            snprintf(buffer, 1024, "%d %d %f\n", gen_i + 1, front_size, volume);
+            fwrite(buffer, strlen(buffer), 1, plot_file);
+        }
+
+        // ---- Break criterion.
+        if ( volume - last_volume < 0.0001 * volume ) {
+            ++convergence_hits;
+        } else {
+            convergence_hits = 0;
+        }
+        last_volume = volume;
+        if ( gen_i == params->num_generations || convergence_hits == CONVERGENCE_LIMIT ) {
+            break;
+        }
+        if ( params->time_limit > 0 &&
+             evolve_time_us() - begin_us > (uint64_t)(params->time_limit * 1000000) ) {
+            sgl_log("Time limit reached.\n");
+            break;
+        }
+
+        // ---- Breed. The fitness of parents is their selection key.
+        population_rank(&p.parents, 1, 1);
+        breed_population(&p.parents, NULL, &p.children, n, seed, gen_i);
+    }
+
+    pareto_write_levels(&p, params);
+
+    PopulationElement winner = {0};
+    winner.fitness = FLT_MAX;
+    for ( int i = 0; i < p.parents.count; ++i ) {
+        float f = pareto_scalar_fitness(p.parent_points[i]);
+        if ( p.parent_front[i] == 0 && f < winner.fitness ) {
+            memcpy(winner.table, p.parents.tables[i], 64);
+            winner.fitness = f;
+        }
+    }
+    return winner;
+}
@@ -0,0 +1,226 @@
+/**
+ * pipeline.c
+ *
+ *  GA that keeps a batch on the OpenCL device while the host works. The
+ *  generational GA breeds generation g+1 from the ranking of all of
+ *  generation g, so the device idles while the host ranks and breeds, and the
+ *  host idles while the device encodes. Here every batch is bred from the
+ *  elements evaluated so far, without waiting for the batch on the device:
+ *
+ *      device:  [ batch b                ][ batch b+1              ]
+ *      host:     breed and launch b+1,     breed and launch b+2,
+ *                wait for b, merge b       wait for b+1, merge b+1
+ *
+ *  So batch b+1 only sees batches up to b-1. The population holds the best
+ *  population_size distinct elements evaluated so far, as in steady_state.c,
+ *  so the lag costs one batch of selection pressure instead of splitting the
+ *  GA into two lineages.
+ *
+ *  Batches alternate between the two buffer sets of the device. Without a
+ *  GPU, or after an OpenCL error, a batch is encoded on the CPU when it is
+ *  launched and merged at the same point, so the results for a seed do not
+ *  depend on the device.
+ */
+
+typedef struct
+{
+    int     enabled;          // 0 means "don't pipeline"
+    int     max_batches;
+    int     convergence_batches;  // Stop after this many batches without improving the best element.
+    int     population_size;  // Also the size of every batch.
+    double  time_limit;       // In seconds. 0 means no limit.
+} PipelineParams;
+
+// A batch between its launch and its merge.
+typedef struct
+{
+    Population      children;
+    EvalResult*     results;
+    uint64_t*       bit_counts;
+    uint64_t*       mse;
+    Arena           arena;      // Tables and results while the batch is on the device.
+    DJEGPUBatch     gpu_batch;
+    int             on_gpu;     // Otherwise it was evaluated at launch.
+
+    // Host timestamps for -cl-profile.
+    uint64_t        breed_us[2];
+    uint64_t        launched_us;
+    uint64_t        merge_us[2];
+} PipelineBatch;
+
+PipelineParams pipeline_default_params()
+{
+    PipelineParams params = {0};
+    params.enabled = false;
+    params.max_batches = 500;
+    // The best element of an elitist population improves in steps, so this
+    // waits longer than the generational loop, whose best element moves every
+    // generation.
+    params.convergence_batches = 3 * CONVERGENCE_LIMIT;
+    params.population_size = INITIAL_GENERATION_COUNT;
+    return params;
+}
+
+// Breeds batch index from population and starts encoding it on buffer set
+// index % GPU_NUM_BATCH_SETS. Only returns early on the device. On the CPU,
+// the batch is evaluated before this returns.
+static void pipeline_launch(FitnessContext* ctx, Population* population, OperatorRates* rates,
+                            PipelineBatch* batch, int index, uint64_t seed)
+{
+    Population* children = &batch->children;
+    batch->breed_us[0] = evolve_time_us();
+    breed_population(population, rates, children, children->capacity, seed, index);
+    batch->breed_us[1] = evolve_time_us();
+
+    batch->on_gpu = false;
+    if (ctx->gpu_info && !ctx->gpu_info->failed) {
+        arena_reset(&batch->arena);
+        DJEState state = ctx->base_state;
+        state.arena = &batch->arena;
+        batch->on_gpu = dje_gpu_launch(&state, ctx->gpu_info, index % GPU_NUM_BATCH_SETS,
+                                       children->tables, children->count, &batch->gpu_batch);
+    }
+    batch->launched_us = evolve_time_us();
+    if (!batch->on_gpu) {
+        evaluate_population(ctx, &batch->arena, children, batch->results);
+    }
+}
+
+// Waits for a batch from pipeline_launch. Afterwards every child has its
+// fitness.
+static void pipeline_wait(FitnessContext* ctx, PipelineBatch* batch)
+{
+    if (!batch->on_gpu) {
+        return;
+    }
+    Population* children = &batch->children;
+    DJEState state = ctx->base_state;
+    state.arena = &batch->arena;
+    if ( !dje_gpu_finish(&state, ctx->gpu_info, &batch->gpu_batch, batch->bit_counts, batch->mse) ) {
+        // The device failed and is not used again.
+        batch->on_gpu = false;
+        evaluate_population(ctx, &batch->arena, children, batch->results);
+        return;
+    }
+    for ( int i = 0; i < children->count; ++i ) {
+        batch->results[i].bit_count = batch->bit_counts[i];
+        batch->results[i].mse = batch->mse[i];
+        children->fitness[i] = fitness_from_result(ctx, &batch->results[i]);
+    }
+}
+
+// Runs the pipelined GA and returns the best element found. If writer is not
+// NULL, every new best element is posted to it.
+//
+// Memory for the population and both batches is taken from arena.
+PopulationElement pipeline_evolve(PipelineParams* params, FitnessContext* fitness_ctx,
+                                  Arena* arena, FILE* plot_file, BestWriter* writer,
+                                  uint64_t seed)
+{
+    int population_size = params->population_size;
+    Population population = population_init(arena, population_size);
+    fill_initial_population(&population, population_size, seed);
+
+    PipelineBatch batches[GPU_NUM_BATCH_SETS];
+    memset(batches, 0, sizeof(batches));
+    for ( int i = 0; i < GPU_NUM_BATCH_SETS; ++i ) {
+        batches[i].children = population_init(arena, population_size);
+        batches[i].results = arena_alloc_array(arena, population_size, EvalResult);
+        batches[i].bit_counts = arena_alloc_array(arena, population_size, uint64_t);
+        batches[i].mse = arena_alloc_array(arena, population_size, uint64_t);
+    }
+    size_t batch_memory = arena_available_space(arena) / GPU_NUM_BATCH_SETS;
+    for ( int i = 0; i < GPU_NUM_BATCH_SETS; ++i ) {
+        batches[i].arena = arena_push(arena, batch_memory);
+    }
+
+    uint64_t begin_us = evolve_time_us();
+
+    // Nothing can be bred before the initial population is ranked.
+    evaluate_population(fitness_ctx, &batches[0].arena, &population, batches[0].results);
+    population_sort(&population);
+    int64_t num_evaluations = population_size;
+
+    float best_fitness = population.fitness[population.order[0]];
+    if (writer) {
+        best_writer_post(writer, population.tables[population.order[0]], best_fitness);
+    }
+
+    OperatorRates rates = operator_rates_default();
+    int convergence_hits = 0;
+    b32 done = false;
+    int num_launched = 0;
+    pipeline_launch(fitness_ctx, &population, &rates, &batches[0], num_launched++, seed);
+    for ( int bi = 0; bi < num_launched; ++bi ) {
+        if ( !done && num_launched < params->max_batches ) {
+            // Bred from batches up to bi - 1 while the device encodes batch bi.
+            pipeline_launch(fitness_ctx, &population, &rates,
+                            &batches[num_launched % GPU_NUM_BATCH_SETS], num_launched, seed);
+            ++num_launched;
+        }
+
+        PipelineBatch* batch = &batches[bi % GPU_NUM_BATCH_SETS];
+        Population* children = &batch->children;
+        pipeline_wait(fitness_ctx, batch);
+
+        batch->merge_us[0] = evolve_time_us();
+        for ( int i = 0; i < children->count; ++i ) {
+            population_insert_sorted(&population, children, i, children->fitness[i]);
+        }
+        operator_rates_update_from(&rates, children);
+        num_evaluations += children->count;
+        batch->merge_us[1] = evolve_time_us();
+
+        float best = population.fitness[population.order[0]];
+        float worst = population.fitness[population.order[population.num_ranked - 1]];
+        if ( best < best_fitness - 0.0001f ) {
+            convergence_hits = 0;
+        } else {
+            ++convergence_hits;
+        }
+        if ( best < best_fitness ) {
+            best_fitness = best;
+            if (writer) {
+                best_writer_post(writer, population.tables[population.order[0]], best);
+            }
+        }
+
+        sgl_log("Batch %d \nBest: %f\nWorst: %f\nEvaluations: %" PRId64 "\n",
+                bi + 1, best, worst, num_evaluations);
+        if ( batch->on_gpu && fitness_ctx->gpu_info->profile ) {
+            uint64_t device_begin_us, device_end_us;
+            gpu_batch_host_times(&batch->gpu_batch, batch->launched_us,
+                                 &device_begin_us, &device_end_us);
+            sgl_log("CL batch %d of %d tables: host breed %" PRIu64 "-%" PRIu64 "us, "
+                    "device %" PRIu64 "-%" PRIu64 "us, host merge %" PRIu64 "-%" PRIu64 "us\n",
+                    bi + 1, children->count,
+                    batch->breed_us[0] - begin_us, batch->breed_us[1] - begin_us,
+                    device_begin_us - begin_us, device_end_us - begin_us,
+                    batch->merge_us[0] - begin_us, batch->merge_us[1] - begin_us);
+        }
+        if (plot_file) {
+            char buffer[1024];
+            snprintf(buffer, 1024, "%d %f %f\n", bi + 1, best, worst);
+            fwrite(buffer, strlen(buffer), 1, plot_file);
+        }
+
+        // The batch already in flight is still waited for and merged.
+        if ( convergence_hits == params->convergence_batches ) {
+            done = true;
+        }
+        if ( params->time_limit > 0 &&
+             evolve_time_us() - begin_us > (uint64_t)(params->time_limit * 1000000) ) {
+            if (!done) {
+                sgl_log("Time limit reached.\n");
+            }
+            done = true;
+        }
+    }
+
+    PopulationElement winner = population_element(&population, 0);
+
+    sgl_log("Pipeline finished after %d batches, %" PRId64 " evaluations. Best fitness: %f\n",
+            num_launched, num_evaluations, winner.fitness);
+
+    return winner;
+}
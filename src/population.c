@@ -0,0 +1,329 @@
+/**
+ * population.c
+ *
+ *  Fixed-capacity, structure-of-arrays population store.
+ *
+ *  Populations are allocated once from an arena. The generational loops keep
+ *  two of them (parents and children) and swap them every generation, so there
+ *  is no heap traffic after startup.
+ *
+ *  Elements never move. Ranking only fills pop->order, and only partially:
+ *  population_rank places the correct element at every rank that
+ *  grab_element can return, and leaves the rest in no particular order.
+ */
+
+// Elements with a fitness above this had numerical errors. (our horrible janky
+// hack adds 1000 to them.) They never take part in selection.
+#define POPULATION_INVALID_FITNESS 900
+
+#define POPULATION_INITIAL_STEP 4  // Mutation step size of every entry of a new table.
+
+typedef struct
+{
+    int         capacity;
+    int         count;
+    uint8_t     (*tables)[64];
+    float*      fitness;
+
+    // order[r] is the index of the element with rank r.
+    int*        order;
+    // Number of ranks that take part in selection. Elements with
+    // POPULATION_INVALID_FITNESS are ranked after them.
+    int         num_ranked;
+
+    // Scratch for population_rank. rank_needed[r] is the number of ranks
+    // below r that must be exact.
+    int*        rank_needed;
+
+    // How each element was bred. Carried along with the table.
+    uint8_t     (*steps)[64];     // Mutation step size of every entry.
+    uint8_t*    op;               // EvolutionOption that bred it. NONE if it was not bred.
+    float*      parent_fitness;   // Fitness of the parent it was bred from.
+} Population;
+
+Population population_init(Arena* arena, int capacity)
+{
+    Population pop = {0};
+    pop.capacity    = capacity;
+    pop.tables      = (uint8_t(*)[64])arena_alloc_array(arena, 64 * capacity, uint8_t);
+    pop.fitness     = arena_alloc_array(arena, capacity, float);
+    pop.order       = arena_alloc_array(arena, capacity, int);
+    pop.rank_needed = arena_alloc_array(arena, capacity + 1, int);
+    pop.steps       = (uint8_t(*)[64])arena_alloc_array(arena, 64 * capacity, uint8_t);
+    pop.op          = arena_alloc_array(arena, capacity, uint8_t);
+    pop.parent_fitness = arena_alloc_array(arena, capacity, float);
+    return pop;
+}
+
+// Adds an element and returns its index.
+int population_push(Population* pop, uint8_t* table, float fitness)
+{
+    assert(pop->count < pop->capacity);
+    int i = pop->count++;
+    memcpy(pop->tables[i], table, 64);
+    pop->fitness[i] = fitness;
+    pop->order[i] = i;
+    memset(pop->steps[i], POPULATION_INITIAL_STEP, 64);
+    pop->op[i] = NONE;
+    pop->parent_fitness[i] = FLT_MAX;
+    return i;
+}
+
+// Copies element si of src, with its breeding state, to element di of dst.
+void population_set(Population* dst, int di, Population* src, int si)
+{
+    memcpy(dst->tables[di], src->tables[si], 64);
+    memcpy(dst->steps[di], src->steps[si], 64);
+    dst->fitness[di] = src->fitness[si];
+    dst->op[di] = src->op[si];
+    dst->parent_fitness[di] = src->parent_fitness[si];
+}
+
+// Adds a copy of element si of src and returns its index.
+int population_push_from(Population* pop, Population* src, int si)
+{
+    assert(pop->count < pop->capacity);
+    int i = pop->count++;
+    pop->order[i] = i;
+    population_set(pop, i, src, si);
+    return i;
+}
+
+PopulationElement population_element(Population* pop, int rank)
+{
+    PopulationElement e;
+    int i = pop->order[rank];
+    memcpy(e.table, pop->tables[i], 64);
+    e.fitness = pop->fitness[i];
+    return e;
+}
+
+// The rank that grab_element returns for a uniform number in [1, count]
+int pareto_rank(int count, int uniform_number)
+{
+    // Cumulative
+    double pareto_number = 1.0 - (1.0 / (double)uniform_number);
+
+    int pareto_index = count - (int) (pareto_number * (double)count ) - 2;
+
+    if (pareto_index < 0) {
+        pareto_index = 0;
+    }
+    return pareto_index;
+}
+
+// Returns the rank of a parent chosen from a pareto distribution, never below start.
+int grab_element(Population* pop, int start, GARng* rng)
+{
+    int count = pop->num_ranked;
+    int uniform_number = 1 + (ga_rand(rng) % count);
+
+    int pareto_index = pareto_rank(count, uniform_number);
+
+    if ( pareto_index < start ) {
+        pareto_index = start;
+    }
+    if ( pareto_index >= count ) {
+        pareto_index = count - 1;
+    }
+
+    return pareto_index;
+}
+
+static void population_swap(int* order, int a, int b)
+{
+    int tmp = order[a];
+    order[a] = order[b];
+    order[b] = tmp;
+}
+
+// Partially sorts order[lo, hi) so that every rank marked in rank_needed holds
+// the element it would hold after a full sort.
+static void population_select(Population* pop, int lo, int hi)
+{
+    int* order = pop->order;
+    float* fitness = pop->fitness;
+    int* needed = pop->rank_needed;
+
+    while ( hi - lo > 16 ) {
+        if ( needed[hi] == needed[lo] ) {
+            return;
+        }
+
+        // Median of three.
+        int mid = lo + (hi - lo) / 2;
+        float a = fitness[order[lo]];
+        float b = fitness[order[mid]];
+        float c = fitness[order[hi - 1]];
+        float pivot = (a < b) ? ((b < c) ? b : ((a < c) ? c : a))
+                              : ((a < c) ? a : ((b < c) ? c : b));
+
+        // Three-way partition. Many elements share a fitness once the
+        // population converges.
+        //   [lo, lt)  < pivot
+        //   [lt, i)  == pivot
+        //   (gt, hi)  > pivot
+        int lt = lo;
+        int gt = hi - 1;
+        int i = lo;
+        while ( i <= gt ) {
+            float f = fitness[order[i]];
+            if ( f < pivot ) {
+                population_swap(order, lt++, i++);
+            } else if ( f > pivot ) {
+                population_swap(order, i, gt--);
+            } else {
+                ++i;
+            }
+        }
+
+        // Recurse into the smaller side, loop on the bigger one.
+        if ( lt - lo < hi - (gt + 1) ) {
+            population_select(pop, lo, lt);
+            lo = gt + 1;
+        } else {
+            population_select(pop, gt + 1, hi);
+            hi = lt;
+        }
+    }
+
+    // Insertion sort for small ranges.
+    for ( int i = lo + 1; i < hi; ++i ) {
+        int idx = order[i];
+        float f = fitness[idx];
+        int j = i;
+        while ( j > lo && fitness[order[j - 1]] > f ) {
+            order[j] = order[j - 1];
+            --j;
+        }
+        order[j] = idx;
+    }
+}
+
+static void population_count_valid(Population* pop)
+{
+    pop->num_ranked = 0;
+    for ( int i = 0; i < pop->count; ++i ) {
+        if ( pop->fitness[i] <= POPULATION_INVALID_FITNESS ) {
+            ++pop->num_ranked;
+        }
+    }
+    if ( pop->num_ranked == 0 ) {
+        pop->num_ranked = pop->count;
+    }
+}
+
+// Ranks only what selection needs: every rank grab_element can return for
+// this population, the num_head best ranks and the num_tail worst valid
+// ranks. That is O(sqrt(count)) ranks, so this is much cheaper than a sort
+// once populations get big.
+void population_rank(Population* pop, int num_head, int num_tail)
+{
+    int count = pop->count;
+    for ( int i = 0; i < count; ++i ) {
+        pop->order[i] = i;
+    }
+    population_count_valid(pop);
+
+    int* needed = pop->rank_needed;
+    memset(needed, 0, (count + 1) * sizeof(int));
+
+    // Mark ranks in needed[r + 1], then turn that into a prefix count.
+    int n = pop->num_ranked;
+    for ( int u = 1; u <= n; ++u ) {
+        int r = pareto_rank(n, u);
+        needed[r + 1] = 1;
+        // Crossover grabs its second parent from above the first one.
+        if ( r + 1 < n ) {
+            needed[r + 2] = 1;
+        }
+        // pareto_rank is decreasing in u and reaches 0 quickly.
+        if ( r == 0 ) {
+            break;
+        }
+    }
+    for ( int r = 0; r < num_head && r < n; ++r ) {
+        needed[r + 1] = 1;
+    }
+    for ( int r = n - num_tail; r < n; ++r ) {
+        if ( r >= 0 ) {
+            needed[r + 1] = 1;
+        }
+    }
+    // Elements with invalid fitness must end up after the valid ones.
+    if ( n < count ) {
+        needed[n] = 1;
+        needed[n + 1] = 1;
+    }
+    for ( int r = 0; r < count; ++r ) {
+        needed[r + 1] += needed[r];
+    }
+
+    population_select(pop, 0, count);
+}
+
+// Full sort of pop->order.
+void population_sort(Population* pop)
+{
+    int count = pop->count;
+    for ( int i = 0; i < count; ++i ) {
+        pop->order[i] = i;
+    }
+    population_count_valid(pop);
+    for ( int r = 0; r <= count; ++r ) {
+        pop->rank_needed[r] = r;
+    }
+    population_select(pop, 0, count);
+}
+
+// Inserts element si of src with the given fitness in sorted position, in
+// place of the worst element of pop, which must be fully sorted. Returns false
+// if the element is worse than every element in pop, or if it is already in
+// it. Without the second check the population quickly fills up with copies of
+// the best element.
+int population_insert_sorted(Population* pop, Population* src, int si, float fitness)
+{
+    uint8_t* table = src->tables[si];
+    int count = pop->count;
+    int* order = pop->order;
+    if ( fitness >= pop->fitness[order[count - 1]] ) {
+        return false;
+    }
+    for ( int i = 0; i < count; ++i ) {
+        if ( !memcmp(pop->tables[i], table, 64) ) {
+            return false;
+        }
+    }
+    int idx = order[count - 1];
+    population_set(pop, idx, src, si);
+    pop->fitness[idx] = fitness;
+
+    int r = count - 1;
+    while ( r > 0 && pop->fitness[order[r - 1]] > fitness ) {
+        order[r] = order[r - 1];
+        --r;
+    }
+    order[r] = idx;
+    if ( fitness <= POPULATION_INVALID_FITNESS && pop->num_ranked < count ) {
+        ++pop->num_ranked;
+    }
+    return true;
+}
+
+// Partially sorts pop->order so that its first k entries are the k best
+// elements, in no particular order.
+void population_select_best(Population* pop, int k)
+{
+    int count = pop->count;
+    for ( int i = 0; i < count; ++i ) {
+        pop->order[i] = i;
+    }
+    population_count_valid(pop);
+    if ( k <= 0 || k >= count ) {
+        return;
+    }
+    for ( int r = 0; r <= count; ++r ) {
+        pop->rank_needed[r] = (r >= k) ? 1 : 0;
+    }
+    population_select(pop, 0, count);
+}
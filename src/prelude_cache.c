@@ -0,0 +1,192 @@
+/**
+ * prelude_cache.c
+ *
+ *  On-disk cache of everything computed from the source image before the
+ *  first evaluation: the decoded pixels, the luma blocks and their DCT.
+ *
+ *  Cache files are named after a hash of the contents of the source file,
+ *  so a re-optimization of the same asset finds its cache whatever the file
+ *  is called, and an edited asset never hits a stale one. They are mapped
+ *  read-only: nothing is copied, and concurrent runs on the same image
+ *  share one copy through the page cache.
+ *
+ *  Files are written to a temporary path and renamed, so a concurrent
+ *  reader sees either no cache or a complete one. The layout is native
+ *  endian and checked against PRELUDE_VERSION; a mismatch is a cache miss.
+ */
+
+#define PRELUDE_MAGIC       0x4c525047  // "GPRL"
+#define PRELUDE_VERSION     2
+#define PRELUDE_ALIGNMENT   64
+
+typedef struct
+{
+    uint32_t    magic;
+    uint32_t    version;
+    uint64_t    hash;        // Of the source file.
+    int32_t     width;
+    int32_t     height;
+    int32_t     num_components;
+    int32_t     num_blocks;
+    uint64_t    data_offset;
+    uint64_t    blocks_offset;
+    uint64_t    dct_offset;
+    uint64_t    file_size;
+} PreludeHeader;
+
+typedef struct
+{
+    const unsigned char*    data;
+    DJEBlock*               y_blocks;    // Read only.
+    DJEDCTBlock*            dct_blocks;  // Read only.
+    int                     width;
+    int                     height;
+    int                     num_components;
+
+    MappedFile              file;
+} PreludeCache;
+
+// Hash of the contents of the file at path. Returns false if it can't be read.
+b32 prelude_hash_file(const char* path, uint64_t* out_hash)
+{
+    FILE* fd = fopen(path, "rb");
+    if ( !fd ) {
+        return false;
+    }
+    size_t chunk_size = 1 << 20;
+    uint8_t* chunk = sgl_malloc(chunk_size);
+    uint64_t hash = PRELUDE_VERSION;
+    uint64_t length = 0;
+    size_t n;
+    while ( (n = fread(chunk, 1, chunk_size, fd)) > 0 ) {
+        size_t i = 0;
+        for ( ; i + 8 <= n; i += 8 ) {
+            uint64_t word;
+            memcpy(&word, chunk + i, 8);
+            hash = ga_mix64(hash ^ word) + 0x9e3779b97f4a7c15ULL;
+        }
+        for ( ; i < n; ++i ) {
+            hash = ga_mix64(hash ^ chunk[i]) + 0x9e3779b97f4a7c15ULL;
+        }
+        length += n;
+    }
+    sgl_free(chunk);
+    fclose(fd);
+    *out_hash = ga_mix64(hash ^ length);
+    return true;
+}
+
+void prelude_cache_path(char* out, size_t out_size, const char* dir, uint64_t hash)
+{
+    snprintf(out, out_size, "%s/%016" PRIx64 ".prelude", dir, hash);
+}
+
+static uint64_t prelude_align(uint64_t offset)
+{
+    return (offset + PRELUDE_ALIGNMENT - 1) / PRELUDE_ALIGNMENT * PRELUDE_ALIGNMENT;
+}
+
+static b32 prelude_write_at(FILE* fd, uint64_t offset, const void* data, size_t size)
+{
+    // Pad up to offset.
+    static const uint8_t zeros[PRELUDE_ALIGNMENT] = {0};
+    long pos = ftell(fd);
+    if ( pos < 0 || (uint64_t)pos > offset || offset - (uint64_t)pos > PRELUDE_ALIGNMENT ) {
+        return false;
+    }
+    if ( offset > (uint64_t)pos && fwrite(zeros, (size_t)(offset - pos), 1, fd) != 1 ) {
+        return false;
+    }
+    return fwrite(data, size, 1, fd) == 1;
+}
+
+// Writes the cache for the image data, whose blocks are in state.
+b32 prelude_cache_write(const char* path, uint64_t hash, DJEState* state,
+                        int width, int height, int num_components, const unsigned char* data)
+{
+    int num_blocks = state->num_blocks;
+    size_t data_size = (size_t)width * height * num_components;
+    size_t blocks_size = sizeof(DJEBlock) * (size_t)num_blocks;
+    size_t dct_size = sizeof(DJEDCTBlock) * (size_t)num_blocks;
+
+    PreludeHeader header = {0};
+    header.magic          = PRELUDE_MAGIC;
+    header.version        = PRELUDE_VERSION;
+    header.hash           = hash;
+    header.width          = width;
+    header.height         = height;
+    header.num_components = num_components;
+    header.num_blocks     = num_blocks;
+    header.data_offset    = prelude_align(sizeof(PreludeHeader));
+    header.blocks_offset  = prelude_align(header.data_offset + data_size);
+    header.dct_offset     = prelude_align(header.blocks_offset + blocks_size);
+    header.file_size      = header.dct_offset + dct_size;
+
+    // Unique per process, so concurrent runs don't write over each other.
+    char tmp_path[1024];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%" PRIu64 ".tmp", path, evolve_time_us());
+    FILE* fd = fopen(tmp_path, "wb");
+    if ( !fd ) {
+        sgl_log("Could not open %s for writing.\n", tmp_path);
+        return false;
+    }
+
+    DJEDCTBlock* dct_blocks = state->dct_blocks;
+    if ( !dct_blocks ) {
+        dct_blocks = sgl_malloc(dct_size);
+        for ( int bi = 0; bi < num_blocks; ++bi ) {
+            dje_block_load(dct_blocks[bi].d, &state->y_blocks[bi]);
+            fdct(dct_blocks[bi].d);
+        }
+    }
+
+    b32 ok = fwrite(&header, sizeof(header), 1, fd) == 1 &&
+            prelude_write_at(fd, header.data_offset, data, data_size) &&
+            prelude_write_at(fd, header.blocks_offset, state->y_blocks, blocks_size) &&
+            prelude_write_at(fd, header.dct_offset, dct_blocks, dct_size);
+    ok = (fclose(fd) == 0) && ok;
+    if ( dct_blocks != state->dct_blocks ) {
+        sgl_free(dct_blocks);
+    }
+    if ( ok ) {
+        ok = evolve_replace_file(tmp_path, path);
+    }
+    if ( !ok ) {
+        sgl_log("Could not write %s\n", path);
+        remove(tmp_path);
+    }
+    return ok;
+}
+
+void prelude_cache_close(PreludeCache* cache)
+{
+    mapped_file_close(&cache->file);
+    memset(cache, 0, sizeof(PreludeCache));
+}
+
+// Maps the cache at path. Returns false if there is none, or if it is not a
+// complete cache for hash.
+b32 prelude_cache_open(PreludeCache* cache, const char* path, uint64_t hash)
+{
+    memset(cache, 0, sizeof(PreludeCache));
+    if ( !mapped_file_open(&cache->file, path) ) {
+        return false;
+    }
+
+    PreludeHeader* header = (PreludeHeader*)cache->file.data;
+    if ( cache->file.size < sizeof(PreludeHeader) ||
+         header->magic != PRELUDE_MAGIC || header->version != PRELUDE_VERSION ||
+         header->hash != hash || header->file_size != cache->file.size ||
+         header->dct_offset + sizeof(DJEDCTBlock) * (uint64_t)header->num_blocks > header->file_size ) {
+        prelude_cache_close(cache);
+        return false;
+    }
+    uint8_t* base = (uint8_t*)cache->file.data;
+    cache->data           = base + header->data_offset;
+    cache->y_blocks       = (DJEBlock*)(base + header->blocks_offset);
+    cache->dct_blocks     = (DJEDCTBlock*)(base + header->dct_offset);
+    cache->width          = header->width;
+    cache->height         = header->height;
+    cache->num_components = header->num_components;
+    return true;
+}
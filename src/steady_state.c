@@ -0,0 +1,218 @@
+/**
+ * steady_state.c
+ *
+ *  Steady-state GA without a generation barrier. Every worker thread breeds
+ *  one child from the shared ranked population, evaluates it with
+ *  dje_encode_serial and inserts it in place of the worst element if it is
+ *  better. A slow evaluation only holds back the worker doing it.
+ *
+ *  The population is always fully sorted by fitness, which is cheap to
+ *  maintain one insertion at a time. It is only locked while breeding and
+ *  while inserting, never during evaluation or while logging.
+ */
+
+typedef struct
+{
+    int     num_workers;        // 0 means "don't use the steady state GA"
+    int     max_evaluations;
+    int     convergence_evaluations;  // Stop after this many evaluations without improving the best element.
+    int     population_size;
+    double  time_limit;  // In seconds. 0 means no limit.
+} SteadyStateParams;
+
+typedef struct
+{
+    SteadyStateParams*  params;
+    FitnessContext*     fitness_ctx;
+    FILE*               plot_file;
+    uint64_t            seed;
+
+    // Everything below is protected by mutex.
+    SglMutex*           mutex;
+    Population          population;    // Fully sorted by fitness.
+    int                 num_pending;   // Elements of the initial population not yet handed to a worker.
+    int                 num_unranked;  // Elements of the initial population not yet evaluated.
+    int                 num_evaluations;
+    int                 num_bred;
+    int                 last_improvement;  // Evaluation index of the last improvement to the best element.
+    OperatorRates       rates;
+    int                 num_recorded;      // Children recorded in rates.
+    float               best_fitness;
+    int                 done;
+    uint64_t            begin_us;
+
+    int                 num_waiting;  // Workers waiting on ranked_semaphore.
+
+    BestWriter*         writer;  // NULL if improvements are not written as they happen.
+    SglSemaphore*       ranked_semaphore;  // Signaled once per waiting worker when the initial population is ranked.
+    SglSemaphore*       done_semaphore;
+} SteadyState;
+
+typedef struct
+{
+    SteadyState*    ss;
+    Population      child;  // A single element.
+    Arena           arena;
+} SteadyStateWorker;
+
+SteadyStateParams steady_state_default_params()
+{
+    SteadyStateParams params = {0};
+    params.num_workers = 0;
+    params.max_evaluations = 500 * INITIAL_GENERATION_COUNT;
+    params.convergence_evaluations = CONVERGENCE_LIMIT * INITIAL_GENERATION_COUNT;
+    params.population_size = INITIAL_GENERATION_COUNT;
+    return params;
+}
+
+static void steady_state_worker(void* data)
+{
+    SteadyStateWorker* worker = (SteadyStateWorker*)data;
+    SteadyState* ss = worker->ss;
+    Population* pop = &ss->population;
+
+    for (;;) {
+        uint8_t* child = worker->child.tables[0];
+        int pending_index = -1;
+
+        // ---- Grab an unevaluated element, or breed a new child.
+        sgl_mutex_lock(ss->mutex);
+        if ( ss->done ) {
+            sgl_mutex_unlock(ss->mutex);
+            break;
+        }
+        if ( ss->num_pending > 0 ) {
+            pending_index = --ss->num_pending;
+            population_set(&worker->child, 0, pop, pending_index);
+        } else if ( ss->num_unranked > 0 ) {
+            // Only happens at startup, while the last elements of the initial
+            // population are being evaluated.
+            ++ss->num_waiting;
+            sgl_mutex_unlock(ss->mutex);
+            sgl_semaphore_wait(ss->ranked_semaphore);
+            continue;
+        } else {
+            // Every child gets its own stream, but which parents it sees
+            // depends on timing. Only runs with one worker are reproducible.
+            GARng rng = ga_rng_key(ss->seed, GA_STREAM_STEADY, (uint32_t)ss->num_bred++);
+            breed_child(pop, &ss->rates, &worker->child, 0, &rng);
+        }
+        sgl_mutex_unlock(ss->mutex);
+
+        float fitness = evaluate_fitness_serial(ss->fitness_ctx, &worker->arena, child);
+
+        // ---- Insert.
+        sgl_mutex_lock(ss->mutex);
+        if ( pending_index >= 0 ) {
+            pop->fitness[pending_index] = fitness;
+            if ( --ss->num_unranked == 0 ) {
+                population_sort(pop);
+            }
+        } else {
+            population_insert_sorted(pop, &worker->child, 0, fitness);
+            operator_rates_record(&ss->rates, worker->child.op[0],
+                                  worker->child.parent_fitness[0], fitness);
+            if ( ++ss->num_recorded % pop->count == 0 ) {
+                operator_rates_update(&ss->rates);
+            }
+        }
+
+        int eval_i = ++ss->num_evaluations;
+        float best = pop->fitness[pop->order[0]];
+        float worst = pop->fitness[pop->order[pop->count - 1]];
+        if ( ss->num_unranked == 0 && best < ss->best_fitness - 0.0001f ) {
+            ss->best_fitness = best;
+            ss->last_improvement = eval_i;
+            if ( ss->writer ) {
+                best_writer_post(ss->writer, pop->tables[pop->order[0]], best);
+            }
+        }
+
+        if ( eval_i >= ss->params->max_evaluations ||
+             eval_i - ss->last_improvement >= ss->params->convergence_evaluations ) {
+            ss->done = true;
+        }
+        if ( ss->params->time_limit > 0 &&
+             evolve_time_us() - ss->begin_us > (uint64_t)(ss->params->time_limit * 1000000) ) {
+            ss->done = true;
+        }
+        // Waiting workers go on to breed, or see done and stop.
+        if ( ss->num_unranked == 0 || ss->done ) {
+            for ( ; ss->num_waiting > 0; --ss->num_waiting ) {
+                sgl_semaphore_signal(ss->ranked_semaphore);
+            }
+        }
+        sgl_mutex_unlock(ss->mutex);
+
+        // Written outside the lock, so that no worker waits on another's
+        // I/O. Lines of different workers can come out of order.
+        sgl_log("Eval %d Fitness: %f Best: %f Worst: %f\n", eval_i, fitness, best, worst);
+        if ( ss->plot_file ) {
+            char buffer[1024];
+            snprintf(buffer, 1024, "%d %f %f\n", eval_i, best, worst);
+            fwrite(buffer, strlen(buffer), 1, ss->plot_file);
+        }
+    }
+
+    sgl_semaphore_signal(ss->done_semaphore);
+}
+
+// Runs the steady-state GA with params->num_workers threads and returns the
+// best element found. If writer is not NULL, every new best element is
+// posted to it.
+//
+// Memory for every worker is taken from arena.
+PopulationElement steady_state_evolve(SteadyStateParams* params, FitnessContext* fitness_ctx,
+                                      Arena* arena, FILE* plot_file, BestWriter* writer,
+                                      uint64_t seed)
+{
+    int num_workers = params->num_workers;
+
+    SteadyState ss = {0};
+    ss.params = params;
+    ss.fitness_ctx = fitness_ctx;
+    ss.plot_file = plot_file;
+    ss.mutex = sgl_create_mutex();
+    ss.ranked_semaphore = sgl_create_semaphore(0);
+    ss.done_semaphore = sgl_create_semaphore(0);
+    ss.best_fitness = FLT_MAX;
+    ss.rates = operator_rates_default();
+    ss.writer = writer;
+    ss.begin_us = evolve_time_us();
+
+    ss.seed = seed;
+    ss.population = population_init(arena, params->population_size);
+    fill_initial_population(&ss.population, params->population_size, seed);
+    ss.num_pending = ss.population.count;
+    ss.num_unranked = ss.num_pending;
+
+    SteadyStateWorker* workers = sgl_calloc(sizeof(SteadyStateWorker), num_workers);
+    for ( int i = 0; i < num_workers; ++i ) {
+        workers[i].ss = &ss;
+        workers[i].child = population_init(arena, 1);
+    }
+    size_t worker_memory = arena_available_space(arena) / num_workers;
+    for ( int i = 0; i < num_workers; ++i ) {
+        workers[i].arena = arena_push(arena, worker_memory);
+    }
+
+    for ( int i = 0; i < num_workers; ++i ) {
+        sgl_create_thread(steady_state_worker, &workers[i]);
+    }
+
+    for ( int i = 0; i < num_workers; ++i ) {
+        sgl_semaphore_wait(ss.done_semaphore);
+    }
+
+    PopulationElement winner = population_element(&ss.population, 0);
+
+    sgl_log("Steady state finished after %d evaluations. Best fitness: %f\n",
+            ss.num_evaluations, winner.fitness);
+
+    sgl_free(workers);
+    sgl_destroy_semaphore(ss.ranked_semaphore);
+    sgl_destroy_semaphore(ss.done_semaphore);
+    sgl_destroy_mutex(ss.mutex);
+
+    return winner;
+}
@@ -0,0 +1,190 @@
+/**
+ * surrogate.c
+ *
+ *  Cheap online model of the encoder, used to throw away bad children
+ *  before they are evaluated.
+ *
+ *  log(bit_count) and log(mse) are predicted by two ridge regressions on the
+ *  logs of the 64 table entries. Only the sufficient statistics (X'X and X'y)
+ *  are kept, so adding a sample is O(65^2) and fitting is one 65x65 Cholesky
+ *  solve per generation. Old samples are decayed every generation, because
+ *  the population moves and the model only has to be right around it.
+ */
+
+#define SURROGATE_DIM        65     // Intercept + one feature per table entry.
+#define SURROGATE_MIN_WEIGHT (2.0 * SURROGATE_DIM)  // Don't fit with fewer samples than this.
+#define SURROGATE_RIDGE      1.0
+#define SURROGATE_DECAY      0.9    // Per generation.
+
+typedef struct
+{
+    uint64_t    bit_count;
+    uint64_t    mse;
+} EvalResult;
+
+enum
+{
+    SurrogateTarget_BITS,
+    SurrogateTarget_MSE,
+
+    SurrogateTarget_COUNT,
+};
+
+typedef struct
+{
+    double  xtx[SURROGATE_DIM * SURROGATE_DIM];
+    double  xty[SurrogateTarget_COUNT][SURROGATE_DIM];
+    double  weight;  // Effective number of samples.
+
+    double  coef[SurrogateTarget_COUNT][SURROGATE_DIM];
+    b32     fitted;
+
+    double  cholesky[SURROGATE_DIM * SURROGATE_DIM];  // Scratch for surrogate_fit.
+} Surrogate;
+
+static void surrogate_features(uint8_t* table, double* x)
+{
+    x[0] = 1.0;
+    for ( int i = 0; i < 64; ++i ) {
+        x[i + 1] = log((double)table[i]);
+    }
+}
+
+void surrogate_add(Surrogate* s, uint8_t* table, EvalResult* result)
+{
+    if ( result->bit_count == 0 || result->mse == 0 ) {
+        return;
+    }
+    double x[SURROGATE_DIM];
+    surrogate_features(table, x);
+    double y[SurrogateTarget_COUNT] = {
+        log((double)result->bit_count),
+        log((double)result->mse),
+    };
+
+    // Only the upper triangle is used.
+    for ( int i = 0; i < SURROGATE_DIM; ++i ) {
+        for ( int j = i; j < SURROGATE_DIM; ++j ) {
+            s->xtx[i * SURROGATE_DIM + j] += x[i] * x[j];
+        }
+        for ( int t = 0; t < SurrogateTarget_COUNT; ++t ) {
+            s->xty[t][i] += x[i] * y[t];
+        }
+    }
+    s->weight += 1.0;
+}
+
+void surrogate_decay(Surrogate* s)
+{
+    for ( int i = 0; i < SURROGATE_DIM * SURROGATE_DIM; ++i ) {
+        s->xtx[i] *= SURROGATE_DECAY;
+    }
+    for ( int t = 0; t < SurrogateTarget_COUNT; ++t ) {
+        for ( int i = 0; i < SURROGATE_DIM; ++i ) {
+            s->xty[t][i] *= SURROGATE_DECAY;
+        }
+    }
+    s->weight *= SURROGATE_DECAY;
+}
+
+// Solves the ridge regression. Returns false if there are not enough samples
+// yet, in which case the previous coefficients are kept.
+b32 surrogate_fit(Surrogate* s)
+{
+    if ( s->weight < SURROGATE_MIN_WEIGHT ) {
+        return false;
+    }
+
+    // Cholesky factorization of X'X + ridge, in the lower triangle of l.
+    // The intercept is not regularized.
+    double* l = s->cholesky;
+    for ( int j = 0; j < SURROGATE_DIM; ++j ) {
+        for ( int i = j; i < SURROGATE_DIM; ++i ) {
+            double sum = s->xtx[j * SURROGATE_DIM + i];
+            if ( i == j && i > 0 ) {
+                sum += SURROGATE_RIDGE;
+            }
+            for ( int k = 0; k < j; ++k ) {
+                sum -= l[i * SURROGATE_DIM + k] * l[j * SURROGATE_DIM + k];
+            }
+            if ( i == j ) {
+                if ( sum <= 0.0 ) {
+                    return false;
+                }
+                l[j * SURROGATE_DIM + j] = sqrt(sum);
+            } else {
+                l[i * SURROGATE_DIM + j] = sum / l[j * SURROGATE_DIM + j];
+            }
+        }
+    }
+
+    for ( int t = 0; t < SurrogateTarget_COUNT; ++t ) {
+        double* c = s->coef[t];
+        // L z = X'y
+        for ( int i = 0; i < SURROGATE_DIM; ++i ) {
+            double sum = s->xty[t][i];
+            for ( int k = 0; k < i; ++k ) {
+                sum -= l[i * SURROGATE_DIM + k] * c[k];
+            }
+            c[i] = sum / l[i * SURROGATE_DIM + i];
+        }
+        // L' c = z
+        for ( int i = SURROGATE_DIM - 1; i >= 0; --i ) {
+            double sum = c[i];
+            for ( int k = i + 1; k < SURROGATE_DIM; ++k ) {
+                sum -= l[k * SURROGATE_DIM + i] * c[k];
+            }
+            c[i] = sum / l[i * SURROGATE_DIM + i];
+        }
+    }
+    s->fitted = true;
+    return true;
+}
+
+EvalResult surrogate_predict(Surrogate* s, uint8_t* table)
+{
+    double x[SURROGATE_DIM];
+    surrogate_features(table, x);
+    double y[SurrogateTarget_COUNT] = {0};
+    for ( int t = 0; t < SurrogateTarget_COUNT; ++t ) {
+        for ( int i = 0; i < SURROGATE_DIM; ++i ) {
+            y[t] += s->coef[t][i] * x[i];
+        }
+    }
+    EvalResult result;
+    result.bit_count = (uint64_t)exp(y[SurrogateTarget_BITS]);
+    result.mse       = (uint64_t)exp(y[SurrogateTarget_MSE]);
+    return result;
+}
+
+// Logs how well the predicted fitness of the last screened generation matched
+// the real one. Elements with invalid fitness are left out.
+void surrogate_log_accuracy(float* predicted, float* actual, int count, int64_t evaluations_saved)
+{
+    int n = 0;
+    double sum_p = 0, sum_a = 0, sum_pp = 0, sum_aa = 0, sum_pa = 0, sum_abs = 0;
+    for ( int i = 0; i < count; ++i ) {
+        if ( predicted[i] > POPULATION_INVALID_FITNESS || actual[i] > POPULATION_INVALID_FITNESS ) {
+            continue;
+        }
+        double p = predicted[i];
+        double a = actual[i];
+        sum_p += p;
+        sum_a += a;
+        sum_pp += p * p;
+        sum_aa += a * a;
+        sum_pa += p * a;
+        sum_abs += fabs(p - a);
+        ++n;
+    }
+    if ( n < 2 ) {
+        return;
+    }
+    double cov   = sum_pa - sum_p * sum_a / n;
+    double var_p = sum_pp - sum_p * sum_p / n;
+    double var_a = sum_aa - sum_a * sum_a / n;
+    double correlation = (var_p > 0 && var_a > 0) ? cov / sqrt(var_p * var_a) : 0.0;
+
+    sgl_log("Surrogate MAE: %f Correlation: %f Evaluations saved: %" PRId64 "\n",
+            sum_abs / n, correlation, evaluations_saved);
+}
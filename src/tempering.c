@@ -0,0 +1,265 @@
+/**
+ * tempering.c
+ *
+ *  Parallel tempering (replica exchange). Every chain runs simulated
+ *  annealing at a fixed temperature on its own thread. A proposal changes a
+ *  single table entry, so it is scored with the delta path in dummy_jpeg.h.
+ *
+ *  Temperatures form a geometric ladder. Every swap_interval proposals, a
+ *  chain tries to exchange temperatures with the chain on the next rung, with
+ *  the usual Metropolis criterion. Exchanges only touch the temperatures and
+ *  the ladder under a mutex, so no chain ever waits for another one to finish
+ *  a proposal.
+ */
+
+typedef struct
+{
+    int     num_chains;     // 0 means "don't use parallel tempering"
+    float   min_temperature;
+    float   max_temperature;
+    int     swap_interval;  // In proposals.
+    int64_t max_proposals;  // Per chain.
+    double  time_limit;     // In seconds. 0 means no limit.
+} TemperingParams;
+
+typedef struct TemperingChain_s TemperingChain;
+
+typedef struct
+{
+    TemperingParams*    params;
+    FitnessContext*     fitness_ctx;
+    TemperingChain*     chains;
+    uint64_t            begin_us;
+
+    // Protects every chain's temperature, rung and fitness, and ladder.
+    SglMutex*           mutex;
+    int*                ladder;  // ladder[rung] is the chain at that temperature. Rung 0 is the coldest.
+    int64_t             num_swaps;
+    int64_t             num_swaps_accepted;
+
+    // Best fitness over every chain, protected by best_mutex. New bests are
+    // posted to writer, if not NULL.
+    BestWriter*         writer;
+    SglMutex*           best_mutex;
+    float               best_fitness;
+
+    SglSemaphore*       done_semaphore;
+} Tempering;
+
+struct TemperingChain_s
+{
+    int                 id;
+    Tempering*          tempering;
+    Arena               arena;
+    DJEDeltaCache       cache;
+    GARng               rng;
+
+    float               temperature;
+    int                 rung;
+    float               fitness;
+
+    int64_t             num_proposals;
+    int64_t             num_accepted;
+    PopulationElement   best;
+};
+
+TemperingParams tempering_default_params()
+{
+    TemperingParams params = {0};
+    params.num_chains = 0;
+    params.min_temperature = 0.0005f;
+    params.max_temperature = 0.1f;
+    params.swap_interval = 50;
+    params.max_proposals = 20000;
+    params.time_limit = 0;
+    return params;
+}
+
+static double tempering_uniform(GARng* rng)
+{
+    return ((double)ga_rand(rng) + 0.5) / 2147483648.0;
+}
+
+// Tries to exchange temperatures with the chain on the next rung.
+static void tempering_try_swap(TemperingChain* chain)
+{
+    Tempering* t = chain->tempering;
+    double u = tempering_uniform(&chain->rng);
+
+    sgl_mutex_lock(t->mutex);
+    int rung = chain->rung;
+    if ( rung + 1 < t->params->num_chains ) {
+        TemperingChain* other = &t->chains[t->ladder[rung + 1]];
+        double beta_diff = 1.0 / chain->temperature - 1.0 / other->temperature;
+        double log_accept = beta_diff * (chain->fitness - other->fitness);
+        ++t->num_swaps;
+        if ( log_accept >= 0 || u < exp(log_accept) ) {
+            float tmp_temperature = chain->temperature;
+            chain->temperature = other->temperature;
+            other->temperature = tmp_temperature;
+            other->rung = rung;
+            chain->rung = rung + 1;
+            t->ladder[rung] = other->id;
+            t->ladder[rung + 1] = chain->id;
+            ++t->num_swaps_accepted;
+        }
+    }
+    sgl_mutex_unlock(t->mutex);
+}
+
+static void tempering_thread(void* data)
+{
+    TemperingChain* chain = (TemperingChain*)data;
+    Tempering* t = chain->tempering;
+    TemperingParams* params = t->params;
+    FitnessContext* ctx = t->fitness_ctx;
+    DJEState* state = &ctx->base_state;
+    uint64_t last_log_us = t->begin_us;
+
+    for ( ;; ) {
+        if ( chain->num_proposals >= params->max_proposals ) {
+            break;
+        }
+        if ( params->time_limit > 0 &&
+             (evolve_time_us() - t->begin_us) > (uint64_t)(params->time_limit * 1000000) ) {
+            break;
+        }
+
+        sgl_mutex_lock(t->mutex);
+        float temperature = chain->temperature;
+        sgl_mutex_unlock(t->mutex);
+
+        int index = ga_rand(&chain->rng) % 64;
+        int step = 1 + ga_rand(&chain->rng) % 4;
+        if ( ga_rand(&chain->rng) % 2 ) {
+            step = -step;
+        }
+        int value = chain->cache.qt[index] + step;
+        value = (value < 1) ? 1 : ((value > 255) ? 255 : value);
+
+        ++chain->num_proposals;
+        if ( value != chain->cache.qt[index] ) {
+            EvalResult result;
+            dje_delta_try(state, &chain->cache, index, (uint8_t)value,
+                          &result.bit_count, &result.mse);
+            float fitness = fitness_from_result(ctx, &result);
+            float diff = fitness - chain->fitness;
+            double u = tempering_uniform(&chain->rng);
+            if ( diff <= 0 || u < exp(-diff / temperature) ) {
+                dje_delta_apply(state, &chain->cache, index, (uint8_t)value);
+                ++chain->num_accepted;
+                sgl_mutex_lock(t->mutex);
+                chain->fitness = fitness;
+                sgl_mutex_unlock(t->mutex);
+                if ( fitness < chain->best.fitness ) {
+                    memcpy(chain->best.table, chain->cache.qt, 64);
+                    chain->best.fitness = fitness;
+                    if ( t->writer ) {
+                        sgl_mutex_lock(t->best_mutex);
+                        if ( fitness < t->best_fitness ) {
+                            t->best_fitness = fitness;
+                            best_writer_post(t->writer, chain->best.table, fitness);
+                        }
+                        sgl_mutex_unlock(t->best_mutex);
+                    }
+                }
+            }
+        }
+
+        if ( chain->num_proposals % params->swap_interval == 0 ) {
+            tempering_try_swap(chain);
+        }
+        // Progress, about once a second.
+        if ( chain->id == 0 && chain->num_proposals % 256 == 0 ) {
+            uint64_t now_us = evolve_time_us();
+            if ( now_us - last_log_us > 1000000 ) {
+                last_log_us = now_us;
+                sgl_log("Proposal %" PRId64 " Chain 0 T: %f Fitness: %f Best: %f\n",
+                        chain->num_proposals, temperature, chain->fitness, chain->best.fitness);
+            }
+        }
+    }
+
+    sgl_semaphore_signal(t->done_semaphore);
+}
+
+// Runs params->num_chains annealing chains in parallel and returns the best
+// element found. fitness_ctx->base_state must have been through
+// dje_delta_prepare. If writer is not NULL, every new best element of any
+// chain is posted to it.
+//
+// Memory for every chain is taken from arena.
+PopulationElement tempering_evolve(TemperingParams* params, FitnessContext* fitness_ctx,
+                                   Arena* arena, BestWriter* writer, uint64_t seed)
+{
+    int num_chains = params->num_chains;
+
+    Tempering t = {0};
+    t.params = params;
+    t.fitness_ctx = fitness_ctx;
+    t.chains = sgl_calloc(sizeof(TemperingChain), num_chains);
+    t.ladder = sgl_calloc(sizeof(int), num_chains);
+    t.mutex = sgl_create_mutex();
+    t.done_semaphore = sgl_create_semaphore(0);
+    t.writer = writer;
+    t.best_mutex = sgl_create_mutex();
+    t.best_fitness = FLT_MAX;
+
+    // Chains start from the same kind of random tables as the GA. Element 0
+    // is the all-ones table, the worst possible start, so it is skipped.
+    Population start = population_init(arena, num_chains + 1);
+    fill_initial_population(&start, num_chains + 1, seed);
+
+    size_t chain_memory = arena_available_space(arena) / num_chains;
+    double ratio = (num_chains > 1) ?
+            pow(params->max_temperature / params->min_temperature, 1.0 / (num_chains - 1)) : 1.0;
+
+    for ( int i = 0; i < num_chains; ++i ) {
+        TemperingChain* chain = &t.chains[i];
+        chain->id = i;
+        chain->tempering = &t;
+        chain->arena = arena_push(arena, chain_memory);
+        chain->rng = ga_rng_key(seed, GA_STREAM_TEMPERING, (uint32_t)i);
+        chain->rung = i;
+        chain->temperature = (float)(params->min_temperature * pow(ratio, i));
+        t.ladder[i] = i;
+
+        uint8_t* table = start.tables[i + 1];
+        dje_delta_init(&fitness_ctx->base_state, &chain->cache, &chain->arena, table);
+        EvalResult result = { chain->cache.bit_count, chain->cache.mse_total };
+        chain->fitness = fitness_from_result(fitness_ctx, &result);
+        memcpy(chain->best.table, table, 64);
+        chain->best.fitness = chain->fitness;
+    }
+
+    t.begin_us = evolve_time_us();
+    for ( int i = 0; i < num_chains; ++i ) {
+        sgl_create_thread(tempering_thread, &t.chains[i]);
+    }
+    for ( int i = 0; i < num_chains; ++i ) {
+        sgl_semaphore_wait(t.done_semaphore);
+    }
+
+    PopulationElement winner = t.chains[0].best;
+    int64_t num_proposals = 0;
+    for ( int i = 0; i < num_chains; ++i ) {
+        TemperingChain* chain = &t.chains[i];
+        sgl_log("Chain %d T: %f Fitness: %f Best: %f Accepted: %" PRId64 "/%" PRId64 "\n",
+                i, chain->temperature, chain->fitness, chain->best.fitness,
+                chain->num_accepted, chain->num_proposals);
+        num_proposals += chain->num_proposals;
+        if ( chain->best.fitness < winner.fitness ) {
+            winner = chain->best;
+        }
+    }
+    sgl_log("Parallel tempering: %" PRId64 " proposals, %" PRId64 "/%" PRId64 " swaps accepted. Best fitness: %f\n",
+            num_proposals, t.num_swaps_accepted, t.num_swaps, winner.fitness);
+
+    sgl_free(t.chains);
+    sgl_free(t.ladder);
+    sgl_destroy_mutex(t.best_mutex);
+    sgl_destroy_mutex(t.mutex);
+    sgl_destroy_semaphore(t.done_semaphore);
+
+    return winner;
+}
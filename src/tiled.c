@@ -0,0 +1,104 @@
+/**
+ * tiled.c
+ *
+ *  Evaluation for images too large to hold as blocks.
+ *
+ *  The image is cut in horizontal strips of whole block rows. For every
+ *  strip, the blocks are extracted from the image source into one
+ *  strip-sized buffer, and every table of the batch is encoded against
+ *  them, adding up bit counts and errors per table. The blocks of the whole
+ *  image never exist at once, so memory is bounded by the strip size, and
+ *  each strip is extracted once per batch instead of once per table.
+ *
+ *  Headers and EOI are counted once per table, as a whole-image encode
+ *  would, so results are the same as with dje_encode_main.
+ */
+
+typedef struct
+{
+    int     strip_rows;  // Pixel rows per strip. Rounded up to whole blocks. 0 means "off".
+} TiledParams;
+
+typedef struct Tiled_s
+{
+    TiledParams     params;
+    ImageSource*    source;
+    DJEState*       base_state;  // From dje_init without blocks.
+    int             num_threads;
+
+    int             blocks_per_row;
+    int             num_block_rows;
+    int             strip_block_rows;
+    DJEBlock*       strip_blocks;  // [blocks_per_row * strip_block_rows]
+    SglSemaphore*   done_semaphore;
+
+    int64_t         num_strips;  // Strips extracted so far.
+} Tiled;
+
+TiledParams tiled_default_params()
+{
+    TiledParams params = {0};
+    params.strip_rows = 0;
+    return params;
+}
+
+void tiled_init(Tiled* tiled, TiledParams* params, Arena* arena, ImageSource* source,
+                DJEState* base_state, int num_threads)
+{
+    memset(tiled, 0, sizeof(Tiled));
+    tiled->params = *params;
+    tiled->source = source;
+    tiled->base_state = base_state;
+    tiled->num_threads = num_threads;
+    tiled->blocks_per_row = (source->image.width + 7) / 8;
+    tiled->num_block_rows = (source->image.height + 7) / 8;
+    tiled->strip_block_rows = (params->strip_rows + 7) / 8;
+    if ( tiled->strip_block_rows < 1 ) {
+        tiled->strip_block_rows = 1;
+    }
+    if ( tiled->strip_block_rows > tiled->num_block_rows ) {
+        tiled->strip_block_rows = tiled->num_block_rows;
+    }
+    // Aligned to a cache line, like the blocks of dje_init.
+    size_t num_blocks = (size_t)tiled->blocks_per_row * tiled->strip_block_rows;
+    DJEBlock* blocks = arena_alloc_array(arena, num_blocks + 1, DJEBlock);
+    tiled->strip_blocks = (DJEBlock*)(((uintptr_t)blocks + sizeof(DJEBlock) - 1) &
+                                      ~(uintptr_t)(sizeof(DJEBlock) - 1));
+    tiled->done_semaphore = sgl_create_semaphore(0);
+    sgl_log("Tiled: %d strips of %d block rows, %zu KB of blocks.\n",
+            (tiled->num_block_rows + tiled->strip_block_rows - 1) / tiled->strip_block_rows,
+            tiled->strip_block_rows, num_blocks * sizeof(DJEBlock) / 1024);
+}
+
+// Encodes count tables against the whole image, a strip at a time.
+void tiled_encode(Tiled* tiled, uint8_t (*tables)[64], int count, EvalResult* results)
+{
+    ImageSource* source = tiled->source;
+    DJEState* base_state = tiled->base_state;
+    // The prelude counted the headers. Each encode below counts an EOI.
+    for ( int i = 0; i < count; ++i ) {
+        results[i].bit_count = base_state->bit_count + 16;
+        results[i].mse = 0;
+    }
+    for ( int row = 0; row < tiled->num_block_rows; row += tiled->strip_block_rows ) {
+        int row_end = row + tiled->strip_block_rows;
+        if ( row_end > tiled->num_block_rows ) {
+            row_end = tiled->num_block_rows;
+        }
+        dje_extract_blocks(&source->image, tiled->strip_blocks, row, row_end,
+                           tiled->num_threads, tiled->done_semaphore);
+        ++tiled->num_strips;
+
+        for ( int i = 0; i < count; ++i ) {
+            // On the CPU, dje_encode_main allocates nothing.
+            DJEState state = *base_state;
+            state.y_blocks = tiled->strip_blocks;
+            state.num_blocks = (row_end - row) * tiled->blocks_per_row;
+            state.dct_blocks = NULL;
+            state.bit_count = 0;
+            dje_encode_main(&state, NULL, tables[i]);
+            results[i].bit_count += state.bit_count - 16;
+            results[i].mse += state.mse;
+        }
+    }
+}